@@ -7,6 +7,9 @@
 #include <boost/bind.hpp>
 #include <time.h>
 #include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 
 
 #ifdef __MACH__
@@ -16,6 +19,8 @@
 
 using namespace es3;
 
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
 int current_utc_time(struct timespec *ts) 
 {
 #ifdef __MACH__ // OS X does not have clock_gettime, use clock_get_time
@@ -36,18 +41,65 @@ int current_utc_time(struct timespec *ts)
 
 agenda::agenda(size_t num_unbound, size_t num_cpu_bound, size_t num_io_bound,
 			   bool quiet, bool final_quiet,
-			   size_t segment_size, size_t max_segments_in_flight) :
+			   size_t segment_size, size_t max_segments_in_flight,
+			   bool huge_pages) :
 	quiet_(quiet), final_quiet_(final_quiet), segment_size_(segment_size),
 	max_segments_in_flight_(max_segments_in_flight),
-	num_working_(), num_submitted_(), num_done_(), num_failed_(),
-	segments_in_flight_()
+	num_shards_(num_unbound+num_cpu_bound+num_io_bound),
+	next_shard_(0), num_pending_(0), num_working_(0), num_unfinished_(0),
+	segments_in_flight_(0), epoch_(0), num_sleepers_(0),
+	num_submitted_(0), num_done_(0), num_failed_(0),
+	huge_pages_(huge_pages), pool_hits_(0), pool_misses_(0)
 {
 	class_limits_[taskUnbound]=num_unbound;
 	class_limits_[taskCPUBound]=num_cpu_bound;
 	class_limits_[taskIOBound]=num_io_bound;
+	for(int f=0;f<TASK_CLASSES_NUM;++f)
+		classes_[f]=0;
+
+	if (num_shards_==0)
+		num_shards_=1;
+	shards_.reset(new task_shard[num_shards_]);
 	current_utc_time(&start_time_) | libc_die2("Can't get time");
 }
 
+agenda::~agenda()
+{
+	for(auto iter=pool_.begin();iter!=pool_.end();++iter)
+		delete *iter;
+}
+
+segment_buffer::~segment_buffer()
+{
+	free(buf_);
+}
+
+void segment_buffer::reserve(size_t sz)
+{
+	if (sz<=capacity_)
+		return;
+
+	size_t align=huge_pages_? HUGE_PAGE_SIZE : size_t(getpagesize());
+	size_t new_cap=(sz+align-1)/align*align;
+	void *res=0;
+	if (posix_memalign(&res, align, new_cap))
+		err(errFatal) << "Failed to allocate a segment of " << new_cap
+					  << " bytes";
+#ifdef MADV_HUGEPAGE
+	if (huge_pages_)
+		madvise(res, new_cap, MADV_HUGEPAGE); //It's only a hint
+#endif
+	if (size_)
+		memcpy(res, buf_, size_);
+	free(buf_);
+	buf_=reinterpret_cast<char*>(res);
+	capacity_=new_cap;
+}
+
+//The shard of the worker thread that is running the current task (if any)
+static __thread agenda *current_agenda=0;
+static __thread size_t current_shard=0;
+
 namespace es3
 {
 	struct segment_deleter
@@ -56,119 +108,104 @@ namespace es3
 
 		void operator()(segment *seg)
 		{
-			delete seg;
+			parent_->release_segment(seg);
 
-			u_guard_t guard(parent_->m_);
-			guard.lock();
 			assert(parent_->segments_in_flight_>0);
 			parent_->segments_in_flight_--;
-			parent_->condition_.notify_one();
+			parent_->wake(false);
 		}
 	};
 
 	class task_executor
 	{
 		agenda_ptr agenda_;
+		size_t shard_;
 	public:
-		task_executor(agenda_ptr agenda) : agenda_(agenda) {}
+		task_executor(agenda_ptr agenda, size_t shard) :
+			agenda_(agenda), shard_(shard) {}
 
-		std::pair<sync_task_ptr, std::vector<segment_ptr> > claim_task()
+		std::pair<sync_task_ptr, std::vector<segment_ptr> > try_claim()
 		{
 			std::pair<sync_task_ptr, std::vector<segment_ptr> > res_pair;
-			while(true)
+
+			//Iterate over classes to find one that is not yet full
+			for(int c=0;c<TASK_CLASSES_NUM;++c)
 			{
-				u_guard_t lock(agenda_->m_);
-				lock.lock();
-				if (agenda_->tasks_.empty())
+				task_type_e cur_class=task_type_e(c);
+				if (!agenda_->reserve_class(cur_class))
+					continue; //Too busy
+
+				//Our own queue first, then try to steal from the others
+				sync_task_ptr res;
+				for(size_t f=0;f<agenda_->num_shards_ && !res;++f)
 				{
-					if (agenda_->num_working_==0)
-						return res_pair;
-					agenda_->condition_.wait(lock);
-					continue;
+					size_t shard=(shard_+f)%agenda_->num_shards_;
+					res=agenda_->take_from(shard, cur_class, f!=0);
 				}
 
-				//Iterate over classes to find one that is not yet full
-				for(auto iter=agenda_->classes_.begin();
-					iter!=agenda_->classes_.end();++iter)
+				if (!res)
 				{
-					//Check if there are too many tasks of this type running
-					task_type_e cur_class=iter->first;
-
-					size_t cur_num=iter->second;
-					size_t limit=agenda_->get_capability(cur_class);
-					//Unbound tasks are allowed to exceed their limits and
-					//borrow threads from other classes
-//					if (cur_class!=taskUnbound && limit<=cur_num)
-//						continue; //Too busy
-					if (limit<=cur_num)
-						continue;
-
-					size_t segments_avail=agenda_->max_segments_in_flight_-
-							agenda_->segments_in_flight_;
-
-					//Good! We can work on this class.
-					//Find the task with the greatest segment requirements
-					agenda::size_map_t::iterator pair=
-							--agenda_->tasks_.end();
-					size_t segments_needed=pair->first;
-					if (segments_needed>segments_avail)
-					{
-						//Try the task with the least number of required segs
-						pair=agenda_->tasks_.begin();
-						segments_needed=pair->first;
-						if (segments_needed>segments_avail)
-							continue; //No such luck :(
-					}
+					agenda_->classes_[c]--;
+					continue;
+				}
 
-					if (!pair->second.count(cur_class))
-						continue; //No tasks for this class
+				res_pair.first=res;
+				if (res->needs_segments())
+					res_pair.second=agenda_->get_segments(
+								res->needs_segments());
+				return res_pair;
+			}
 
-					agenda::task_map_t &task_map=pair->second.at(cur_class);
-					assert(!task_map.empty());
-					sync_task_ptr res=task_map.begin()->second;
-					task_map.erase(task_map.begin());
-					if (task_map.empty())
-					{
-						pair->second.erase(cur_class);
-						if (pair->second.empty())
-							agenda_->tasks_.erase(pair->first);
-					}
+			return res_pair;
+		}
 
-					agenda_->num_working_++;
-					agenda_->classes_[cur_class]++;
+		std::pair<sync_task_ptr, std::vector<segment_ptr> > claim_task()
+		{
+			while(true)
+			{
+				uint64_t seen=agenda_->epoch_;
+				std::pair<sync_task_ptr, std::vector<segment_ptr> > res_pair=
+						try_claim();
+				if (res_pair.first)
+					return res_pair;
 
-					res_pair.first=res;
-					if (segments_needed)
-						res_pair.second=agenda_->get_segments(segments_needed);
+				if (agenda_->num_unfinished_==0)
+				{
+					agenda_->wake(true); //We've finished our tasks!
 					return res_pair;
 				}
 
-				agenda_->condition_.wait(lock);
+				//Nothing to do right now - sleep until something changes
+				u_guard_t lock(agenda_->idle_m_);
+				agenda_->num_sleepers_++;
+				while(agenda_->epoch_==seen)
+					agenda_->condition_.wait(lock);
+				agenda_->num_sleepers_--;
 			}
 		}
 
 		void cleanup(sync_task_ptr cur_task, bool fail)
 		{
-			u_guard_t lock(agenda_->m_);
-			lock.lock();
-			agenda_->num_working_--;
-			assert(agenda_->classes_[cur_task->get_class()]>0);
-			agenda_->classes_[cur_task->get_class()]--;
-
-			if (agenda_->tasks_.empty() && agenda_->num_working_==0)
-				agenda_->condition_.notify_all(); //We've finished our tasks!
-			else
-				agenda_->condition_.notify_one();
-
 			//Update stats
-			guard_t lockst(agenda_->stats_m_);
 			agenda_->num_done_++;
 			if (fail)
 				agenda_->num_failed_++;
+
+			assert(agenda_->classes_[cur_task->get_class()]>0);
+			agenda_->classes_[cur_task->get_class()]--;
+			agenda_->num_working_--;
+
+			if (--agenda_->num_unfinished_==0)
+				agenda_->wake(true); //We've finished our tasks!
+			else
+				agenda_->wake(false);
 		}
 
 		void operator ()()
 		{
+			current_agenda=agenda_.get();
+			current_shard=shard_;
+
 			while(true)
 			{
 				std::pair<sync_task_ptr, std::vector<segment_ptr> > cur_task;
@@ -177,7 +214,7 @@ namespace es3
 					break;
 
 				bool fail=true;
-				for(int f=0; f<10; ++f)
+				for(int f=0; f<MAX_TASK_ATTEMPTS; ++f)
 				{
 					try
 					{
@@ -190,12 +227,12 @@ namespace es3
 						if (code.code()==errNone)
 						{
 							VLOG(2) << "INFO: " << ex.what();
-							sleep(5);
+							sleep(TASK_RETRY_DELAY);
 							continue;
 						} else if (code.code()==errWarn)
 						{
 							VLOG(1) << "WARN: " << ex.what();
-							sleep(5);
+							sleep(TASK_RETRY_DELAY);
 							continue;
 						} else
 						{
@@ -213,46 +250,183 @@ namespace es3
 					}
 				}
 
+				//Release the segments before the task slot is freed
+				cur_task.second.clear();
 				cleanup(cur_task.first, fail);
 			}
+
+			current_agenda=0;
 		}
 	};
 }
 
+bool agenda::reserve_class(task_type_e cls)
+{
+	size_t limit=get_capability(cls);
+	size_t cur=classes_[cls];
+	while(cur<limit)
+	{
+		if (classes_[cls].compare_exchange_weak(cur, cur+1))
+			return true;
+	}
+	return false;
+}
+
+bool agenda::reserve_segments(size_t num)
+{
+	size_t cur=segments_in_flight_;
+	while(cur+num<=max_segments_in_flight_)
+	{
+		if (segments_in_flight_.compare_exchange_weak(cur, cur+num))
+			return true;
+	}
+	return false;
+}
+
+sync_task_ptr agenda::take_from(size_t shard, task_type_e cls, bool steal)
+{
+	task_shard &cur=shards_[shard];
+	if (cur.counts_[cls]==0)
+		return sync_task_ptr(); //Fast path - nothing to see here
+
+	guard_t lock(cur.m_);
+	sync_task_ptr res;
+	std::deque<sync_task_ptr> &plain=cur.plain_[cls];
+	std::deque<sync_task_ptr> &segmented=cur.segmented_[cls];
+	if (!plain.empty())
+	{
+		if (steal)
+		{
+			res=plain.back();
+			plain.pop_back();
+		} else
+		{
+			res=plain.front();
+			plain.pop_front();
+		}
+	} else if (!segmented.empty())
+	{
+		//Tasks with segments are always taken in order, so that the
+		//earlier parts of a file are not starved by the later ones
+		if (!reserve_segments(segmented.front()->needs_segments()))
+			return res;
+		res=segmented.front();
+		segmented.pop_front();
+	} else
+		return res;
+
+	//The order is important - a task must be counted as working
+	//before it stops being pending, see claim_task()
+	num_working_++;
+	num_pending_--;
+	cur.counts_[cls]--;
+	return res;
+}
+
+void agenda::wake(bool all)
+{
+	epoch_++;
+	if (num_sleepers_==0)
+		return;
+
+	guard_t lock(idle_m_);
+	if (all)
+		condition_.notify_all();
+	else
+		condition_.notify_one();
+}
+
 std::vector<segment_ptr> agenda::get_segments(size_t num)
 {
-	assert(segments_in_flight_+num<=max_segments_in_flight_);
+	assert(segments_in_flight_<=max_segments_in_flight_);
 
 	std::vector<segment_ptr> res;
 	res.reserve(num);
 	for(size_t f=0;f<num;++f)
 	{
+		segment *cur=0;
+		{
+			guard_t lock(pool_m_);
+			if (!pool_.empty())
+			{
+				cur=pool_.back();
+				pool_.pop_back();
+			}
+		}
+
+		if (cur)
+			pool_hits_++;
+		else
+		{
+			pool_misses_++;
+			cur=new segment(huge_pages_);
+			cur->data_.reserve(segment_size_);
+		}
+
 		segment_deleter del {shared_from_this()};
-		segment_ptr seg=segment_ptr(new segment(), del);
-		res.push_back(seg);
+		res.push_back(segment_ptr(cur, del));
 	}
-	segments_in_flight_+=num;
 	return res;
 }
 
-void agenda::schedule(sync_task_ptr task)
+void agenda::release_segment(segment *seg)
 {
-	u_guard_t lock(m_);
-	lock.lock();
-//	agenda_ptr ptr = shared_from_this();
-
-//	auto iter=std::lower_bound(tasks_.begin(), tasks_.end(), task);
-//	if (iter!=tasks_.end())
-//		tasks_.insert(iter, task);
-//	else
-//		tasks_.push_back(task);
-	classes_[task->get_class()]; //Force insertion of class entry
-	task_map_t &task_map=tasks_[task->needs_segments()][task->get_class()];
-	task_map.insert(std::make_pair(task->ordinal(), task));
-	condition_.notify_one();
+	seg->data_.clear();
+	guard_t lock(pool_m_);
+	//The pool never holds more than the in-flight limit
+	if (pool_.size()>=max_segments_in_flight_)
+		delete seg;
+	else
+		pool_.push_back(seg);
+}
 
-	guard_t lockst(stats_m_);
+void agenda::schedule(sync_task_ptr task)
+{
+	//Keep the task local to the worker that has spawned it, external
+	//threads spread their tasks around
+	size_t shard;
+	if (current_agenda==this)
+		shard=current_shard;
+	else
+		shard=(next_shard_++)%num_shards_;
+
+	task_type_e cls=task->get_class();
+	task_shard &cur=shards_[shard];
+	{
+		guard_t lock(cur.m_);
+		if (task->needs_segments())
+			cur.segmented_[cls].push_back(task);
+		else
+			cur.plain_[cls].push_back(task);
+		num_unfinished_++;
+		num_pending_++;
+		cur.counts_[cls]++;
+	}
 	num_submitted_++;
+	wake(false);
+}
+
+void agenda::begin_async()
+{
+	num_unfinished_++;
+}
+
+void agenda::end_async(sync_task_ptr task, const result_code_t &res,
+					   size_t attempt)
+{
+	//The retry is scheduled first, so the agenda can't run dry
+	if (res.code()==errFatal || (!res.ok() && attempt+1>=MAX_TASK_ATTEMPTS))
+	{
+		VLOG(0) << res.desc();
+		num_failed_++;
+	} else if (!res.ok())
+	{
+		VLOG(1) << "WARN: " << res.desc();
+		schedule(task);
+	}
+
+	if (--num_unfinished_==0)
+		wake(true); //We've finished our tasks!
 }
 
 typedef boost::shared_ptr<boost::thread> thread_ptr_t;
@@ -265,7 +439,8 @@ size_t agenda::run()
 		thread_num+=iter->second;
 
 	for(int f=0;f<thread_num;++f)
-		threads.push_back(thread_ptr_t(new boost::thread(task_executor(shared_from_this()))));
+		threads.push_back(thread_ptr_t(new boost::thread(
+			task_executor(shared_from_this(), f%num_shards_))));
 
 	if (!quiet_)
 	{
@@ -296,11 +471,8 @@ void agenda::draw_progress()
 {
 	while(true)
 	{
-		{
-			guard_t g(m_);
-			if (num_working_==0 && tasks_.empty())
-				return;
-		}
+		if (num_unfinished_==0)
+			return;
 		draw_progress_widget();
 		usleep(500000);
 	}
@@ -342,12 +514,12 @@ void agenda::draw_progress_widget()
 
 	std::stringstream str;
 	{
-		guard_t lockst(stats_m_);
 		str << "Tasks: [" << num_done_ << "/" << num_submitted_
 			<< "]";
 		if (num_failed_)
 			str << " Failed tasks: " << num_failed_;
 
+		guard_t lockst(stats_m_);
 		uint64_t uploaded = cur_stats_["uploaded"];
 		uint64_t downloaded = cur_stats_["downloaded"];
 		if (downloaded)
@@ -366,6 +538,10 @@ void agenda::draw_progress_widget()
 				<< ul.first << " " << ul.second << ", speed: "
 				<< us.first << " " << us.second << "/sec";
 		}
+		uint64_t files_uploaded = cur_stats_["files_uploaded"];
+		if (files_uploaded)
+			str << "  Files: " << files_uploaded << ", "
+				<< (el==0? 0 : files_uploaded*1000/el) << "/sec";
 
 		str << "\r";
 	}
@@ -396,27 +572,47 @@ void agenda::draw_stats()
 		uint64_t val=f->second;
 		if (!val) continue;
 
+		if (name.compare(0, 6, "files_")==0)
+		{
+			//Counted in files, not in bytes
+			std::cerr << name << ": " << val
+					  << ", average [files/sec]: "
+					  << val*1000/el << std::endl;
+			continue;
+		}
+
 		uint64_t avg = val*1000/el;
 
 		std::cerr << name << " [B]: " << val
 				  << ", average [B/sec]: " << avg
 				  << std::endl;
 	}
+
+	uint64_t hits=pool_hits_, total=pool_hits_+pool_misses_;
+	if (total)
+		std::cerr << "segment pool hit rate [%]: " << hits*100/total
+				  << " (" << hits << " of " << total << ")" << std::endl;
 }
 
 void agenda::print_queue()
 {
-	std::cerr << "There are " << tasks_.size() << " task[s] present.\n";
-	for(auto by_segs=tasks_.begin();by_segs!=tasks_.end();++by_segs)
+	std::cerr << "There are " << num_pending_ << " task[s] present.\n";
+	for(size_t f=0;f<num_shards_;++f)
 	{
-		for(auto iter=by_segs->second.begin();
-			iter!=by_segs->second.end(); ++iter)
+		task_shard &cur=shards_[f];
+		guard_t lock(cur.m_);
+		for(int c=0;c<TASK_CLASSES_NUM;++c)
 		{
-			for(auto iter2=iter->second.begin();
-				iter2!=iter->second.end();++iter2)
+			for(auto iter=cur.plain_[c].begin();
+				iter!=cur.plain_[c].end(); ++iter)
+			{
+				(*iter)->print_to(std::cerr);
+				std::cerr<<std::endl;
+			}
+			for(auto iter=cur.segmented_[c].begin();
+				iter!=cur.segmented_[c].end(); ++iter)
 			{
-				sync_task_ptr task=iter2->second;
-				task->print_to(std::cerr);
+				(*iter)->print_to(std::cerr);
 				std::cerr<<std::endl;
 			}
 		}
@@ -2,19 +2,64 @@
 #define AGENDA_H
 
 #include "common.h"
+#include "errors.h"
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/scoped_array.hpp>
 //#include <condition_variable>
+#include <atomic>
+#include <deque>
 
 #define MIN_SEGMENT_SIZE (6*1024*1024)
 #define MAX_IN_FLIGHT 200
+//Parts that are streamed to or from a file keep it open while they're
+//in the transfer engine, past this many the workers wait for them
+#define MAX_ASYNC_FILE_PARTS 64
+//A failing task is tried this many times, with a pause in between
+#define MAX_TASK_ATTEMPTS 10
+#define TASK_RETRY_DELAY 5
 
 namespace es3 {
 	class agenda;
 	typedef boost::shared_ptr<agenda> agenda_ptr;
 
+	/**
+	  Raw page-aligned buffer. Unlike std::vector it never initializes
+	  its contents and keeps its memory when shrunk, so that it can be
+	  reused for the next segment.
+	  */
+	class segment_buffer
+	{
+		char *buf_;
+		size_t size_, capacity_;
+		bool huge_pages_;
+	public:
+		segment_buffer(bool huge_pages)
+			: buf_(), size_(), capacity_(), huge_pages_(huge_pages) {}
+		~segment_buffer();
+
+		void reserve(size_t sz);
+		void resize(size_t sz)
+		{
+			if (sz>capacity_)
+				reserve(sz);
+			size_=sz;
+		}
+		void clear() { size_=0; }
+
+		size_t size() const { return size_; }
+		size_t capacity() const { return capacity_; }
+		char* data() { return buf_; }
+		char& operator[](size_t pos) { return buf_[pos]; }
+		const char& operator[](size_t pos) const { return buf_[pos]; }
+	private:
+		segment_buffer(const segment_buffer &);
+	};
+
 	struct segment
 	{
-		std::vector<char> data_;
+		segment_buffer data_;
+
+		segment(bool huge_pages) : data_(huge_pages) {}
 	};
 	typedef boost::shared_ptr<segment> segment_ptr;
 
@@ -24,6 +69,7 @@ namespace es3 {
 		taskCPUBound,
 		taskIOBound,
 	};
+	#define TASK_CLASSES_NUM 3
 
 	class sync_task
 	{
@@ -52,6 +98,26 @@ namespace es3 {
 		return p1->ordinal() < p2->ordinal();
 	}
 
+	/**
+	  Per-worker task queue. The owning worker takes tasks from the front,
+	  other workers steal from the back. Counters are readable without
+	  the lock so that empty shards can be skipped cheaply.
+	  */
+	struct task_shard
+	{
+		mutex_t m_; //This mutex protects the following data {
+		std::deque<sync_task_ptr> plain_[TASK_CLASSES_NUM];
+		std::deque<sync_task_ptr> segmented_[TASK_CLASSES_NUM];
+		//}
+		std::atomic<size_t> counts_[TASK_CLASSES_NUM];
+
+		task_shard()
+		{
+			for(int f=0;f<TASK_CLASSES_NUM;++f)
+				counts_[f]=0;
+		}
+	};
+
 	class agenda : public boost::enable_shared_from_this<agenda>
 	{
 		std::map<task_type_e, size_t> class_limits_;
@@ -59,28 +125,45 @@ namespace es3 {
 		const bool quiet_, final_quiet_;
 		struct timespec start_time_;
 
-		mutex_t m_; //This mutex protects the following data {
+		size_t num_shards_;
+		boost::scoped_array<task_shard> shards_;
+		std::atomic<size_t> next_shard_;
+
+		//Scheduler state, all lock-free
+		std::atomic<size_t> classes_[TASK_CLASSES_NUM];
+		std::atomic<size_t> num_pending_, num_working_;
+		//Pending, working and asynchronous tasks, the agenda is done
+		//once it drops to zero
+		std::atomic<size_t> num_unfinished_;
+		std::atomic<size_t> segments_in_flight_;
+
+		//Idle workers sleep here until the epoch changes
+		mutex_t idle_m_;
 		boost::condition_variable condition_;
-		typedef std::multimap<int64_t, sync_task_ptr> task_map_t;
-		typedef std::map<task_type_e, task_map_t> task_by_class_t;
-		typedef std::map<size_t, task_by_class_t> size_map_t;
-		std::map<size_t, task_by_class_t> tasks_;
-		std::map<task_type_e, size_t> classes_;
-		size_t num_working_;
-		size_t segments_in_flight_;
-		//}
+		std::atomic<uint64_t> epoch_;
+		std::atomic<size_t> num_sleepers_;
+
+		std::atomic<size_t> num_submitted_, num_done_, num_failed_;
 
 		mutex_t stats_m_; //This mutex protects the following data {
-		size_t num_submitted_, num_done_, num_failed_;
 		std::map<std::string, std::pair<uint64_t, uint64_t> > progress_;
 		std::map<std::string, uint64_t> cur_stats_;
 		//}
 
+		//Released segments are kept here for reuse
+		const bool huge_pages_;
+		mutex_t pool_m_; //This mutex protects the following data {
+		std::vector<segment*> pool_;
+		//}
+		std::atomic<uint64_t> pool_hits_, pool_misses_;
+
 		friend struct segment_deleter;
 	public:
 		agenda(size_t num_unbound, size_t num_cpu_bound,
 			   size_t num_io_bound, bool quiet, bool final_quiet,
-			   size_t def_segment_size, size_t max_segments_in_flight_);
+			   size_t def_segment_size, size_t max_segments_in_flight_,
+			   bool huge_pages=false);
+		~agenda();
 
 		size_t get_capability(task_type_e tp) const
 		{
@@ -89,6 +172,20 @@ namespace es3 {
 		void schedule(sync_task_ptr task);
 		size_t run();
 
+		/**
+		  Keeps the agenda running while a task waits for its request
+		  in the transfer engine after its operator() has returned.
+		  Each call must be paired with end_async().
+		  */
+		void begin_async();
+		/**
+		  Finishes the asynchronous part of a task. If it has failed
+		  with a transient error and has been tried fewer than
+		  MAX_TASK_ATTEMPTS times, the task is scheduled again.
+		  */
+		void end_async(sync_task_ptr task, const result_code_t &res,
+					   size_t attempt);
+
 		void add_stat_counter(const std::string &stat, uint64_t val);
 
 		size_t max_in_flight() const { return max_segments_in_flight_; }
@@ -96,9 +193,14 @@ namespace es3 {
 
 		void print_queue();
 		void print_epilog();
-		size_t tasks_count() const { return tasks_.size(); }
+		size_t tasks_count() const { return num_pending_; }
 	private:
 		std::vector<segment_ptr> get_segments(size_t num);
+		void release_segment(segment *seg);
+		bool reserve_segments(size_t num);
+		bool reserve_class(task_type_e cls);
+		sync_task_ptr take_from(size_t shard, task_type_e cls, bool steal);
+		void wake(bool all);
 
 		void draw_progress();
 		void draw_progress_widget();
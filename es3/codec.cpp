@@ -0,0 +1,485 @@
+#include "codec.h"
+#include "errors.h"
+
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+using namespace es3;
+
+#define GZIP_DEFAULT_LEVEL 1
+//LZ4 is fed in small pieces, so that its output bound stays tight
+#define LZ4_PIECE (64*1024)
+
+//Frame info is two little-endian 64 bit lengths tagged with "E3"
+#define INFO_LEN 16
+#define GZIP_EXTRA_LEN (4+INFO_LEN)
+#define GZIP_INFO_OFFSET 16 //Header, XLEN, subfield id and length
+#define SKIPPABLE_MAGIC 0x184D2A5E
+#define SKIPPABLE_LEN (8+INFO_LEN)
+
+static void put_le(char *p, uint64_t val, int bytes)
+{
+	for(int f=0;f<bytes;++f)
+		p[f]=char((val>>(f*8))&0xFF);
+}
+
+static uint64_t get_le(const char *p, int bytes)
+{
+	uint64_t res=0;
+	for(int f=bytes-1;f>=0;--f)
+		res=(res<<8) | uint8_t(p[f]);
+	return res;
+}
+
+static void put_info(char *p, uint64_t frame_len, uint64_t raw_len)
+{
+	put_le(p, frame_len, 8);
+	put_le(p+8, raw_len, 8);
+}
+
+//Skippable frames are understood by both ZSTD and LZ4 decoders
+static size_t put_skippable(char *out, size_t avail)
+{
+	if (avail<SKIPPABLE_LEN)
+		err(errFatal) << "No room for the frame info";
+	put_le(out, SKIPPABLE_MAGIC, 4);
+	put_le(out+4, INFO_LEN, 4);
+	put_info(out+8, 0, 0);
+	return SKIPPABLE_LEN;
+}
+
+bool es3::read_frame_info(codec_type_e codec, const char *frame, size_t len,
+						  uint64_t *frame_len, uint64_t *raw_len)
+{
+	const char *info=0;
+	if (codec==codecGzip)
+	{
+		//ID1, ID2, deflate method and the FEXTRA flag
+		if (len<GZIP_INFO_OFFSET+INFO_LEN || uint8_t(frame[0])!=0x1F ||
+				uint8_t(frame[1])!=0x8B || (frame[3] & 4)==0 ||
+				get_le(frame+10, 2)<GZIP_EXTRA_LEN ||
+				frame[12]!='E' || frame[13]!='3' ||
+				get_le(frame+14, 2)!=INFO_LEN)
+			return false;
+		info=frame+GZIP_INFO_OFFSET;
+	} else
+	{
+		if (len<SKIPPABLE_LEN || get_le(frame, 4)!=SKIPPABLE_MAGIC ||
+				get_le(frame+4, 4)!=INFO_LEN)
+			return false;
+		info=frame+8;
+	}
+
+	*frame_len=get_le(info, 8);
+	*raw_len=get_le(info+8, 8);
+	return *frame_len!=0;
+}
+
+codec_type_e es3::parse_codec(const std::string &name)
+{
+	if (name=="gzip")
+		return codecGzip;
+	if (name=="zstd")
+	{
+#ifdef HAVE_ZSTD
+		return codecZstd;
+#else
+		err(errFatal) << "ZSTD support is not compiled in";
+#endif
+	}
+	if (name=="lz4")
+	{
+#ifdef HAVE_LZ4
+		return codecLz4;
+#else
+		err(errFatal) << "LZ4 support is not compiled in";
+#endif
+	}
+	err(errFatal) << "Unknown codec: " << name;
+	return codecGzip;
+}
+
+std::string es3::codec_name(codec_type_e codec)
+{
+	switch(codec)
+	{
+		case codecZstd: return "zstd";
+		case codecLz4: return "lz4";
+		default: return "gzip";
+	}
+}
+
+namespace es3
+{
+	class gzip_encoder : public block_encoder
+	{
+		z_stream stream_;
+		gz_header header_;
+		char extra_[GZIP_EXTRA_LEN];
+	public:
+		gzip_encoder(int level)
+		{
+			stream_=z_stream();
+			if (deflateInit2(&stream_, level ? level : GZIP_DEFAULT_LEVEL,
+							 Z_DEFLATED,
+							 15|16, //15 window bits | GZIP
+							 8, Z_DEFAULT_STRATEGY)!=Z_OK)
+				err(errFatal) << "Failed to initialize GZIP compressor";
+
+			//The lengths are patched in by seal()
+			extra_[0]='E';
+			extra_[1]='3';
+			put_le(extra_+2, INFO_LEN, 2);
+			put_info(extra_+4, 0, 0);
+			header_=gz_header();
+			header_.os=3; //Unix
+			header_.extra=(Bytef*)extra_;
+			header_.extra_len=GZIP_EXTRA_LEN;
+			deflateSetHeader(&stream_, &header_);
+		}
+		~gzip_encoder()
+		{
+			deflateEnd(&stream_);
+		}
+
+		virtual size_t bound(size_t raw)
+		{
+			return deflateBound(&stream_, raw);
+		}
+
+		virtual size_t update(const char *in, size_t len,
+							  char *out, size_t avail)
+		{
+			stream_.next_in=(Bytef*)in;
+			stream_.avail_in=len;
+			stream_.next_out=(Bytef*)out;
+			stream_.avail_out=avail;
+			if (deflate(&stream_, Z_NO_FLUSH)!=Z_OK || stream_.avail_in!=0)
+				err(errFatal) << "GZIP compression failed";
+			return avail-stream_.avail_out;
+		}
+
+		virtual size_t finish(char *out, size_t avail)
+		{
+			stream_.next_in=0;
+			stream_.avail_in=0;
+			stream_.next_out=(Bytef*)out;
+			stream_.avail_out=avail;
+			if (deflate(&stream_, Z_FINISH)!=Z_STREAM_END)
+				err(errFatal) << "Failed to finish GZIP compression";
+			return avail-stream_.avail_out;
+		}
+
+		virtual void seal(char *frame, uint64_t frame_len, uint64_t raw_len)
+		{
+			put_info(frame+GZIP_INFO_OFFSET, frame_len, raw_len);
+		}
+	};
+
+	class gzip_decoder : public stream_decoder
+	{
+		z_stream stream_;
+	public:
+		gzip_decoder()
+		{
+			stream_=z_stream();
+			inflateInit2(&stream_, 15 | 16);
+		}
+		~gzip_decoder()
+		{
+			inflateEnd(&stream_);
+		}
+
+		virtual size_t decode(const char *&in, size_t &len,
+							  char *out, size_t avail)
+		{
+			size_t produced=0;
+			while(produced<avail)
+			{
+				stream_.next_in=(Bytef*)in;
+				stream_.avail_in=len;
+				stream_.next_out=(Bytef*)out+produced;
+				stream_.avail_out=avail-produced;
+				int res = inflate(&stream_, Z_SYNC_FLUSH);
+				if (res<0 && res!=Z_BUF_ERROR)
+					err(errFatal) << "GZ error, failed to decompress";
+
+				size_t used=len-stream_.avail_in;
+				size_t got=avail-produced-stream_.avail_out;
+				in+=used;
+				len-=used;
+				produced+=got;
+
+				if (res == Z_STREAM_END)
+				{
+					//For gzip files with concatenated content
+					inflateReset(&stream_);
+				} else if (used==0 && got==0)
+					break;
+			}
+			return produced;
+		}
+	};
+
+#ifdef HAVE_ZSTD
+	class zstd_encoder : public block_encoder
+	{
+		ZSTD_CCtx *ctx_;
+		bool started_;
+	public:
+		zstd_encoder(int level) : started_()
+		{
+			ctx_=ZSTD_createCCtx();
+			if (!ctx_)
+				err(errFatal) << "Failed to initialize ZSTD compressor";
+			if (level)
+				ZSTD_CCtx_setParameter(ctx_, ZSTD_c_compressionLevel, level);
+		}
+		~zstd_encoder()
+		{
+			ZSTD_freeCCtx(ctx_);
+		}
+
+		virtual size_t bound(size_t raw)
+		{
+			return SKIPPABLE_LEN+ZSTD_compressBound(raw);
+		}
+
+		virtual size_t update(const char *in, size_t len,
+							  char *out, size_t avail)
+		{
+			return do_compress(in, len, out, avail, ZSTD_e_continue);
+		}
+
+		virtual size_t finish(char *out, size_t avail)
+		{
+			return do_compress(0, 0, out, avail, ZSTD_e_end);
+		}
+
+		virtual void seal(char *frame, uint64_t frame_len, uint64_t raw_len)
+		{
+			put_info(frame+8, frame_len, raw_len);
+		}
+
+	private:
+		size_t do_compress(const char *in, size_t len,
+						   char *out, size_t avail, ZSTD_EndDirective mode)
+		{
+			size_t prefix=0;
+			if (!started_)
+			{
+				started_=true;
+				prefix=put_skippable(out, avail);
+			}
+
+			ZSTD_inBuffer input={in, len, 0};
+			ZSTD_outBuffer output={out+prefix, avail-prefix, 0};
+			while(true)
+			{
+				size_t res=ZSTD_compressStream2(ctx_, &output, &input, mode);
+				if (ZSTD_isError(res))
+					err(errFatal) << "ZSTD compression failed: "
+								  << ZSTD_getErrorName(res);
+				bool done=(mode==ZSTD_e_end)? res==0 : input.pos==input.size;
+				if (done)
+					break;
+				if (output.pos==output.size)
+					err(errFatal) << "ZSTD output doesn't fit the bound";
+			}
+			return prefix+output.pos;
+		}
+	};
+
+	class zstd_decoder : public stream_decoder
+	{
+		ZSTD_DStream *stream_;
+	public:
+		zstd_decoder()
+		{
+			stream_=ZSTD_createDStream();
+			if (!stream_)
+				err(errFatal) << "Failed to initialize ZSTD decompressor";
+		}
+		~zstd_decoder()
+		{
+			ZSTD_freeDStream(stream_);
+		}
+
+		virtual size_t decode(const char *&in, size_t &len,
+							  char *out, size_t avail)
+		{
+			//Concatenated and skippable frames are handled by ZSTD itself
+			ZSTD_inBuffer input={in, len, 0};
+			ZSTD_outBuffer output={out, avail, 0};
+			while(input.pos<input.size && output.pos<output.size)
+			{
+				size_t res=ZSTD_decompressStream(stream_, &output, &input);
+				if (ZSTD_isError(res))
+					err(errFatal) << "ZSTD error, failed to decompress: "
+								  << ZSTD_getErrorName(res);
+			}
+			//Flush the data buffered inside the decoder
+			if (input.pos==input.size && output.pos<output.size)
+				ZSTD_decompressStream(stream_, &output, &input);
+			in+=input.pos;
+			len-=input.pos;
+			return output.pos;
+		}
+	};
+#endif
+
+#ifdef HAVE_LZ4
+	class lz4_encoder : public block_encoder
+	{
+		LZ4F_cctx *ctx_;
+		LZ4F_preferences_t prefs_;
+		bool started_;
+	public:
+		lz4_encoder(int level) : started_()
+		{
+			prefs_=LZ4F_preferences_t();
+			prefs_.frameInfo.blockSizeID=LZ4F_max64KB;
+			prefs_.compressionLevel=level;
+			if (LZ4F_isError(LZ4F_createCompressionContext(
+								 &ctx_, LZ4F_VERSION)))
+				err(errFatal) << "Failed to initialize LZ4 compressor";
+		}
+		~lz4_encoder()
+		{
+			LZ4F_freeCompressionContext(ctx_);
+		}
+
+		virtual size_t bound(size_t raw)
+		{
+			return SKIPPABLE_LEN+LZ4F_compressFrameBound(raw, &prefs_)+
+					LZ4F_compressBound(LZ4_PIECE, &prefs_);
+		}
+
+		virtual size_t update(const char *in, size_t len,
+							  char *out, size_t avail)
+		{
+			size_t produced=start(out, avail);
+			while(len>0)
+			{
+				size_t piece=std::min(len, size_t(LZ4_PIECE));
+				produced+=checked(LZ4F_compressUpdate(ctx_, out+produced,
+					avail-produced, in, piece, NULL));
+				in+=piece;
+				len-=piece;
+			}
+			return produced;
+		}
+
+		virtual size_t finish(char *out, size_t avail)
+		{
+			size_t produced=start(out, avail);
+			return produced+checked(LZ4F_compressEnd(ctx_, out+produced,
+				avail-produced, NULL));
+		}
+
+		virtual void seal(char *frame, uint64_t frame_len, uint64_t raw_len)
+		{
+			put_info(frame+8, frame_len, raw_len);
+		}
+
+	private:
+		size_t start(char *out, size_t avail)
+		{
+			if (started_)
+				return 0;
+			started_=true;
+			size_t prefix=put_skippable(out, avail);
+			return prefix+checked(LZ4F_compressBegin(ctx_, out+prefix,
+				avail-prefix, &prefs_));
+		}
+
+		size_t checked(size_t res)
+		{
+			if (LZ4F_isError(res))
+				err(errFatal) << "LZ4 compression failed: "
+							  << LZ4F_getErrorName(res);
+			return res;
+		}
+	};
+
+	class lz4_decoder : public stream_decoder
+	{
+		LZ4F_dctx *ctx_;
+	public:
+		lz4_decoder()
+		{
+			if (LZ4F_isError(LZ4F_createDecompressionContext(
+								 &ctx_, LZ4F_VERSION)))
+				err(errFatal) << "Failed to initialize LZ4 decompressor";
+		}
+		~lz4_decoder()
+		{
+			LZ4F_freeDecompressionContext(ctx_);
+		}
+
+		virtual size_t decode(const char *&in, size_t &len,
+							  char *out, size_t avail)
+		{
+			//The context is ready for the next frame once a frame ends,
+			//skippable frames are skipped by LZ4 itself
+			size_t produced=0;
+			while(produced<avail)
+			{
+				size_t in_sz=len, out_sz=avail-produced;
+				size_t res=LZ4F_decompress(ctx_, out+produced, &out_sz,
+										   in, &in_sz, NULL);
+				if (LZ4F_isError(res))
+					err(errFatal) << "LZ4 error, failed to decompress: "
+								  << LZ4F_getErrorName(res);
+				in+=in_sz;
+				len-=in_sz;
+				produced+=out_sz;
+				if (in_sz==0 && out_sz==0)
+					break;
+			}
+			return produced;
+		}
+	};
+#endif
+}; //namespace es3
+
+encoder_ptr es3::make_encoder(codec_type_e codec, int level)
+{
+	switch(codec)
+	{
+#ifdef HAVE_ZSTD
+		case codecZstd: return encoder_ptr(new zstd_encoder(level));
+#endif
+#ifdef HAVE_LZ4
+		case codecLz4: return encoder_ptr(new lz4_encoder(level));
+#endif
+		case codecGzip: return encoder_ptr(new gzip_encoder(level));
+		default:
+			err(errFatal) << "Codec " << codec_name(codec)
+						  << " is not compiled in";
+	}
+	return encoder_ptr();
+}
+
+decoder_ptr es3::make_decoder(codec_type_e codec)
+{
+	switch(codec)
+	{
+#ifdef HAVE_ZSTD
+		case codecZstd: return decoder_ptr(new zstd_decoder());
+#endif
+#ifdef HAVE_LZ4
+		case codecLz4: return decoder_ptr(new lz4_decoder());
+#endif
+		case codecGzip: return decoder_ptr(new gzip_decoder());
+		default:
+			err(errFatal) << "Codec " << codec_name(codec)
+						  << " is not compiled in";
+	}
+	return decoder_ptr();
+}
@@ -0,0 +1,79 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "common.h"
+
+namespace es3 {
+	enum codec_type_e
+	{
+		codecGzip,
+		codecZstd,
+		codecLz4,
+	};
+
+	/**
+	  Parse the codec name, fails if the codec is not compiled in.
+	  */
+	codec_type_e parse_codec(const std::string &name);
+	std::string codec_name(codec_type_e codec);
+
+	//Enough bytes from the start of a frame to read its info
+	#define FRAME_INFO_PROBE 32
+
+	/**
+	  Compresses one block into a self-contained frame. Frames of the
+	  same codec can be concatenated and decoded as a single stream.
+	  Each frame starts with its compressed and raw lengths (in a GZIP
+	  extra field or in a skippable frame), so a stream can be split
+	  into frames without decompressing it.
+	  */
+	class block_encoder
+	{
+	public:
+		virtual ~block_encoder() {}
+
+		//The worst-case size of a frame with 'raw' bytes of input
+		virtual size_t bound(size_t raw) = 0;
+		//Both calls return the number of bytes written to 'out'. The
+		//output must always have room for the rest of the frame bound.
+		virtual size_t update(const char *in, size_t len,
+							  char *out, size_t avail) = 0;
+		virtual size_t finish(char *out, size_t avail) = 0;
+		//Record the lengths in the finished frame
+		virtual void seal(char *frame, uint64_t frame_len,
+						  uint64_t raw_len) = 0;
+	};
+	typedef boost::shared_ptr<block_encoder> encoder_ptr;
+
+	/**
+	  Read the lengths recorded by block_encoder::seal. Returns false
+	  if the frame has no such info (i.e. it's a legacy object).
+	  */
+	bool read_frame_info(codec_type_e codec, const char *frame, size_t len,
+						 uint64_t *frame_len, uint64_t *raw_len);
+
+	/**
+	  Decodes a stream of concatenated frames.
+	  */
+	class stream_decoder
+	{
+	public:
+		virtual ~stream_decoder() {}
+
+		//Consumes the input and returns the number of bytes produced.
+		//If the output is filled up then more output might be pending,
+		//so the call has to be repeated even if there's no more input.
+		virtual size_t decode(const char *&in, size_t &len,
+							  char *out, size_t avail) = 0;
+	};
+	typedef boost::shared_ptr<stream_decoder> decoder_ptr;
+
+	/**
+	  Level 0 selects the default level of the codec.
+	  */
+	encoder_ptr make_encoder(codec_type_e codec, int level);
+	decoder_ptr make_decoder(codec_type_e codec);
+
+}; //namespace es3
+
+#endif //CODEC_H
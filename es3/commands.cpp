@@ -3,6 +3,7 @@
 #include "sync.h"
 #include <iostream>
 #include <boost/program_options.hpp>
+#include <boost/bind.hpp>
 
 using namespace es3;
 namespace po = boost::program_options;
@@ -14,6 +15,9 @@ int es3::do_rsync(context_ptr context, const stringvec& params,
 	stringvec included, excluded;
 	opts.add_options()
 		("delete-missing,D", "Delete missing files from the sync destination")
+		("streaming,S", "Start the transfers while the directories are "
+			"still being listed, comparing them pair by pair. Needs a "
+			"single source")
 		("exclude-path,E", po::value<stringvec>(&excluded),
 			"Exclude the paths matching the pattern from synchronization. "
 			"If set, all matching files will be excluded even if they match "
@@ -117,7 +121,8 @@ int es3::do_rsync(context_ptr context, const stringvec& params,
 	for(int f=0;f<3;++f)
 	{
 		synchronizer sync(ag, context, remotes, locals, do_upload,
-						  delete_missing, included, excluded);
+						  delete_missing, included, excluded,
+						  vm.count("streaming"));
 		if (!sync.create_schedule(false, false, false))
 		{
 			std::cerr << "ERR: <SOURCE> not found.\n";
@@ -125,6 +130,9 @@ int es3::do_rsync(context_ptr context, const stringvec& params,
 		}
 
 		int res=ag->run();
+		//A failed directory task leaves its deletes unsent
+		if (sync.flush_deletes())
+			res=ag->run();
 		if (res!=0)
 			return res;
 		if (!ag->tasks_count())
@@ -174,7 +182,7 @@ int es3::do_test(context_ptr context, const stringvec& params,
 
 		s3_directory_ptr ptr=conn.list_files_shallow(path,
 													 s3_directory_ptr(),  true);
-		if (!ptr->subdirs_.empty() || !ptr->files_.empty())
+		if (ptr->num_subdirs()!=0 || !ptr->files_.empty())
 			return 0;
 		else
 			return 1;
@@ -215,7 +223,7 @@ int es3::do_touch(context_ptr context, const stringvec& params,
 
 		s3_directory_ptr ptr=conn.list_files_shallow(path,
 													 s3_directory_ptr(), true);
-		if (ptr->subdirs_.empty() && ptr->files_.empty())
+		if (ptr->num_subdirs()==0 && ptr->files_.empty())
 			conn.upload_data(path, "", 0);
 		return 0;
 	} else
@@ -305,6 +313,9 @@ int es3::do_rm(context_ptr context, const stringvec& params,
 		}
 
 		int res=ag->run();
+		//A failed directory task leaves its deletes unsent
+		if (sync.flush_deletes())
+			res=ag->run();
 		if (res!=0)
 			return res;
 		if (!ag->tasks_count())
@@ -330,25 +341,24 @@ int es3::do_rm(context_ptr context, const stringvec& params,
 struct stat_struct
 {
 	uint64_t size_, file_num_, dir_num_;
-	std::string recent_timestamp_;
+	time_t recent_timestamp_;
 };
 
 static void get_size(s3_directory_ptr cur, stat_struct *out)
 {
-	for(auto iter=cur->files_.begin(); iter!=cur->files_.end();++iter)
+	for(size_t f=0; f<cur->files_.size();++f)
 	{
-		out->size_+=iter->second->size_;
+		const s3_file &file=cur->files_.at(f);
+		out->size_+=file.size_;
 		out->file_num_++;
-		
-		const std::string &mtime=iter->second->mtime_str_;
-		if (mtime > out->recent_timestamp_)
-			out->recent_timestamp_=mtime;
+		if (file.mtime_ > out->recent_timestamp_)
+			out->recent_timestamp_=file.mtime_;
 	}
 	
-	for(auto iter=cur->subdirs_.begin(); iter!=cur->subdirs_.end();++iter)
+	for(size_t f=0; f<cur->num_subdirs();++f)
 	{
 		out->dir_num_++;
-		get_size(iter->second, out);
+		get_size(cur->subdir(f), out);
 	}
 }
 
@@ -392,13 +402,17 @@ int es3::do_du(context_ptr context, const stringvec& params,
 	}
 	
 	//Calculate total size and print it
+	seal_listing(cur_root);
 	stat_struct st={0};
 	get_size(cur_root, &st);
 	
 	std::cout<<"Total files: " << st.file_num_ << std::endl;
 	std::cout<<"Total directories: " << st.dir_num_ << std::endl;
 	std::cout<<"Total size: " << st.size_ << std::endl;
-	std::cout<<"Most recent timestamp: " << st.recent_timestamp_ << std::endl;
+	std::cout<<"Most recent timestamp: ";
+	if (st.recent_timestamp_)
+		std::cout << format_iso_time(st.recent_timestamp_);
+	std::cout << std::endl;
 
 	return 0;
 }
@@ -434,6 +448,96 @@ public:
 	}
 };
 
+//HEADs of ls that are in flight at once
+#define LS_MAX_IN_FLIGHT 256
+//Failed HEADs are retried like the agenda retries its tasks
+#define LS_MAX_ATTEMPTS 10
+#define LS_RETRY_DELAY 5
+
+/**
+  HEADs of the files of a directory that run through the transfer
+  engine. The callbacks share it, so it outlives the requests that are
+  still in flight if the submitting thread bails out.
+  */
+struct async_file_info
+{
+	const s3_directory_ptr dir_;
+
+	mutex_t m_; //This mutex protects the following data {
+	boost::condition_variable cond_;
+	size_t next_, in_flight_, failed_;
+	std::vector<file_desc> descs_;
+	std::vector<int> attempts_;
+	std::deque<std::pair<time_t, size_t> > retries_; //By the time to retry
+	//}
+
+	async_file_info(const s3_directory_ptr &dir) : dir_(dir), next_(),
+		in_flight_(), failed_(), descs_(dir->files_.size()),
+		attempts_(dir->files_.size()) {}
+
+	void on_done(size_t idx, const file_desc &desc, const result_code_t &res)
+	{
+		guard_t lock(m_);
+		in_flight_--;
+		cond_.notify_all();
+		if (res.ok())
+		{
+			descs_[idx]=desc;
+			return;
+		}
+		if (res.code()!=errFatal && attempts_[idx]<LS_MAX_ATTEMPTS)
+		{
+			VLOG(1) << "WARN: " << res.desc();
+			retries_.push_back(std::make_pair(time(NULL)+LS_RETRY_DELAY, idx));
+			return;
+		}
+		VLOG(0) << "Failed to get info about " << dir_->file_path(idx)
+				<< ": " << res.desc();
+		failed_++;
+	}
+};
+typedef boost::shared_ptr<async_file_info> async_file_info_ptr;
+
+/**
+  Runs the HEADs, up to LS_MAX_IN_FLIGHT of them at once, and waits
+  for all of them. Returns the number of the files that failed.
+  */
+static size_t find_file_infos(context_ptr context, async_file_info_ptr info)
+{
+	u_guard_t lock(info->m_);
+	while(true)
+	{
+		bool retry=!info->retries_.empty() &&
+				info->retries_.front().first<=time(NULL);
+		if (info->in_flight_<LS_MAX_IN_FLIGHT &&
+				(retry || info->next_<info->descs_.size()))
+		{
+			size_t idx=info->next_;
+			if (retry)
+			{
+				idx=info->retries_.front().second;
+				info->retries_.pop_front();
+			} else
+				info->next_++;
+			info->attempts_[idx]++;
+			info->in_flight_++;
+
+			lock.unlock();
+			s3_connection::find_mtime_and_size_async(context,
+				info->dir_->file_path(idx), boost::bind(
+					&async_file_info::on_done, info, idx, _1, _2));
+			lock.lock();
+			continue;
+		}
+		if (info->in_flight_==0 && info->retries_.empty() &&
+				info->next_==info->descs_.size())
+			break;
+		//Woken up by the completions, the retries are checked each second
+		info->cond_.timed_wait(lock, boost::posix_time::seconds(1));
+	}
+	return info->failed_;
+}
+
 int es3::do_ls(context_ptr context, const stringvec& params,
 		 agenda_ptr ag, bool help)
 {
@@ -463,19 +567,36 @@ int es3::do_ls(context_ptr context, const stringvec& params,
 				path, s3_directory_ptr(), true);
 	size_t files=0, dirs=0;
 	uint64_t total=0;
-	for(auto iter=cur->subdirs_.begin(); iter!=cur->subdirs_.end();++iter)
+	for(size_t f=0; f<cur->num_subdirs();++f)
 	{
-		std::cout << "\t\tDIR\t" << iter->second->absolute_name_ << std::endl;
+		std::cout << "\t\tDIR\t" << cur->subdir(f)->path() << std::endl;
 		dirs++;
 	}
 	
-	if (cur->files_.size()>10)
+	if (cur->files_.size()>10 && context->engine_)
+	{
+		//The HEADs don't need a thread each
+		async_file_info_ptr info(new async_file_info(cur));
+		if (find_file_infos(context, info))
+			return 6;
+
+		for(size_t f=0; f<cur->files_.size();++f)
+		{
+			s3_path remote_name = cur->file_path(f);
+			const file_desc &mod=info->descs_.at(f);
+			std::cout << mod.mtime_
+					  << "\t"<< mod.raw_size_
+					  << "\t" << remote_name << std::endl;
+			files++;
+			total+=cur->files_.at(f).size_;
+		}
+	} else if (cur->files_.size()>10)
 	{
 		std::map<s3_path, file_desc> desc_map;
 		mutex_t desc_mtx;	
-		for(auto iter=cur->files_.begin(); iter!=cur->files_.end();++iter)
+		for(size_t f=0; f<cur->files_.size();++f)
 		{
-			sync_task_ptr tsk(new get_file_info(iter->second->absolute_name_,
+			sync_task_ptr tsk(new get_file_info(cur->file_path(f),
 												context, desc_map, desc_mtx));
 			ag->schedule(tsk);
 		}
@@ -491,27 +612,27 @@ int es3::do_ls(context_ptr context, const stringvec& params,
 			return 4;
 		}
 		
-		for(auto iter=cur->files_.begin(); iter!=cur->files_.end();++iter)
+		for(size_t f=0; f<cur->files_.size();++f)
 		{
-			s3_path remote_name = iter->second->absolute_name_;
+			s3_path remote_name = cur->file_path(f);
 			const file_desc &mod=desc_map.at(remote_name);
 			std::cout << mod.mtime_
 					  << "\t"<< mod.raw_size_
 					  << "\t" << remote_name << std::endl;
 			files++;
-			total+=iter->second->size_;
+			total+=cur->files_.at(f).size_;
 		}
 	} else
 	{
-		for(auto iter=cur->files_.begin(); iter!=cur->files_.end();++iter)
+		for(size_t f=0; f<cur->files_.size();++f)
 		{
-			s3_path remote_name = iter->second->absolute_name_;
+			s3_path remote_name = cur->file_path(f);
 			file_desc mod=conn.find_mtime_and_size(remote_name);
 			std::cout << mod.mtime_
 					  << "\t"<< mod.raw_size_
 					  << "\t" << remote_name << std::endl;
 			files++;
-			total+=iter->second->size_;
+			total+=cur->files_.at(f).size_;
 		}		
 	}
 	
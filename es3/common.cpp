@@ -2,6 +2,7 @@
 #include <sstream>
 #include "errors.h"
 #include <stdio.h>
+#include <time.h>
 
 #ifndef __MACH__
 #define BOOST_KARMA_NUMERICS_LOOP_UNROLL 6
@@ -113,6 +114,23 @@ std::string es3::format_time(time_t time)
 	return date_header;
 }
 
+time_t es3::parse_iso_time(const std::string &str)
+{
+	struct tm timeinfo={0};
+	if (!strptime(str.c_str(), "%Y-%m-%dT%H:%M:%S", &timeinfo))
+		return 0;
+	return timegm(&timeinfo);
+}
+
+std::string es3::format_iso_time(time_t time)
+{
+	struct tm timeinfo={0};
+	gmtime_r(&time, &timeinfo);
+	char res[80] = {0};
+	strftime(res, 80, "%Y-%m-%dT%H:%M:%S.000Z", &timeinfo);
+	return res;
+}
+
 handle_t::handle_t()
 {
 	fileno_ = 0;
@@ -63,6 +63,9 @@ namespace es3 {
 
 	ES3LIB_PUBLIC std::string tobinhex(const unsigned char* data, size_t ln);
 	ES3LIB_PUBLIC std::string format_time(time_t time);
+	//ISO 8601 timestamps, as used by the S3 listings
+	ES3LIB_PUBLIC time_t parse_iso_time(const std::string &str);
+	ES3LIB_PUBLIC std::string format_iso_time(time_t time);
 
 	class logger
 	{
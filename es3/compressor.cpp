@@ -2,174 +2,452 @@
 #include "agenda.h"
 #include "context.h"
 
-#include <zlib.h>
+#include "codec.h"
 #include <stdio.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <string.h>
+#include <unistd.h>
 #include "scope_guard.h"
 #include "errors.h"
 
 using namespace es3;
 
-#define MINIMAL_BLOCK (1024*1024)
 #define COMPRESSION_THRESHOLD 10000000
+#define READ_CHUNK (1024*1024*2)
 
 namespace es3
 {
+	struct compress_stream :
+			public boost::enable_shared_from_this<compress_stream>
+	{
+		context_ptr context_;
+		bf::path path_;
+		agenda_ptr agenda_;
+		part_ready_callback on_part_;
+		parts_done_callback on_done_;
+		uint64_t file_size_, block_size_, num_blocks_;
+
+		mutex_t m_; //This mutex protects the following data {
+		std::vector<segment_ptr> free_;
+		std::map<uint64_t, segment_ptr> finished_;
+		uint64_t next_scheduled_, next_assembled_;
+		segment_ptr accumulator_;
+		size_t num_parts_;
+		//}
+
+		compress_stream() : file_size_(), block_size_(), num_blocks_(),
+			next_scheduled_(), next_assembled_(), num_parts_() {}
+
+		void pump();
+		void on_block_done(uint64_t num, segment_ptr seg);
+		void release(segment_ptr seg);
+	private:
+		void assemble(segment_ptr seg, std::vector<segment_ptr> &parts);
+		void emit_part(std::vector<segment_ptr> &parts);
+	};
+
+	/**
+	  Returns a lent segment back to its stream once the part is uploaded.
+	  */
+	struct segment_returner
+	{
+		compress_stream_ptr stream_;
+		segment_ptr seg_;
+
+		void operator()(segment *)
+		{
+			stream_->release(seg_);
+		}
+	};
+
 	struct compress_task : public sync_task
 	{
-		compressor_ptr parent_;
-		uint64_t block_num_, offset_, size_, block_total_;
+		compress_stream_ptr stream_;
+		uint64_t block_num_;
+		segment_ptr seg_;
 
 		virtual task_type_e get_class() const { return taskCPUBound; }
 
 		virtual void print_to(std::ostream &str)
 		{
-			str << "Compress block " << block_num_ << " of " << parent_->path_;
+			str << "Compress block " << block_num_ << " of "
+				<< stream_->path_;
 		}
 
 		virtual void operator()(agenda_ptr agenda)
 		{
-			std::pair<bf::path,uint64_t> res=do_compress(agenda);
-			parent_->on_complete(res.first, block_num_, res.second);
+			do_compress(agenda);
+			stream_->on_block_done(block_num_, seg_);
 		}
 
-		std::pair<bf::path,uint64_t> do_compress(agenda_ptr agenda)
+		void do_compress(agenda_ptr agenda)
 		{
-			handle_t src(open(parent_->path_.c_str(), O_RDONLY)
-						 | libc_die2("Failed to open "
-									 +parent_->path_.string()
-									 +" for compression"));
-			lseek64(src.get(), offset_, SEEK_SET)
-					| libc_die2("Incorrect offset "+int_to_string(offset_)
-								+" in "+parent_->path_.string());
+			const bf::path &path=stream_->path_;
+			uint64_t offset=stream_->block_size_*block_num_;
+			uint64_t size=std::min(stream_->block_size_,
+								   stream_->file_size_-offset);
 
-			//Generate the temp name
-			bf::path tmp_nm = bf::path(parent_->context_->scratch_dir_) /
-					bf::unique_path("scratchy-%%%%-%%%%-%%%%-%%%%");
-			handle_t tmp_desc(open(tmp_nm.c_str(), O_RDWR|O_CREAT, 0600)
-							  | libc_die2("Failed to create temp file: "
-										  +tmp_nm.string()));
+			handle_t src(open(path.c_str(), O_RDONLY)
+						 | libc_die2("Failed to open "+path.string()
+									 +" for compression"));
 
 			VLOG(2) << "Compressing part " << block_num_ << " out of " <<
-					   block_total_ << " of " << parent_->path_;
+					   stream_->num_blocks_ << " of " << path;
 
-			z_stream stream = {0};
-			deflateInit2(&stream, 1, Z_DEFLATED,
-							   15|16, //15 window bits | GZIP
-							   8,
-							   Z_DEFAULT_STRATEGY);
-			ON_BLOCK_EXIT(&deflateEnd, &stream);
+			context_ptr ctx=stream_->context_;
+			encoder_ptr enc=make_encoder(ctx->codec_,
+										 ctx->compression_level_);
+
+			//The block size guarantees that the output fits
+			segment_buffer &out=seg_->data_;
+			out.resize(agenda->segment_size());
+			size_t produced=0;
 
 			std::vector<char> buf;
-			std::vector<char> buf_out;
-			buf.resize(1024*1024*2);
-			buf_out.resize(1024*1024);
+			buf.resize(READ_CHUNK);
 
-			size_t consumed=0;
-			size_t raw_consumed=0;
-			while(raw_consumed<size_)
+			uint64_t raw_consumed=0;
+			while(raw_consumed<size)
 			{
 				size_t chunk = std::min(uint64_t(buf.size()),
-										size_-raw_consumed);
-				ssize_t ln=read(src.get(), &buf[0], chunk) | libc_die;
-				assert(ln>0);
+										size-raw_consumed);
+				ssize_t ln=pread(src.get(), &buf[0], chunk,
+								 offset+raw_consumed) | libc_die;
+				if (ln==0)
+					err(errFatal) << "File " << path
+								  << " was truncated during compression";
 				raw_consumed+=ln;
 
-				stream.avail_in = ln;
-				stream.next_in = (Bytef*)&buf[0];
-
-				do
-				{
-					stream.avail_out= buf_out.size();
-					stream.next_out = (Bytef*)&buf_out[0];
-					int c_err=deflate(&stream, Z_NO_FLUSH);
-					if (c_err!=Z_OK)
-						err(errFatal) << "Failed to compress "
-									  << parent_->path_;
-
-					size_t cur_consumed=buf_out.size() - stream.avail_out;
-					write(tmp_desc.get(), &buf_out[0], cur_consumed) | libc_die;
-					consumed += cur_consumed;
-				} while(stream.avail_in!=0);
+				produced+=enc->update(&buf[0], ln, out.data()+produced,
+									  out.size()-produced);
 			}
-			assert(raw_consumed==size_);
+			assert(raw_consumed==size);
 
 			//We're writing the epilogue
-			stream.avail_out= buf_out.size();
-			stream.next_out = (Bytef*)&buf_out[0];
-			int c_err=deflate(&stream, Z_FINISH);
-			if (c_err!=Z_STREAM_END) //Epilogue must always fit
-				err(errFatal) << "Failed to finish compression of "
-							  << parent_->path_;
-			size_t cur_consumed=buf_out.size() - stream.avail_out;
-			consumed += cur_consumed;
-			if (cur_consumed!=0)
-				write(tmp_desc.get(), &buf_out[0], cur_consumed) | libc_die;
-
-			agenda->add_stat_counter("compressed", consumed);
-			agenda->add_stat_counter("precompressed", size_);
-			agenda->add_stat_counter("read", size_);
+			produced+=enc->finish(out.data()+produced, out.size()-produced);
+			enc->seal(out.data(), produced, size);
+			out.resize(produced);
 
-			VLOG(2) << "Done compressing part " << block_num_ << " out of " <<
-					   block_total_ << " of " << parent_->path_;
+			agenda->add_stat_counter("compressed", out.size());
+			agenda->add_stat_counter("precompressed", size);
+			agenda->add_stat_counter("read", size);
 
-			return std::pair<bf::path,uint64_t>(tmp_nm, consumed);
+			VLOG(2) << "Done compressing part " << block_num_ << " out of " <<
+					   stream_->num_blocks_ << " of " << path;
 		}
 	};
 }; //namespace es3
 
-void file_compressor::operator()(agenda_ptr agenda)
+void compress_stream::pump()
 {
-	uint64_t file_sz=bf::file_size(path_);
-	assert(file_sz>MINIMAL_BLOCK);
+	//Blocks are started strictly in order, so the next block to
+	//assemble always has its segment and the stream can't get stuck
+	while(!free_.empty() && next_scheduled_<num_blocks_)
+	{
+		boost::shared_ptr<compress_task> task(new compress_task());
+		task->stream_=shared_from_this();
+		task->block_num_=next_scheduled_++;
+		task->seg_=free_.back();
+		free_.pop_back();
+		agenda_->schedule(task);
+	}
+}
 
-	//Start compressing
-	uint64_t estimate_num_blocks = file_sz / MINIMAL_BLOCK;
-	assert(estimate_num_blocks>0);
+void compress_stream::release(segment_ptr seg)
+{
+	guard_t lock(m_);
+	seg->data_.clear();
+	free_.push_back(seg);
+	pump();
+}
 
-	if (estimate_num_blocks> agenda->get_capability(taskCPUBound))
-		estimate_num_blocks = agenda->get_capability(taskCPUBound);
-	uint64_t block_sz = file_sz / estimate_num_blocks;
-	assert(block_sz>0);
-	uint64_t num_blocks = file_sz / block_sz + ((file_sz%block_sz)==0?0:1);
+void compress_stream::emit_part(std::vector<segment_ptr> &parts)
+{
+	segment_returner ret {shared_from_this(), accumulator_};
+	segment_ptr lent(accumulator_.get(), ret);
+	accumulator_.reset();
+	//Keep a reference until the lock is released, the returner
+	//grabs the lock
+	parts.push_back(lent);
+	on_part_(num_parts_++, lent);
+}
+
+void compress_stream::assemble(segment_ptr seg,
+							   std::vector<segment_ptr> &parts)
+{
+	size_t segment_size=agenda_->segment_size();
+	if (accumulator_)
+	{
+		segment_buffer &acc=accumulator_->data_, &cur=seg->data_;
+		size_t have=acc.size(), avail=cur.size();
+		size_t chunk=std::min(segment_size-have, avail);
+		acc.resize(have+chunk);
+		memcpy(&acc[have], cur.data(), chunk);
+		//The leftover starts the next part
+		memmove(cur.data(), cur.data()+chunk, avail-chunk);
+		cur.resize(avail-chunk);
+		if (acc.size()==segment_size)
+			emit_part(parts);
+	}
 
-	result_=files_ptr(new scattered_files(num_blocks));
-	num_pending_ = num_blocks;
-	for(uint64_t f=0; f<num_blocks; ++f)
+	if (!accumulator_ && seg->data_.size()!=0)
 	{
-		boost::shared_ptr<compress_task> ptr(new compress_task());
-		ptr->parent_=shared_from_this();
-		ptr->block_num_=f;
-		ptr->block_total_=num_blocks;
-		ptr->offset_=block_sz*f;
-		ptr->size_=file_sz-ptr->offset_;
-		if (ptr->size_>block_sz)
-			ptr->size_=block_sz;
-
-		agenda->schedule(ptr);
+		accumulator_=seg;
+		if (seg->data_.size()==segment_size)
+			emit_part(parts);
+	} else
+	{
+		seg->data_.clear();
+		free_.push_back(seg);
 	}
 }
 
-void file_compressor::on_complete(const bf::path &name, uint64_t num,
-				 uint64_t resulting_size)
+void compress_stream::on_block_done(uint64_t num, segment_ptr seg)
 {
+	std::vector<segment_ptr> parts;
+	bool done=false;
+	size_t total_parts=0;
 	{
 		guard_t lock(m_);
-		assert(num_pending_!=0);
-		num_pending_--;
-		result_->files_.at(num) = name;
-		result_->sizes_.at(num) = resulting_size;
+		finished_[num]=seg;
+		while(!finished_.empty() &&
+			  finished_.begin()->first==next_assembled_)
+		{
+			assemble(finished_.begin()->second, parts);
+			finished_.erase(finished_.begin());
+			next_assembled_++;
+		}
+
+		if (next_assembled_==num_blocks_)
+		{
+			if (accumulator_)
+				emit_part(parts); //The last part might be small
+			done=true;
+			total_parts=num_parts_;
+		} else
+			pump();
 	}
-	if (num_pending_==0)
-		on_finish_(result_);
+
+	if (done)
+		on_done_(total_parts);
+}
+
+file_compressor::file_compressor(const bf::path &path, context_ptr context,
+								 agenda_ptr agenda,
+								 part_ready_callback on_part,
+								 parts_done_callback on_done)
+	: context_(context), path_(path), on_part_(on_part), on_done_(on_done)
+{
+	//One segment is needed for the part being assembled and at least
+	//one more for a block being compressed
+	window_=agenda->get_capability(taskCPUBound)+2;
+	if (window_>agenda->max_in_flight()/2)
+		window_=agenda->max_in_flight()/2;
+	if (window_<2)
+		window_=2;
+}
+
+void file_compressor::operator()(agenda_ptr agenda,
+								 const std::vector<segment_ptr> &segments)
+{
+	uint64_t file_sz=bf::file_size(path_);
+	assert(file_sz>0);
+
+	compress_stream_ptr stream(new compress_stream());
+	stream->context_=context_;
+	stream->path_=path_;
+	stream->agenda_=agenda;
+	stream->on_part_=on_part_;
+	stream->on_done_=on_done_;
+	stream->file_size_=file_sz;
+
+	//Pick the largest block whose compressed form always fits
+	//into a segment
+	size_t segment_size=agenda->segment_size();
+	encoder_ptr enc=make_encoder(context_->codec_,
+								 context_->compression_level_);
+	uint64_t block_sz=segment_size;
+	while(enc->bound(block_sz)>segment_size)
+		block_sz-=enc->bound(block_sz)-segment_size;
+
+	stream->block_size_=block_sz;
+	stream->num_blocks_=file_sz/block_sz + ((file_sz%block_sz)==0?0:1);
+
+	guard_t lock(stream->m_);
+	stream->free_=segments;
+	stream->pump();
+}
+
+namespace es3
+{
+	struct frame_desc
+	{
+		uint64_t offset_, size_, raw_offset_, raw_size_;
+	};
+
+	/**
+	  Decompresses a single frame and writes it at its raw offset.
+	  */
+	struct decompress_frame_task : public sync_task
+	{
+		boost::shared_ptr<file_decompressor> parent_;
+		frame_desc frame_;
+		size_t frame_num_;
+
+		virtual task_type_e get_class() const { return taskCPUBound; }
+		virtual size_t needs_segments() const { return 1; }
+
+		virtual void print_to(std::ostream &str)
+		{
+			str << "Decompress frame " << frame_num_ << " of "
+				<< parent_->source_;
+		}
+
+		virtual void operator()(agenda_ptr agenda,
+								const std::vector<segment_ptr> &segments)
+		{
+			//Frames are normally not bigger than a segment, but the
+			//object could have been uploaded with a larger segment size
+			segment_buffer &in=segments.at(0)->data_;
+			in.resize(safe_cast<size_t>(frame_.size_));
+
+			handle_t in_fl(open(parent_->source_.c_str(), O_RDONLY)
+						   | libc_die2("Failed to open "
+									   +parent_->source_.string()));
+			size_t done=0;
+			while(done<in.size())
+			{
+				ssize_t res=pread(in_fl.get(), in.data()+done, in.size()-done,
+								  frame_.offset_+done) | libc_die;
+				if (res==0)
+					err(errFatal) << "Unexpected end of "
+								  << parent_->source_;
+				done+=res;
+			}
+
+			handle_t out_fl(open(parent_->temp_out_.c_str(), O_WRONLY)
+							| libc_die2("Failed to decompress to "
+										+parent_->result_.string()));
+			decoder_ptr dec=make_decoder(parent_->codec_);
+			std::vector<char> buf_out;
+			buf_out.resize(1024*1024*2);
+
+			const char *cur=in.data();
+			size_t in_len=in.size();
+			uint64_t written=0;
+			size_t to_write=0;
+			do
+			{
+				to_write=dec->decode(cur, in_len, &buf_out[0], buf_out.size());
+				if (written+to_write>frame_.raw_size_)
+					err(errFatal) << "Frame " << frame_num_ << " of "
+								  << parent_->source_ << " is corrupted";
+				pwrite(out_fl.get(), &buf_out[0], to_write,
+					   frame_.raw_offset_+written) | libc_die;
+				written+=to_write;
+			} while(in_len>0 || to_write==buf_out.size());
+
+			if (written!=frame_.raw_size_)
+				err(errFatal) << "Frame " << frame_num_ << " of "
+							  << parent_->source_ << " is truncated";
+			agenda->add_stat_counter("decompressed", written);
+			parent_->on_frame_done();
+		}
+	};
+}; //namespace es3
+
+/**
+  Split the file into frames using the recorded frame lengths.
+  */
+static bool scan_frames(int fd, uint64_t file_size, codec_type_e codec,
+						std::vector<frame_desc> *frames)
+{
+	uint64_t offset=0, raw_offset=0;
+	while(offset<file_size)
+	{
+		char probe[FRAME_INFO_PROBE];
+		size_t ln=pread(fd, probe, sizeof(probe), offset) | libc_die;
+		frame_desc cur;
+		if (!read_frame_info(codec, probe, ln, &cur.size_, &cur.raw_size_))
+			return false;
+		if (cur.size_>file_size-offset)
+			return false;
+		cur.offset_=offset;
+		cur.raw_offset_=raw_offset;
+		frames->push_back(cur);
+
+		offset+=cur.size_;
+		raw_offset+=cur.raw_size_;
+	}
+	return true;
 }
 
 void file_decompressor::operator()(agenda_ptr agenda)
 {
-	z_stream stream = {0};
-	inflateInit2(&stream, 15 | 16);
-	ON_BLOCK_EXIT(&inflateEnd, &stream);
+	std::vector<frame_desc> frames;
+	{
+		handle_t in_fl(open(source_.c_str(), O_RDONLY) |
+					   libc_die2("Failed to decompress to "+result_.string()+
+								 ", can't open temporary file"));
+		if (!scan_frames(in_fl.get(), in_fl.size(), codec_, &frames)
+				|| frames.size()<2)
+		{
+			//Legacy objects have to be decoded as a single stream
+			decompress_sequentially(agenda);
+			return;
+		}
+	}
+
+	uint64_t raw_size=frames.back().raw_offset_+frames.back().raw_size_;
+	VLOG(2) << "Decompressing " << frames.size() << " frames of "
+			<< source_ << " in parallel";
+
+	guard_t lock(m_);
+	temp_out_=bf::unique_path(result_.string()+"-%%%%%%%%%");
+	handle_t out_fl(open(temp_out_.c_str(), O_WRONLY|O_CREAT, 0600) |
+					libc_die2("Failed to decompress to "+result_.string()));
+	ftruncate(out_fl.get(), raw_size)
+			| libc_die2("Failed to allocate "+temp_out_.string());
+
+	frames_left_=frames.size();
+	for(size_t f=0;f<frames.size();++f)
+	{
+		boost::shared_ptr<decompress_frame_task> task(
+					new decompress_frame_task());
+		task->parent_=shared_from_this();
+		task->frame_=frames.at(f);
+		task->frame_num_=f;
+		agenda->schedule(task);
+	}
+}
+
+void file_decompressor::on_frame_done()
+{
+	guard_t lock(m_);
+	assert(frames_left_>0);
+	frames_left_--;
+	if (frames_left_==0)
+	{
+		install(temp_out_);
+		temp_out_.clear();
+	}
+}
+
+void file_decompressor::install(const bf::path &temp_out_name)
+{
+	bf::last_write_time(temp_out_name, mtime_);
+	chmod(temp_out_name.c_str(), mode_)
+			| libc_die2("Failed to set mode on "+result_.string());
+	rename(temp_out_name.c_str(), result_.c_str())
+			| libc_die2("Failed to replace "+result_.string());
+	if (on_installed_)
+		on_installed_();
+}
+
+void file_decompressor::decompress_sequentially(agenda_ptr agenda)
+{
+	decoder_ptr dec=make_decoder(codec_);
 
 	std::vector<char> buf;
 	std::vector<char> buf_out;
@@ -194,36 +472,19 @@ void file_decompressor::operator()(agenda_ptr agenda)
 		if (cur_chunk==0)
 			break;
 
-		stream.avail_in = cur_chunk;
-		stream.next_in = (Bytef*)&buf[0];
-
-		while (stream.avail_in>0)
+		const char *in=&buf[0];
+		size_t in_len=cur_chunk;
+		size_t to_write=0;
+		do
 		{
-			stream.next_out = (Bytef*)&buf_out[0];
-			stream.avail_out = buf_out.size();
-			int res = inflate(&stream, Z_SYNC_FLUSH);
-			if (res<0)
-				err(errFatal) << "GZ error, failed to decompress " << result_;
-
-			size_t to_write = buf_out.size()-stream.avail_out;
+			to_write=dec->decode(in, in_len, &buf_out[0], buf_out.size());
 			written_so_far+=to_write;
 			write(out_fl.get(), &buf_out[0], to_write) | libc_die;
 			agenda->add_stat_counter("decompressed", to_write);
-
-			if (res == Z_STREAM_END)
-			{
-				//For gzip files with concatenated content
-				inflateEnd(&stream);
-				inflateInit2(&stream, 15 | 16);
-			}
-		}
+		} while(in_len>0 || to_write==buf_out.size());
 	}
 
-	bf::last_write_time(temp_out_name, mtime_);
-	chmod(temp_out_name.c_str(), mode_)
-			| libc_die2("Failed to set mode on "+result_.string());
-	rename(temp_out_name.c_str(), result_.c_str())
-			| libc_die2("Failed to replace "+result_.string());
+	install(temp_out_name);
 }
 
 bool es3::should_compress(const bf::path &p, uint64_t sz)
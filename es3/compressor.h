@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "agenda.h"
+#include "codec.h"
 #include <functional>
 #include <boost/filesystem.hpp>
 
@@ -16,61 +17,52 @@ namespace es3 {
 	{
 		std::vector<bf::path> files_;
 		std::vector<uint64_t> sizes_;
-		bool was_compressed_;
-
-		scattered_files(size_t sz)
-		{
-			files_.resize(sz);
-			sizes_.resize(sz);
-			was_compressed_ = true;
-		}
 
 		scattered_files(const bf::path &file, uint64_t sz)
 		{
 			files_.push_back(file);
 			sizes_.push_back(sz);
-			was_compressed_=false;
-		}
-		~scattered_files()
-		{
-			if (was_compressed_)
-				for(auto f =files_.begin();f!=files_.end();++f)
-					if (!f->empty()) unlink(f->c_str());
 		}
 	};
 	typedef boost::shared_ptr<scattered_files> files_ptr;
-	typedef boost::function<void(files_ptr)> files_finished_callback;
 
-	class file_compressor : public sync_task,
-			public boost::enable_shared_from_this<file_compressor>
-	{
-		mutex_t m_;
+	//Receives a filled part, parts are numbered from zero
+	typedef boost::function<void(size_t, segment_ptr)> part_ready_callback;
+	//Receives the total number of parts once the last one is out
+	typedef boost::function<void(size_t)> parts_done_callback;
+	//Called once the decompressed file replaces its target
+	typedef boost::function<void()> installed_callback;
+
+	struct compress_stream;
+	typedef boost::shared_ptr<compress_stream> compress_stream_ptr;
 
+	/**
+	  Compresses a file into segment-sized parts. Blocks are compressed
+	  in parallel directly into segments and are reassembled in order,
+	  each part is handed out as soon as it's filled. The whole window
+	  of segments is reserved upfront, so that compressors of different
+	  files can't starve each other.
+	  */
+	class file_compressor : public sync_task
+	{
 		context_ptr context_;
 		const bf::path path_;
-		files_finished_callback on_finish_;
-
-		files_ptr result_;
-		volatile size_t num_pending_;
-
-		friend struct compress_task;
+		size_t window_;
+		part_ready_callback on_part_;
+		parts_done_callback on_done_;
 	public:
-		file_compressor(const bf::path &path,
-						context_ptr context,
-						files_finished_callback on_finish)
-			: path_(path), context_(context), on_finish_(on_finish)
-		{
-		}
-		virtual void operator()(agenda_ptr agenda);
+		file_compressor(const bf::path &path, context_ptr context,
+						agenda_ptr agenda, part_ready_callback on_part,
+						parts_done_callback on_done);
+
+		virtual size_t needs_segments() const { return window_; }
+		virtual void operator()(agenda_ptr agenda,
+								const std::vector<segment_ptr> &segments);
 		virtual void print_to(std::ostream &str)
 		{
 			str << "Compress " << path_;
 		}
-	private:
-		void on_complete(const bf::path &name, uint64_t num,
-						 uint64_t resulting_size);
 	};
-	typedef boost::shared_ptr<file_compressor> compressor_ptr;
 
 	class file_decompressor : public sync_task,
 			public boost::enable_shared_from_this<file_decompressor>
@@ -80,19 +72,33 @@ namespace es3 {
 		const bf::path result_;
 		time_t mtime_;
 		mode_t mode_;
+		codec_type_e codec_;
 		bool delete_on_stop_;
+		const installed_callback on_installed_;
+
+		mutex_t m_; //This mutex protects the following data {
+		bf::path temp_out_;
+		size_t frames_left_;
+		//}
+
+		friend struct decompress_frame_task;
 	public:
 		file_decompressor(context_ptr context, const bf::path &source,
 						  const bf::path &result, time_t mtime, mode_t mode,
-						  bool delete_on_stop)
+						  codec_type_e codec, bool delete_on_stop,
+						  const installed_callback &on_installed=
+							installed_callback())
 			: context_(context), source_(source), result_(result),
-			  delete_on_stop_(delete_on_stop), mtime_(mtime), mode_(mode)
+			  delete_on_stop_(delete_on_stop), mtime_(mtime), mode_(mode),
+			  codec_(codec), on_installed_(on_installed), frames_left_()
 		{
 		}
 		~file_decompressor()
 		{
 			if (delete_on_stop_)
 				unlink(source_.c_str());
+			if (!temp_out_.empty())
+				unlink(temp_out_.c_str()); //Leftovers of a failed run
 		}
 
 		virtual task_type_e get_class() const { return taskCPUBound; }
@@ -102,6 +108,10 @@ namespace es3 {
 		{
 			str << "Decompress " << source_ << " to " << result_;
 		}
+	private:
+		void decompress_sequentially(agenda_ptr agenda);
+		void on_frame_done();
+		void install(const bf::path &temp_out_name);
 	};
 
 	bool should_compress(const bf::path &p, uint64_t sz);
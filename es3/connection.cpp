@@ -2,11 +2,17 @@
 #include "context.h"
 #include <curl/curl.h>
 #include "errors.h"
-#include <openssl/hmac.h>
 #include <openssl/md5.h>
 #include <tinyxml.h>
 #include "scope_guard.h"
+#include "transfer.h"
+#include "state_db.h"
+#include "list_parser.h"
+#include "signer.h"
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <unistd.h>
 
 using namespace es3;
 
@@ -54,6 +60,13 @@ s3_connection::~s3_connection()
 		curl_slist_free_all(header_list_);
 }
 
+int s3_connection::perform(curl_ptr_t curl)
+{
+	if (conn_data_->engine_)
+		return conn_data_->engine_->perform(curl);
+	return curl_easy_perform(curl.get());
+}
+
 void s3_connection::checked(curl_ptr_t curl, int curl_code)
 {
 	if (curl_code!=CURLE_OK)
@@ -113,12 +126,13 @@ void s3_connection::check_for_errors(curl_ptr_t curl,
 void s3_connection::prepare(curl_ptr_t curl,
 							const std::string &verb,
 							const s3_path &path,
-							const header_map_t &opts)
+							const header_map_t &opts,
+							const std::string &args)
 {
 	s3_path cur_path=path;
 	if (cur_path.path_.empty())
 		cur_path.path_.append("/");
-	curl_easy_reset(curl.get());
+	conn_data_->reset_curl(curl);
 	//memset(conn_data_->err_buf_for(curl.get()) , 0, CURL_ERROR_SIZE);
 
 	//Set HTTP verb
@@ -141,7 +155,7 @@ void s3_connection::prepare(curl_ptr_t curl,
 		header_list_ = curl_slist_append(header_list_, header.c_str());
 	}
 
-	header_list_ = authenticate_req(header_list_, verb, cur_path, opts);
+	header_list_ = authenticate_req(header_list_, verb, cur_path, args, opts);
 	checked(curl,
 			curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, header_list_));
 	checked(curl,
@@ -149,7 +163,7 @@ void s3_connection::prepare(curl_ptr_t curl,
 
 	checked(curl,
 			curl_easy_setopt(curl.get(), CURLOPT_NOSIGNAL, 1));
-	set_url(curl, path, "");
+	set_url(curl, path, args);
 }
 
 void s3_connection::set_url(curl_ptr_t curl,
@@ -160,67 +174,223 @@ void s3_connection::set_url(curl_ptr_t curl,
 		cur_path.path_.append("/");
 
 	std::string url = conn_data_->use_ssl_?"https://" : "http://";
-	url.append(cur_path.bucket_);
-	url.append(".").append(cur_path.zone_);
-	url.append(".amazonaws.com");
+	url.append(host_of(cur_path));
+	if (!conn_data_->endpoint_.empty())
+		url.append("/").append(cur_path.bucket_);
 	url.append(cur_path.path_);
 	url.append(args);
 	checked(curl,
 			curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str()));
 }
 
+std::string s3_connection::host_of(const s3_path &path) const
+{
+	if (!conn_data_->endpoint_.empty())
+		return conn_data_->endpoint_;
+	return path.bucket_+"."+path.zone_+".amazonaws.com";
+}
+
 curl_slist* s3_connection::authenticate_req(struct curl_slist * header_list,
-	const std::string &verb, const s3_path &path, const header_map_t &opts)
+	const std::string &verb, const s3_path &path, const std::string &args,
+	const header_map_t &opts)
 {
-	header_map_t my_opts = opts;
+	if (conn_data_->use_sigv4_)
+		return authenticate_v4(header_list, verb, path, args, opts);
+	return authenticate_v2(header_list, verb, path, opts);
+}
 
+curl_slist* s3_connection::authenticate_v2(struct curl_slist * header_list,
+	const std::string &verb, const s3_path &path, const header_map_t &opts)
+{
 	//Make a 'Date' header
 	std::string date_header=format_time(time(NULL));
-	my_opts["x-amz-date"] = date_header;
 	header_list = curl_slist_append(header_list,
 		(std::string("x-amz-date: ")+date_header).c_str());
 
-	std::string amz_headers;
-	for(auto iter = my_opts.begin(); iter!=my_opts.end();++iter)
-	{
-		std::string lower_hdr = iter->first;
-		std::transform(lower_hdr.begin(), lower_hdr.end(),
-					   lower_hdr.begin(), ::tolower);
-		if (lower_hdr.find("x-amz")==0)
-			amz_headers.append(lower_hdr).append(":")
-					.append(iter->second).append("\n");
-	}
-
-	//Signature
-	std::string canonicalizedResource="/"+path.bucket_+path.path_;
-	std::string stringToSign = verb + "\n" +
-		try_get(opts, "content-md5") + "\n" +
-		try_get(opts, "content-type") + "\n" +
-		/*date_header +*/ "\n" +
-		amz_headers +
-		canonicalizedResource;
-	std::string sign_res=sign(stringToSign) ;
-	if (sign_res.empty())
-		sign_res.empty();
-
-	std::string auth="Authorization: AWS "+conn_data_->api_key_+":"+sign_res;
+	request_signer &signer=*conn_data_->signer_;
+	std::string &str=signer.buffer();
+	str.append(verb).append("\n");
+	str.append(try_get(opts, "content-md5")).append("\n");
+	str.append(try_get(opts, "content-type")).append("\n");
+	str.append("\n"); //The date is sent as x-amz-date
+
+	//The headers are already sorted case-insensitively, our date goes
+	//in its place among them and replaces the caller's one
+	bool date_added=false;
+	for(auto iter = opts.begin(); iter!=opts.end();++iter)
+	{
+		const std::string &name=iter->first;
+		if (strncasecmp(name.c_str(), "x-amz", 5))
+			continue;
+		int cmp=strcasecmp(name.c_str(), "x-amz-date");
+		if (!date_added && cmp>=0)
+		{
+			str.append("x-amz-date:").append(date_header).append("\n");
+			date_added=true;
+		}
+		if (cmp==0)
+			continue;
+		for(size_t f=0;f<name.size();++f)
+			str.push_back(tolower(name[f]));
+		str.append(":").append(iter->second).append("\n");
+	}
+	if (!date_added)
+		str.append("x-amz-date:").append(date_header).append("\n");
+
+	//Canonicalized resource
+	str.append("/").append(path.bucket_).append(path.path_);
+
+	std::string auth="Authorization: AWS "+signer.api_key()+":"+
+			signer.sign_v2(str);
 	return curl_slist_append(header_list, auth.c_str());
 }
 
-std::string s3_connection::sign(const std::string &str)
+//SHA-256 of an empty payload
+#define EMPTY_PAYLOAD_SHA256 \
+	"e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"
+
+/**
+  Maps the zone of a path to the region name used by SigV4.
+  */
+static std::string region_of(const std::string &zone)
 {
-	if (str.length() >= INT_MAX)
-		throw std::bad_exception();
+	if (zone=="s3" || zone=="s3-external-1")
+		return "us-east-1";
+	if (zone=="s3-EU")
+		return "eu-west-1";
+	if (zone.compare(0, 3, "s3-")==0 || zone.compare(0, 3, "s3.")==0)
+		return zone.substr(3);
+	return zone;
+}
 
-	const std::string &secret_key = conn_data_->secret_key;
-	char md[EVP_MAX_MD_SIZE+1]={0};
-	unsigned int md_len=0;
-	HMAC(EVP_sha1(),
-				  secret_key.c_str(),
-				  secret_key.length(),
-				  (const unsigned char*)str.c_str(), str.length(),
-				  (unsigned char*)md, &md_len);
-	return base64_encode(md, md_len);
+static void uri_encode(std::string &out, const std::string &str,
+					   bool keep_slash)
+{
+	static const char digits[]="0123456789ABCDEF";
+	for(size_t f=0;f<str.size();++f)
+	{
+		unsigned char c=str[f];
+		if (isalnum(c) || c=='-' || c=='_' || c=='.' || c=='~' ||
+				(keep_slash && c=='/'))
+			out.push_back(c);
+		else
+			out.append(1, '%').append(1, digits[c>>4])
+					.append(1, digits[c&0xF]);
+	}
+}
+
+static std::string unescape(const std::string &str)
+{
+	char *res=curl_unescape(str.c_str(), str.length());
+	ON_BLOCK_EXIT(&curl_free,res);
+	return std::string(res);
+}
+
+/**
+  Appends the parameters of the query (possibly escaped already)
+  sorted and encoded as SigV4 expects them.
+  */
+static void append_canonical_query(std::string &out, const std::string &query)
+{
+	std::vector<std::pair<std::string, std::string> > params;
+	size_t pos=0;
+	while(pos<query.size())
+	{
+		size_t end=query.find('&', pos);
+		if (end==std::string::npos)
+			end=query.size();
+		std::string param=query.substr(pos, end-pos);
+		size_t eq=param.find('=');
+		if (!param.empty())
+			params.push_back(std::make_pair(unescape(param.substr(0, eq)),
+				eq==std::string::npos ? "" : unescape(param.substr(eq+1))));
+		pos=end+1;
+	}
+	std::sort(params.begin(), params.end());
+
+	for(auto iter=params.begin();iter!=params.end();++iter)
+	{
+		if (iter!=params.begin())
+			out.append("&");
+		uri_encode(out, iter->first, false);
+		out.append("=");
+		uri_encode(out, iter->second, false);
+	}
+}
+
+curl_slist* s3_connection::authenticate_v4(struct curl_slist * header_list,
+	const std::string &verb, const s3_path &path, const std::string &args,
+	const header_map_t &opts)
+{
+	time_t now=time(NULL);
+	struct tm timeinfo={0};
+	gmtime_r(&now, &timeinfo);
+	char timestamp[32]={0};
+	strftime(timestamp, sizeof(timestamp), "%Y%m%dT%H%M%SZ", &timeinfo);
+	std::string date(timestamp, 8);
+	std::string region=region_of(path.zone_);
+
+	//All the headers are signed, sorted by their lowercase names
+	std::map<std::string, std::string> signed_hdrs;
+	for(auto iter = opts.begin(); iter!=opts.end();++iter)
+	{
+		std::string name;
+		for(size_t f=0;f<iter->first.size();++f)
+			name.push_back(tolower(iter->first[f]));
+		signed_hdrs[name]=trim(iter->second);
+	}
+	signed_hdrs["host"]=host_of(path);
+	signed_hdrs["x-amz-date"]=timestamp;
+	header_list = curl_slist_append(header_list,
+		(std::string("x-amz-date: ")+timestamp).c_str());
+	std::string payload=try_get(opts, "x-amz-content-sha256");
+	if (payload.empty())
+	{
+		payload=EMPTY_PAYLOAD_SHA256;
+		signed_hdrs["x-amz-content-sha256"]=payload;
+		header_list = curl_slist_append(header_list,
+			("x-amz-content-sha256: "+payload).c_str());
+	}
+
+	//Canonical request
+	request_signer &signer=*conn_data_->signer_;
+	std::string &req=signer.buffer();
+	req.append(verb).append("\n");
+	size_t query_pos=path.path_.find('?');
+	if (!conn_data_->endpoint_.empty())
+		uri_encode(req, "/"+path.bucket_, true);
+	uri_encode(req, path.path_.substr(0, query_pos), true);
+	req.append("\n");
+	std::string query=query_pos==std::string::npos ? "" :
+			path.path_.substr(query_pos+1);
+	if (!args.empty())
+	{
+		if (!query.empty())
+			query.append("&");
+		query.append(args[0]=='?' ? args.substr(1) : args);
+	}
+	append_canonical_query(req, query);
+	req.append("\n");
+	std::string names;
+	for(auto iter=signed_hdrs.begin();iter!=signed_hdrs.end();++iter)
+	{
+		req.append(iter->first).append(":").append(iter->second).append("\n");
+		if (!names.empty())
+			names.append(";");
+		names.append(iter->first);
+	}
+	req.append("\n").append(names).append("\n").append(payload);
+
+	sig_timestamp_=timestamp;
+	sig_scope_=date+"/"+region+"/s3/aws4_request";
+	std::string to_sign="AWS4-HMAC-SHA256\n"+sig_timestamp_+"\n"+
+			sig_scope_+"\n"+request_signer::sha256_hex(req.data(), req.size());
+	seed_signature_=signer.sign_v4(to_sign, date, region);
+
+	std::string auth="Authorization: AWS4-HMAC-SHA256 Credential="+
+			signer.api_key()+"/"+sig_scope_+", SignedHeaders="+names+
+			", Signature="+seed_signature_;
+	return curl_slist_append(header_list, auth.c_str());
 }
 
 static size_t string_appender(const char *ptr,
@@ -238,14 +408,12 @@ std::string s3_connection::read_fully(const std::string &verb,
 {
 	std::string res;
 	curl_ptr_t curl=conn_data_->get_curl(path.zone_, path.bucket_);
-	prepare(curl, verb, path, opts);
-	if (!args.empty())
-		set_url(curl, path, args);
+	prepare(curl, verb, path, opts, args);
 	checked(curl, curl_easy_setopt(
 				curl.get(), CURLOPT_WRITEFUNCTION, &string_appender));
 	checked(curl,curl_easy_setopt(
 				curl.get(), CURLOPT_WRITEDATA, &res));
-	checked(curl,curl_easy_perform(curl.get()));
+	checked(curl, perform(curl));
 	check_for_errors(curl, res);
 	return res;
 }
@@ -258,104 +426,164 @@ static std::string extract_leaf(const std::string &path)
 	return path.substr(idx+1);
 }
 
+s3_directory_ptr s3_connection::make_listing_target(const s3_path &path,
+													bool try_to_root)
+{
+	s3_path root=path;
+	if (try_to_root && *path.path_.rbegin() != '/')
+	{
+		size_t pos=path.path_.find_last_of('/');
+		if (pos==std::string::npos)
+			root.path_ = "/";
+		else
+			root.path_ = path.path_.substr(0, pos+1);
+	}
+	return s3_dir_tree::make_root(root, "");
+}
+
 s3_directory_ptr s3_connection::list_files_shallow(const s3_path &path,
 	s3_directory_ptr target, bool try_to_root)
 {
 	if (!target)
-	{
-		target=s3_directory_ptr(new s3_directory());
-		target->absolute_name_ = path;
-		if (try_to_root && *path.path_.rbegin() != '/')
-		{
-			size_t pos=path.path_.find_last_of('/');
-			if (pos==std::string::npos)
-				target->absolute_name_.path_ = "/";
-			else
-				target->absolute_name_.path_ = path.path_.substr(0, pos+1);
-		}
-	}
+		target=make_listing_target(path, try_to_root);
 
 	std::string marker;
-	while(true)
-	{
-		std::string args;
-		assert(!path.path_.empty() && path.path_[0]=='/');
+	while(list_page(path, target, marker, "", &marker, 0))
+		;
+	target->files_.seal();
+	return target;
+}
 
-		std::string no_leading_slash = path.path_.substr(1);
-		if (no_leading_slash.empty())
-			args="?marker="+escape(marker)+"&delimiter=/";
-		else
-			args="?prefix="+escape(no_leading_slash)+
-					"&marker="+escape(marker)+"&delimiter=/";
+void es3::seal_listing(const s3_directory_ptr &dir)
+{
+	dir->files_.seal();
+	for(size_t f=0;f<dir->num_subdirs();++f)
+		seal_listing(dir->subdir(f));
+}
 
-		s3_path root=path;
-		root.path_="/";
-		std::string list=read_fully("GET", root, args);
+/**
+  Feeds the listing to the parser as curl receives it. Files go straight
+  into the directory, prefixes are only added once the page is complete
+  so that a failed page can be retried without losing subdirectories.
+  */
+class listing_write_data
+{
+	CURL *curl_;
+	s3_directory_ptr target_;
+	const std::string &last_;
+	std::string error_body_;
+	bool checked_code_, is_error_;
+public:
+	//Some names of the page are past 'last', so the range is done
+	bool past_last_;
+	std::vector<std::string> prefixes_;
+	listing_parser parser_; //Last, its callback uses the fields above
+
+	listing_write_data(CURL *curl, s3_directory_ptr target,
+					   const std::string &last)
+		: curl_(curl), target_(target), last_(last),
+		  checked_code_(), is_error_(), past_last_(),
+		  parser_(boost::bind(&listing_write_data::on_entry, this, _1))
+	{
+	}
 
-		TiXmlDocument doc;
-		doc.Parse(list.c_str());
-		if (doc.Error())
-			err(errWarn) << "Failed to get file listing from /" << path;
-		TiXmlHandle docHandle(&doc);
+	const std::string& error_body() const { return error_body_; }
 
-		TiXmlNode *node=docHandle.FirstChild("ListBucketResult")
-				.FirstChild("IsTruncated")
-				.ToNode();
-		if (!node)
-			break;
-		node=node->NextSibling();
-		if (!node)
-			break;
+	static size_t write_func(const char *bufptr, size_t size,
+							 size_t nitems, void *userp)
+	{
+		return reinterpret_cast<listing_write_data*>(userp)->simple_write(
+					bufptr, size*nitems);
+	}
 
-		while(node)
+	size_t simple_write(const char *bufptr, size_t size)
+	{
+		if (!checked_code_)
 		{
-			std::string name;
-			if (strcmp(node->Value(), "Contents")==0)
-			{
-				name = node->FirstChild("Key")->
-						FirstChild()->ToText()->Value();
-				std::string size = node->FirstChild("Size")->
-						FirstChild()->ToText()->Value();
-				std::string mtime = node->FirstChild("LastModified")->
-						FirstChild()->ToText()->Value();
-				if (*name.rbegin()!='/')
-				{
-					//Yes, Virginia, there are directory-like-files in S3
-					s3_file_ptr fl(new s3_file());
-					fl->name_ = extract_leaf(name);
-					fl->absolute_name_=derive(target->absolute_name_,
-											  fl->name_);
-					fl->size_ = atoll(size.c_str());
-					fl->mtime_str_ = mtime;
-					fl->parent_ = target;
-					target->files_[fl->name_]=fl;
-				}
-			} else if (strcmp(node->Value(), "CommonPrefixes")==0)
-			{
-				name = node->FirstChild("Prefix")->
-						FirstChild()->ToText()->Value();
-				//Trim trailing '/'
-				std::string trimmed_name=name.substr(0, name.size()-1);
-				s3_directory_ptr dir(new s3_directory());
-				dir->name_ = extract_leaf(trimmed_name);
-				dir->absolute_name_=derive(target->absolute_name_,
-										   dir->name_+"/");
-				dir->parent_ = target;
-				target->subdirs_[dir->name_] = dir;
-			}
-
-			node=node->NextSibling();
-			if (!node)
-				marker = name;
+			long code=200;
+			curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &code);
+			is_error_=code>=400;
+			checked_code_=true;
 		}
+		if (is_error_)
+			error_body_.append(bufptr, size);
+		else
+			parser_.feed(bufptr, size);
+		return size;
+	}
 
-		std::string is_trunc=docHandle.FirstChild("ListBucketResult")
-				.FirstChild("IsTruncated").FirstChild().Text()->Value();
-		if (is_trunc=="false")
-			break;
+	bool on_entry(const listing_entry &entry)
+	{
+		if (entry.name_.empty())
+			return true;
+		if (!last_.empty() && entry.name_>last_)
+		{
+			//Skipped one by one, the prefixes of the range come after
+			//all the keys of the page
+			past_last_=true;
+			return true;
+		}
+		if (entry.is_prefix_)
+		{
+			prefixes_.push_back(entry.name_);
+			return true;
+		}
+		//Yes, Virginia, there are directory-like-files in S3
+		if (*entry.name_.rbegin()=='/')
+			return true;
+
+		s3_file fl;
+		fl.size_ = entry.size_;
+		fl.mtime_ = parse_iso_time(entry.mtime_str_);
+		std::string leaf=extract_leaf(entry.name_);
+		std::string etag=normalize_etag(entry.etag_);
+
+		//Other pages of the same directory might be listed concurrently
+		guard_t lock(target_->lock());
+		target_->files_.add(leaf, fl, etag);
+		return true;
 	}
+};
 
-	return target;
+bool s3_connection::list_page(const s3_path &path, s3_directory_ptr target,
+	const std::string &marker, const std::string &last,
+	std::string *next_marker, std::vector<s3_directory_ptr> *new_dirs)
+{
+	std::string args;
+	assert(!path.path_.empty() && path.path_[0]=='/');
+
+	std::string no_leading_slash = path.path_.substr(1);
+	if (no_leading_slash.empty())
+		args="?marker="+escape(marker)+"&delimiter=/";
+	else
+		args="?prefix="+escape(no_leading_slash)+
+				"&marker="+escape(marker)+"&delimiter=/";
+
+	s3_path root=path;
+	root.path_="/";
+	curl_ptr_t curl=conn_data_->get_curl(root.zone_, root.bucket_);
+	prepare(curl, "GET", root, header_map_t(), args);
+
+	listing_write_data data(curl.get(), target, last);
+	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION,
+								   &listing_write_data::write_func));
+	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &data));
+	checked(curl, perform(curl));
+	check_for_errors(curl, data.error_body());
+
+	guard_t lock(target->lock());
+	for(auto iter=data.prefixes_.begin();iter!=data.prefixes_.end();++iter)
+	{
+		//Trim trailing '/'
+		std::string trimmed_name=iter->substr(0, iter->size()-1);
+		//Adjacent ranges can both see the same prefix
+		s3_directory_ptr dir=target->add_subdir(extract_leaf(trimmed_name));
+		if (dir && new_dirs)
+			new_dirs->push_back(dir);
+	}
+
+	*next_marker=data.parser_.next_marker();
+	return !data.past_last_ && data.parser_.is_truncated();
 }
 
 static std::string find_header(void *ptr, size_t size, size_t nmemb,
@@ -398,10 +626,21 @@ static size_t find_mtime(void *ptr, size_t size, size_t nmemb, void *userdata)
 	if (cmpr=="true")
 		info->compressed_=true;
 
+	//Objects without the codec were compressed with GZIP
+	std::string codec=find_header(ptr, size, nmemb, "x-amz-meta-codec");
+	if (codec==codec_name(codecZstd))
+		info->codec_=codecZstd;
+	else if (codec==codec_name(codecLz4))
+		info->codec_=codecLz4;
+
 	std::string md=find_header(ptr, size, nmemb, "x-amz-meta-file-mode");
 	if (!md.empty())
 		info->mode_ = atoll(md.c_str());
 
+	std::string etag=find_header(ptr, size, nmemb, "etag");
+	if (!etag.empty())
+		info->etag_=normalize_etag(etag);
+
 	return size*nmemb;
 }
 
@@ -413,101 +652,426 @@ static size_t find_etag(void *ptr, size_t size, size_t nmemb, void *userdata)
 	return size*nmemb;
 }
 
-file_desc s3_connection::find_mtime_and_size(const s3_path &path)
+void s3_connection::prepare_head(curl_ptr_t curl, const s3_path &path,
+								 file_desc *result)
 {
-	file_desc result={0};
-	result.compressed_=false;
-	result.mode_ = 0664;
-	result.remote_size_=result.raw_size_=0;
+	*result=file_desc();
+	result->compressed_=false;
+	result->codec_=codecGzip;
+	result->mode_ = 0664;
+	result->remote_size_=result->raw_size_=0;
 
-	curl_ptr_t curl=conn_data_->get_curl(path.zone_, path.bucket_);
 	prepare(curl, "HEAD", path);
 	//last-modified
 	checked(curl, curl_easy_setopt(
 				curl.get(), CURLOPT_HEADERFUNCTION, &::find_mtime));
-	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA, &result));
+	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA, result));
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_NOBODY, 1));
-	checked(curl, curl_easy_perform(curl.get()));
+}
 
+void s3_connection::finish_head(curl_ptr_t curl, file_desc *result)
+{
 	long code=404;
 	checked(curl, curl_easy_getinfo(curl.get(), CURLINFO_RESPONSE_CODE, &code));
-	result.found_=code!=404;
-	
-	if (result.raw_size_==0)
-		result.raw_size_=result.remote_size_;
+	result->found_=code!=404;
+
+	if (result->raw_size_==0)
+		result->raw_size_=result->remote_size_;
+}
+
+file_desc s3_connection::find_mtime_and_size(const s3_path &path)
+{
+	file_desc result;
+	curl_ptr_t curl=conn_data_->get_curl(path.zone_, path.bucket_);
+	prepare_head(curl, path, &result);
+	checked(curl, perform(curl));
+	finish_head(curl, &result);
 	return result;
 }
 
-class buf_data
+namespace es3
+{
+	struct head_request
+	{
+		boost::shared_ptr<s3_connection> conn_;
+		curl_ptr_t curl_;
+		file_desc result_;
+		desc_callback_t on_done_;
+	};
+}; //namespace es3
+
+void s3_connection::find_mtime_and_size_async(const context_ptr &ctx,
+	const s3_path &path, desc_callback_t on_done)
+{
+	assert(ctx->engine_);
+	boost::shared_ptr<head_request> req(new head_request());
+	req->conn_.reset(new s3_connection(ctx));
+	req->curl_=ctx->get_curl(path.zone_, path.bucket_);
+	req->on_done_=on_done;
+	req->conn_->prepare_head(req->curl_, path, &req->result_);
+
+	ctx->engine_->submit(req->curl_,
+						 boost::bind(&s3_connection::on_head_done, req, _1));
+}
+
+void s3_connection::on_head_done(boost::shared_ptr<head_request> req,
+								 int curl_code)
+{
+	result_code_t res;
+	try
+	{
+		req->conn_->checked(req->curl_, curl_code);
+		req->conn_->finish_head(req->curl_, &req->result_);
+	} catch(const es3_exception &ex)
+	{
+		res=ex.err();
+	}
+	req->on_done_(req->result_, res);
+}
+
+namespace es3
+{
+	/**
+	  Source of the request body, calculates MD5 of the data as it's
+	  handed over to CURL.
+	  */
+	class upload_source
+	{
+		MD5_CTX md5_ctx;
+	public:
+		upload_source()
+		{
+			MD5_Init(&md5_ctx);
+		}
+		virtual ~upload_source() {}
+
+		std::string get_md5()
+		{
+			unsigned char md[MD5_DIGEST_LENGTH+1]={0};
+			MD5_Final(md, &md5_ctx);
+			return tobinhex(md, MD5_DIGEST_LENGTH);
+		}
+
+		static size_t read_func(char *bufptr, size_t size,
+								size_t nitems, void *userp)
+		{
+			return reinterpret_cast<upload_source*>(userp)->read(
+				bufptr, size*nitems);
+		}
+
+		virtual size_t read(char *bufptr, size_t size)
+		{
+			size_t res=simple_read(bufptr, size);
+			if (res!=0 && res!=CURL_READFUNC_ABORT)
+				MD5_Update(&md5_ctx, bufptr, res);
+			return res;
+		}
+
+		virtual size_t simple_read(char *bufptr, size_t size) = 0;
+	};
+}; //namespace es3
+
+class buf_data : public upload_source
 {
 	const char *buf_;
 	size_t total_size_;
 	size_t written_;
-	MD5_CTX md5_ctx;
 public:
 	buf_data(const char *buf, size_t total_size)
 		: buf_(buf), total_size_(total_size), written_()
 	{
-		MD5_Init(&md5_ctx);
 	}
 
-	std::string get_md5()
+	virtual size_t simple_read(char *bufptr, size_t size)
 	{
-		unsigned char md[MD5_DIGEST_LENGTH+1]={0};
-		MD5_Final(md, &md5_ctx);
-		return tobinhex(md, MD5_DIGEST_LENGTH);
+		size_t tocopy = std::min(total_size_-written_, size);
+		if (tocopy!=0)
+		{
+			memcpy(bufptr, buf_+written_, tocopy);
+			written_+=tocopy;
+		}
+		return tocopy;
 	}
+};
 
-	static size_t read_func(char *bufptr, size_t size,
-							size_t nitems, void *userp)
+/**
+  Reads the data straight from the file into the CURL's buffer,
+  without any intermediate copies.
+  */
+class file_data : public upload_source
+{
+	int fd_;
+	uint64_t offset_;
+	size_t total_size_;
+	size_t written_;
+public:
+	file_data(int fd, uint64_t offset, size_t total_size)
+		: fd_(fd), offset_(offset), total_size_(total_size), written_()
 	{
-		return reinterpret_cast<buf_data*>(userp)->simple_read(
-					bufptr, size*nitems);
 	}
 
-	size_t simple_read(char *bufptr, size_t size)
+	virtual size_t simple_read(char *bufptr, size_t size)
 	{
-		size_t tocopy = std::min(total_size_-written_, size);
-		if (tocopy!=0)
+		size_t toread = std::min(total_size_-written_, size);
+		if (toread==0)
+			return 0;
+
+		ssize_t res=pread(fd_, bufptr, toread, offset_+written_);
+		if (res<=0)
+			return CURL_READFUNC_ABORT; //File got truncated?
+		written_+=res;
+		return res;
+	}
+};
+
+//Payload chunks of the streaming SigV4 uploads, all of them but the
+//last one have to be at least 8Kb
+#define SIGV4_CHUNK_SIZE (64*1024)
+#define STREAMING_PAYLOAD "STREAMING-AWS4-HMAC-SHA256-PAYLOAD"
+#define CHUNK_SIGNATURE ";chunk-signature="
+
+/**
+  Sends the data of another source with the aws-chunked encoding. Each
+  chunk is signed in a chain that starts from the request's signature,
+  so the payload doesn't have to be hashed before the request. The MD5
+  of the raw data is still calculated by the inner source.
+  */
+class chunked_source : public upload_source
+{
+	upload_source &inner_;
+	request_signer &signer_;
+	const std::string timestamp_, scope_;
+	std::string date_, region_, prev_signature_;
+	std::vector<char> chunk_;
+	std::string out_;
+	size_t out_pos_;
+	bool done_;
+public:
+	chunked_source(upload_source &inner, request_signer &signer,
+				   const std::string &timestamp, const std::string &scope,
+				   const std::string &seed_signature)
+		: inner_(inner), signer_(signer), timestamp_(timestamp),
+		  scope_(scope), prev_signature_(seed_signature),
+		  chunk_(SIGV4_CHUNK_SIZE), out_pos_(), done_()
+	{
+		//The scope is date/region/service/aws4_request
+		size_t region_pos=scope.find('/')+1;
+		date_=scope.substr(0, region_pos-1);
+		region_=scope.substr(region_pos, scope.find('/', region_pos)-region_pos);
+	}
+
+	static uint64_t encoded_size(uint64_t size)
+	{
+		uint64_t full=size/SIGV4_CHUNK_SIZE, rest=size%SIGV4_CHUNK_SIZE;
+		uint64_t res=full*(SIGV4_CHUNK_SIZE+overhead(SIGV4_CHUNK_SIZE));
+		if (rest)
+			res+=rest+overhead(rest);
+		return res+overhead(0); //The final empty chunk
+	}
+
+	virtual size_t read(char *bufptr, size_t size)
+	{
+		return simple_read(bufptr, size); //The framing is not hashed
+	}
+
+	virtual size_t simple_read(char *bufptr, size_t size)
+	{
+		if (out_pos_==out_.size())
 		{
-			memcpy(bufptr, buf_+written_, tocopy);
-			MD5_Update(&md5_ctx, bufptr, tocopy);
-			written_+=tocopy;
+			if (done_)
+				return 0;
+			if (!next_chunk())
+				return CURL_READFUNC_ABORT;
 		}
+		size_t tocopy=std::min(size, out_.size()-out_pos_);
+		memcpy(bufptr, out_.data()+out_pos_, tocopy);
+		out_pos_+=tocopy;
 		return tocopy;
 	}
+
+private:
+	static uint64_t overhead(size_t len)
+	{
+		char hdr[32];
+		int hdr_len=snprintf(hdr, sizeof(hdr), "%zx", len);
+		return hdr_len+strlen(CHUNK_SIGNATURE)+64+4; //Two CRLFs
+	}
+
+	bool next_chunk()
+	{
+		size_t len=0;
+		while(len<chunk_.size())
+		{
+			size_t res=inner_.read(&chunk_[len], chunk_.size()-len);
+			if (res==CURL_READFUNC_ABORT)
+				return false;
+			if (res==0)
+				break;
+			len+=res;
+		}
+		done_=(len==0);
+
+		std::string to_sign="AWS4-HMAC-SHA256-PAYLOAD\n"+timestamp_+"\n"+
+				scope_+"\n"+prev_signature_+"\n" EMPTY_PAYLOAD_SHA256 "\n"+
+				request_signer::sha256_hex(&chunk_[0], len);
+		prev_signature_=signer_.sign_v4(to_sign, date_, region_);
+
+		char hdr[32];
+		snprintf(hdr, sizeof(hdr), "%zx", len);
+		out_.assign(hdr).append(CHUNK_SIGNATURE).append(prev_signature_);
+		out_.append("\r\n").append(&chunk_[0], len).append("\r\n");
+		out_pos_=0;
+		return true;
+	}
 };
 
+namespace es3
+{
+	/**
+	  Body of a PUT request and the response that is collected for it.
+	  */
+	struct upload_body
+	{
+		upload_source &data_;
+		boost::scoped_ptr<chunked_source> chunked_;
+		std::string etag_, result_;
+
+		upload_body(upload_source &data) : data_(data) {}
+	};
+
+	struct upload_request
+	{
+		boost::shared_ptr<s3_connection> conn_;
+		curl_ptr_t curl_;
+		boost::scoped_ptr<upload_source> data_;
+		upload_body body_;
+		upload_callback_t on_done_;
+
+		upload_request(upload_source *data) : data_(data), body_(*data) {}
+	};
+}; //namespace es3
+
 std::string s3_connection::upload_data(const s3_path &path,
 	const char *data, size_t size, const header_map_t& opts)
 {
 	assert(data);
+	buf_data read_data(data, size);
+	return do_upload(path, read_data, size, opts);
+}
+
+void s3_connection::upload_data_async(const context_ptr &ctx,
+	const s3_path &path, const char *data, size_t size,
+	const header_map_t &opts, upload_callback_t on_done)
+{
+	assert(data);
+	submit_upload(ctx, path, new buf_data(data, size), size, opts, on_done);
+}
 
+void s3_connection::upload_file_async(const context_ptr &ctx,
+	const s3_path &path, int fd, uint64_t offset, size_t size,
+	const header_map_t &opts, upload_callback_t on_done)
+{
+	submit_upload(ctx, path, new file_data(fd, offset, size), size, opts,
+				  on_done);
+}
+
+void s3_connection::submit_upload(const context_ptr &ctx,
+	const s3_path &path, upload_source *source, uint64_t size,
+	const header_map_t &opts, upload_callback_t on_done)
+{
+	assert(ctx->engine_);
+	boost::shared_ptr<upload_request> req(new upload_request(source));
+	req->conn_.reset(new s3_connection(ctx));
+	req->curl_=ctx->get_curl(path.zone_, path.bucket_);
+	req->on_done_=on_done;
+	req->conn_->prepare_upload(req->curl_, path, req->body_, size, opts);
+
+	ctx->engine_->submit(req->curl_,
+						 boost::bind(&s3_connection::on_upload_done, req, _1));
+}
+
+void s3_connection::on_upload_done(boost::shared_ptr<upload_request> req,
+								   int curl_code)
+{
+	result_code_t res;
 	std::string etag;
-	buf_data read_data(data, size);
+	try
+	{
+		req->conn_->checked(req->curl_, curl_code);
+		etag=req->conn_->finish_upload(req->curl_, req->body_);
+	} catch(const es3_exception &ex)
+	{
+		res=ex.err();
+	}
+	req->on_done_(etag, res);
+}
+
+std::string s3_connection::upload_file(const s3_path &path,
+	int fd, uint64_t offset, size_t size, const header_map_t& opts)
+{
+	file_data read_data(fd, offset, size);
+	return do_upload(path, read_data, size, opts);
+}
 
+std::string s3_connection::do_upload(const s3_path &path,
+	upload_source &read_data, uint64_t size, const header_map_t& opts)
+{
+	upload_body body(read_data);
 	curl_ptr_t curl=conn_data_->get_curl(path.zone_, path.bucket_);
-	prepare(curl, "PUT", path, opts);
+	prepare_upload(curl, path, body, size, opts);
+	checked(curl, perform(curl));
+	return finish_upload(curl, body);
+}
+
+void s3_connection::prepare_upload(curl_ptr_t curl, const s3_path &path,
+	upload_body &body, uint64_t size, const header_map_t& opts)
+{
+	//With SigV4 the payload is signed as it's streamed
+	header_map_t my_opts=opts;
+	uint64_t body_size=size;
+	if (conn_data_->use_sigv4_)
+	{
+		std::string encoding=try_get(opts, "Content-Encoding");
+		my_opts["Content-Encoding"]=encoding.empty() ? "aws-chunked" :
+				"aws-chunked,"+encoding;
+		my_opts["x-amz-content-sha256"]=STREAMING_PAYLOAD;
+		my_opts["x-amz-decoded-content-length"]=int_to_string(size);
+		body_size=chunked_source::encoded_size(size);
+	}
+
+	prepare(curl, "PUT", path, my_opts);
+	upload_source *source=&body.data_;
+	if (conn_data_->use_sigv4_)
+	{
+		body.chunked_.reset(new chunked_source(body.data_,
+			*conn_data_->signer_, sig_timestamp_, sig_scope_,
+			seed_signature_));
+		source=body.chunked_.get();
+	}
 	checked(curl, curl_easy_setopt(curl.get(),
 								   CURLOPT_HEADERFUNCTION, &find_etag));
-	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA, &etag));
+	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_HEADERDATA,
+								   &body.etag_));
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_UPLOAD, 1));
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_INFILESIZE_LARGE,
-							 uint64_t(size)));
+							 body_size));
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_READFUNCTION,
-							 &buf_data::read_func));
-	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_READDATA, &read_data));
+							 &upload_source::read_func));
+	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_READDATA, source));
 
-	std::string result;
 	checked(curl, curl_easy_setopt(curl.get(),
 								   CURLOPT_WRITEFUNCTION, &string_appender));
-	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &result));
+	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA,
+								   &body.result_));
+}
 
-	checked(curl, curl_easy_perform(curl.get()));
-	check_for_errors(curl, result);
+std::string s3_connection::finish_upload(curl_ptr_t curl, upload_body &body)
+{
+	check_for_errors(curl, body.result_);
 
+	const std::string &etag=body.etag_;
 	if (!etag.empty() &&
-			strcasecmp(etag.c_str(), ("\""+read_data.get_md5()+"\"").c_str()))
+			strcasecmp(etag.c_str(), ("\""+body.data_.get_md5()+"\"").c_str()))
 		abort(); //Data corruption. This SHOULD NOT happen!
 
 	return etag;
@@ -554,17 +1118,96 @@ std::string s3_connection::complete_multipart(const s3_path &path,
 
 	s3_path up_path=path;
 	up_path.path_+="?uploadId="+upload_id;
+	std::string read_data=post_data(up_path, data);
+
+	TiXmlDocument doc;
+	doc.Parse(read_data.c_str());
+	TiXmlNode *node=TiXmlHandle(&doc)
+			.FirstChild("CompleteMultipartUploadResult")
+			.FirstChild("ETag")
+			.FirstChild()
+			.ToText();
+
+	VLOG(2) << "Completed multipart of " << path;
+	return node ? normalize_etag(node->Value()) : std::string();
+}
+
+part_map_t s3_connection::list_parts(const s3_path &path,
+									const std::string &upload_id)
+{
+	part_map_t res;
+	s3_path up_path=path;
+	up_path.path_+="?uploadId="+upload_id;
+	std::string marker;
+	while(true)
+	{
+		std::string args;
+		if (!marker.empty())
+			args="&part-number-marker="+marker;
+		std::string list=read_fully("GET", up_path, args);
+
+		TiXmlDocument doc;
+		doc.Parse(list.c_str());
+		if (doc.Error())
+			err(errWarn) << "Failed to list the parts of " << path;
+		TiXmlNode *result=TiXmlHandle(&doc).FirstChild("ListPartsResult")
+				.ToNode();
+		if (!result)
+			err(errWarn) << "Incorrect document format - no parts list";
+		for(TiXmlNode *node=result->FirstChild("Part"); node;
+			node=node->NextSibling("Part"))
+		{
+			TiXmlHandle part(node);
+			TiXmlText *num=part.FirstChild("PartNumber").FirstChild().ToText();
+			TiXmlText *etag=part.FirstChild("ETag").FirstChild().ToText();
+			TiXmlText *size=part.FirstChild("Size").FirstChild().ToText();
+			if (!num || !etag || !size)
+				continue;
+			uploaded_part &cur=res[strtoul(num->Value(), 0, 10)];
+			cur.etag_=normalize_etag(etag->Value());
+			cur.size_=strtoull(size->Value(), 0, 10);
+		}
+
+		TiXmlText *truncated=TiXmlHandle(result).FirstChild("IsTruncated")
+				.FirstChild().ToText();
+		TiXmlText *next=TiXmlHandle(result).FirstChild("NextPartNumberMarker")
+				.FirstChild().ToText();
+		if (!truncated || strcmp(truncated->Value(), "true") || !next)
+			break;
+		marker=next->Value();
+	}
+	VLOG(2) << "Found " << res.size() << " uploaded parts of " << path;
+	return res;
+}
+
+void s3_connection::abort_multipart(const s3_path &path,
+									const std::string &upload_id)
+{
+	s3_path up_path=path;
+	up_path.path_+="?uploadId="+upload_id;
+	read_fully("DELETE", up_path);
+	VLOG(2) << "Aborted multipart of " << path;
+}
+
+std::string s3_connection::post_data(const s3_path &path,
+	const std::string &data, const header_map_t &opts)
+{
+	header_map_t my_opts=opts;
+	if (conn_data_->use_sigv4_)
+		my_opts["x-amz-content-sha256"]=request_signer::sha256_hex(
+			data.data(), data.size());
 
 	curl_ptr_t curl=conn_data_->get_curl(path.zone_, path.bucket_);
-	prepare(curl, "POST", up_path);
+	prepare(curl, "POST", path, my_opts);
 
 	buf_data data_params(data.c_str(), data.size());
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_UPLOAD, 1));
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_INFILESIZE_LARGE,
 							 uint64_t(data.size())));
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_READFUNCTION,
-							 &buf_data::read_func));
-	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_READDATA, &data_params));
+							 &upload_source::read_func));
+	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_READDATA,
+								   static_cast<upload_source*>(&data_params)));
 
 	std::string read_data;
 	checked(curl, curl_easy_setopt(
@@ -572,13 +1215,83 @@ std::string s3_connection::complete_multipart(const s3_path &path,
 	checked(curl, curl_easy_setopt(
 				curl.get(), CURLOPT_WRITEDATA, &read_data));
 
-	checked(curl, curl_easy_perform(curl.get()));
+	checked(curl, perform(curl));
 	check_for_errors(curl, read_data);
-
-	VLOG(2) << "Completed multipart of " << path;
 	return read_data;
 }
 
+static std::string xml_escape(const std::string &str)
+{
+	std::string res;
+	res.reserve(str.size());
+	for(auto iter=str.begin();iter!=str.end();++iter)
+	{
+		switch(*iter)
+		{
+		case '&': res.append("&amp;"); break;
+		case '<': res.append("&lt;"); break;
+		case '>': res.append("&gt;"); break;
+		case '"': res.append("&quot;"); break;
+		case '\'': res.append("&apos;"); break;
+		default: res.push_back(*iter);
+		}
+	}
+	return res;
+}
+
+std::vector<delete_error> s3_connection::delete_objects(
+	const std::vector<s3_path> &paths)
+{
+	assert(!paths.empty() && paths.size()<=MAX_DELETE_BATCH);
+
+	//Quiet mode reports only the keys that failed
+	std::string data="<Delete><Quiet>true</Quiet>";
+	std::map<std::string, s3_path> by_key;
+	for(auto iter=paths.begin();iter!=paths.end();++iter)
+	{
+		std::string key=iter->path_.substr(1); //Without the leading '/'
+		by_key[key]=*iter;
+		data.append("<Object><Key>").append(xml_escape(key))
+				.append("</Key></Object>");
+	}
+	data.append("</Delete>");
+
+	unsigned char md[MD5_DIGEST_LENGTH+1]={0};
+	MD5(reinterpret_cast<const unsigned char*>(data.c_str()), data.size(), md);
+	header_map_t opts;
+	opts["Content-MD5"]=base64_encode(reinterpret_cast<const char*>(md),
+									  MD5_DIGEST_LENGTH);
+	opts["Content-Type"]="application/xml";
+
+	s3_path root=paths.front();
+	root.path_="/?delete";
+	std::string read_data=post_data(root, data, opts);
+
+	TiXmlDocument doc;
+	doc.Parse(read_data.c_str());
+	if (doc.Error())
+		err(errWarn) << "Failed to parse the result of a batch delete";
+	std::vector<delete_error> res;
+	TiXmlNode *result=TiXmlHandle(&doc).FirstChild("DeleteResult").ToNode();
+	if (!result)
+		return res;
+	for(TiXmlNode *node=result->FirstChild("Error"); node;
+		node=node->NextSibling("Error"))
+	{
+		TiXmlText *key=TiXmlHandle(node).FirstChild("Key")
+				.FirstChild().ToText();
+		TiXmlText *code=TiXmlHandle(node).FirstChild("Code")
+				.FirstChild().ToText();
+		if (!key || !by_key.count(key->Value()))
+			continue;
+		res.push_back(delete_error(by_key[key->Value()],
+								   code ? code->Value() : ""));
+	}
+	VLOG(2) << "Deleted " << paths.size()-res.size() << " of "
+			<< paths.size() << " keys in " << root.bucket_;
+	return res;
+}
+
 class write_data
 {
 	char *buf_;
@@ -591,6 +1304,11 @@ public:
 	}
 
 	size_t written() const { return written_; }
+	//The start of the response, it's the error if the request failed
+	std::string error_body() const
+	{
+		return std::string(buf_, std::min(written_, size_t(1024)));
+	}
 
 	static size_t write_func(const char *bufptr, size_t size,
 							size_t nitems, void *userp)
@@ -615,27 +1333,199 @@ void s3_connection::download_data(const s3_path &path,
 	uint64_t offset, char *data, size_t size, const header_map_t& opts)
 {
 	curl_ptr_t curl=conn_data_->get_curl(path.zone_, path.bucket_);
+	prepare_download(curl, path, offset, size, opts);
 
-	prepare(curl, "GET", path, opts);
-	checked(curl, curl_easy_setopt(
-				curl.get(), CURLOPT_INFILESIZE_LARGE, uint64_t(size)));
+	write_data wd(data, size);
+	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION,
+							 &write_data::write_func));
+	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &wd));
 
+	checked(curl, perform(curl));
+	finish_download(curl, path, offset, size, wd.written(), wd.error_body());
+}
+
+void s3_connection::prepare_download(curl_ptr_t curl, const s3_path &path,
+	uint64_t offset, size_t size, const header_map_t& opts)
+{
+	prepare(curl, "GET", path, opts);
 	std::string range=int_to_string(offset)+"-"+
 			int_to_string(offset+size-1);
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_RANGE, range.c_str()));
+}
 
-	write_data wd(data, size);
+void s3_connection::finish_download(curl_ptr_t curl, const s3_path &path,
+	uint64_t offset, size_t size, size_t written,
+	const std::string &error_body)
+{
+	check_for_errors(curl, error_body);
+	if (written!=size)
+		err(errWarn)  << "Size of a segment at offset " << offset
+					  << " of "<< path << " is incorrect.";
+}
+
+/**
+  Writes the received data directly into the target file at the right
+  offset. Error responses are collected separately, so they never
+  end up in the file.
+  */
+class file_write_data
+{
+	CURL *curl_;
+	int fd_;
+	uint64_t offset_;
+	size_t total_size_;
+	size_t written_;
+	std::string error_body_;
+	bool checked_code_, is_error_;
+public:
+	file_write_data(CURL *curl, int fd, uint64_t offset, size_t total_size)
+		: curl_(curl), fd_(fd), offset_(offset), total_size_(total_size),
+		  written_(), checked_code_(), is_error_()
+	{
+	}
+
+	size_t written() const { return written_; }
+	const std::string& error_body() const { return error_body_; }
+
+	static size_t write_func(const char *bufptr, size_t size,
+							size_t nitems, void *userp)
+	{
+		return reinterpret_cast<file_write_data*>(userp)->simple_write(
+					bufptr, size*nitems);
+	}
+
+	size_t simple_write(const char *bufptr, size_t size)
+	{
+		if (!checked_code_)
+		{
+			long code=200;
+			curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &code);
+			is_error_=code>=400;
+			checked_code_=true;
+		}
+		if (is_error_)
+		{
+			error_body_.append(bufptr, size);
+			return size;
+		}
+
+		size_t towrite = std::min(total_size_-written_, size);
+		size_t done=0;
+		while(done<towrite)
+		{
+			ssize_t res=pwrite(fd_, bufptr+done, towrite-done,
+							   offset_+written_+done);
+			if (res<=0)
+				return 0; //CURL will report a write error
+			done+=res;
+		}
+		written_+=towrite;
+		return towrite;
+	}
+};
+
+void s3_connection::download_file(const s3_path &path,
+	uint64_t offset, size_t size, int fd, const header_map_t& opts)
+{
+	curl_ptr_t curl=conn_data_->get_curl(path.zone_, path.bucket_);
+	prepare_download(curl, path, offset, size, opts);
+
+	file_write_data wd(curl.get(), fd, offset, size);
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION,
-							 &write_data::write_func));
+							 &file_write_data::write_func));
 	checked(curl, curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &wd));
 
-	checked(curl, curl_easy_perform(curl.get()));
-	check_for_errors(curl, std::string(data,
-								 std::min(wd.written(), size_t(1024))));
+	checked(curl, perform(curl));
+	finish_download(curl, path, offset, size, wd.written(),
+					wd.error_body());
+}
 
-	if (wd.written()!=size)
-		err(errWarn)  << "Size of a segment at offset " << offset
-					  << " of "<< path << " is incorrect.";
+namespace es3
+{
+	/**
+	  A ranged GET that is run by the transfer engine. The data goes
+	  either into the buffer or straight into the file.
+	  */
+	struct download_request
+	{
+		boost::shared_ptr<s3_connection> conn_;
+		curl_ptr_t curl_;
+		s3_path path_;
+		uint64_t offset_;
+		size_t size_;
+		boost::scoped_ptr<write_data> buf_;
+		boost::scoped_ptr<file_write_data> file_;
+		download_callback_t on_done_;
+	};
+}; //namespace es3
+
+void s3_connection::download_data_async(const context_ptr &ctx,
+	const s3_path &path, uint64_t offset, char *data, size_t size,
+	download_callback_t on_done)
+{
+	boost::shared_ptr<download_request> req=start_download(ctx, path,
+		offset, size, on_done);
+	req->buf_.reset(new write_data(data, size));
+	req->conn_->checked(req->curl_, curl_easy_setopt(req->curl_.get(),
+		CURLOPT_WRITEFUNCTION, &write_data::write_func));
+	req->conn_->checked(req->curl_, curl_easy_setopt(req->curl_.get(),
+		CURLOPT_WRITEDATA, req->buf_.get()));
+
+	ctx->engine_->submit(req->curl_,
+		boost::bind(&s3_connection::on_download_done, req, _1));
+}
+
+void s3_connection::download_file_async(const context_ptr &ctx,
+	const s3_path &path, uint64_t offset, size_t size, int fd,
+	download_callback_t on_done)
+{
+	boost::shared_ptr<download_request> req=start_download(ctx, path,
+		offset, size, on_done);
+	req->file_.reset(new file_write_data(req->curl_.get(), fd, offset, size));
+	req->conn_->checked(req->curl_, curl_easy_setopt(req->curl_.get(),
+		CURLOPT_WRITEFUNCTION, &file_write_data::write_func));
+	req->conn_->checked(req->curl_, curl_easy_setopt(req->curl_.get(),
+		CURLOPT_WRITEDATA, req->file_.get()));
+
+	ctx->engine_->submit(req->curl_,
+		boost::bind(&s3_connection::on_download_done, req, _1));
+}
+
+boost::shared_ptr<download_request> s3_connection::start_download(
+	const context_ptr &ctx, const s3_path &path, uint64_t offset,
+	size_t size, download_callback_t on_done)
+{
+	assert(ctx->engine_);
+	boost::shared_ptr<download_request> req(new download_request());
+	req->conn_.reset(new s3_connection(ctx));
+	req->curl_=ctx->get_curl(path.zone_, path.bucket_);
+	req->path_=path;
+	req->offset_=offset;
+	req->size_=size;
+	req->on_done_=on_done;
+	req->conn_->prepare_download(req->curl_, path, offset, size,
+								 header_map_t());
+	return req;
+}
+
+void s3_connection::on_download_done(boost::shared_ptr<download_request> req,
+									 int curl_code)
+{
+	result_code_t res;
+	try
+	{
+		req->conn_->checked(req->curl_, curl_code);
+		if (req->buf_)
+			req->conn_->finish_download(req->curl_, req->path_, req->offset_,
+				req->size_, req->buf_->written(), req->buf_->error_body());
+		else
+			req->conn_->finish_download(req->curl_, req->path_, req->offset_,
+				req->size_, req->file_->written(), req->file_->error_body());
+	} catch(const es3_exception &ex)
+	{
+		res=ex.err();
+	}
+	req->on_done_(res);
 }
 
 std::string s3_connection::find_region(const std::string &bucket)
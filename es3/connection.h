@@ -3,6 +3,9 @@
 
 #include "common.h"
 #include "context.h"
+#include "errors.h"
+#include "file_table.h"
+#include "dir_tree.h"
 #include <functional>
 #include <boost/weak_ptr.hpp>
 
@@ -20,7 +23,9 @@ namespace es3 {
 		uint64_t raw_size_, remote_size_;
 		mode_t mode_;
 		bool compressed_;
+		codec_type_e codec_; //Meaningful only for compressed files
 		bool found_;
+		std::string etag_;
 	};
 
 	struct s3_path
@@ -33,6 +38,22 @@ namespace es3 {
 				path_<right.path_;
 		}
 	};
+
+	//The limit of the Multi-Object Delete request
+	#define MAX_DELETE_BATCH 1000
+	//A key that couldn't be deleted and the S3 error code
+	typedef std::pair<s3_path, std::string> delete_error;
+
+	/**
+	  A part of a multipart upload that is already on the server.
+	  */
+	struct uploaded_part
+	{
+		std::string etag_; //Without quotes
+		uint64_t size_;
+	};
+	//By the part number, counted from 1
+	typedef std::map<size_t, uploaded_part> part_map_t;
 	inline s3_path derive(const s3_path &left, const std::string &right)
 	{
 		s3_path res(left);
@@ -51,42 +72,62 @@ namespace es3 {
 		return out;
 	}
 
-	struct s3_file;
-	typedef boost::shared_ptr<s3_file> s3_file_ptr;
-	typedef std::map<std::string, s3_file_ptr> file_map_t;
-
-	struct s3_directory;
-	typedef boost::shared_ptr<s3_directory> s3_directory_ptr;
-	typedef boost::weak_ptr<s3_directory> s3_directory_weak_t;
-	typedef std::map<std::string, s3_directory_ptr> subdir_map_t;
+	struct head_request;
+	struct upload_request;
+	struct download_request;
+	struct upload_body;
+	class upload_source;
 
-	struct s3_directory
+	/**
+	  A file in a listing, its name and its ETag (without quotes, might
+	  be empty) are kept in the directory's file table.
+	  */
+	struct s3_file
 	{
-		std::string name_;
-		s3_path absolute_name_;
-
-		mutex_t m_;
-		file_map_t files_;
-		subdir_map_t subdirs_;
-		s3_directory_weak_t parent_;
+		uint64_t size_;
+		time_t mtime_; //The time of the upload, not the original mtime
 	};
+	typedef file_table<s3_file> s3_file_table;
 
-	struct s3_file
+	/**
+	  A directory of a listing, see dir_tree. Its lock() protects the
+	  files and the subdirectories while it's being listed.
+	  */
+	struct s3_directory : public dir_node<s3_directory, s3_path>
 	{
-		std::string name_;
-		s3_path absolute_name_;
-		std::string mtime_str_;
+		s3_file_table files_; //Sealed once the listing is complete
 
-		uint64_t size_;
-		s3_directory_weak_t parent_;
+		static s3_path join(const s3_path &parent, const std::string &name)
+		{
+			return derive(parent, name+"/");
+		}
+		s3_path file_path(size_t idx) const
+		{
+			return derive(path(), files_.name(idx));
+		}
 	};
+	typedef boost::shared_ptr<s3_directory> s3_directory_ptr;
+	typedef dir_tree<s3_directory, s3_path> s3_dir_tree;
+	/**
+	  Seal the file tables of a listed tree.
+	  */
+	void seal_listing(const s3_directory_ptr &dir);
 
 	typedef boost::function<void(size_t)> progress_callback_t;
+	typedef boost::function<void(const file_desc&, const result_code_t&)>
+		desc_callback_t;
+	//Receives the ETag of the uploaded object
+	typedef boost::function<void(const std::string&, const result_code_t&)>
+		upload_callback_t;
+	typedef boost::function<void(const result_code_t&)> download_callback_t;
 
 	class s3_connection
 	{
 		const context_ptr conn_data_;
 		struct curl_slist *header_list_;
+		//SigV4 signature of the last prepared request, the chunks of a
+		//streamed payload are signed in a chain that starts from it
+		std::string sig_timestamp_, sig_scope_, seed_signature_;
 	public:
 		s3_connection(const context_ptr &conn_data);
 		~s3_connection();
@@ -98,39 +139,162 @@ namespace es3 {
 		std::string upload_data(const s3_path &path,
 								const char *data, size_t size,
 								const header_map_t& opts=header_map_t());
+		/**
+		  Upload a range of the file, the data is read by CURL directly
+		  from the descriptor (which is not repositioned).
+		  */
+		std::string upload_file(const s3_path &path,
+								int fd, uint64_t offset, size_t size,
+								const header_map_t& opts=header_map_t());
 		void download_data(const s3_path &path,
 			uint64_t offset, char *data, size_t size,
 			const header_map_t& opts=header_map_t());
+		/**
+		  Download a range of the object and write it at the same offset
+		  into the file as the data arrives.
+		  */
+		void download_file(const s3_path &path,
+			uint64_t offset, size_t size, int fd,
+			const header_map_t& opts=header_map_t());
 
 		s3_directory_ptr list_files_shallow(const s3_path &path,
 			s3_directory_ptr target, bool try_to_root);
+		/**
+		  Creates the directory for the listing of the path. With
+		  try_to_root a path that doesn't end with '/' is listed into
+		  its parent directory.
+		  */
+		static s3_directory_ptr make_listing_target(const s3_path &path,
+													bool try_to_root);
+		/**
+		  Lists one page of keys after the marker and up to 'last'
+		  inclusive (no limit if it's empty) into the target. Returns
+		  true and the marker for the next page if there's more.
+		  The page is always read to its end, since all its keys come
+		  before all its prefixes: names past 'last' are skipped one by
+		  one and the range ends with this page.
+		  Directories created by this call are added to new_dirs.
+		  */
+		bool list_page(const s3_path &path, s3_directory_ptr target,
+			const std::string &marker, const std::string &last,
+			std::string *next_marker,
+			std::vector<s3_directory_ptr> *new_dirs);
 
 		std::string initiate_multipart(const s3_path &path,
 									   const header_map_t &opts);
+		/**
+		  Returns the ETag of the assembled object.
+		  */
 		std::string complete_multipart(const s3_path &path,
 									   const std::string &upload_id,
 									   const std::vector<std::string> &etags);
+		part_map_t list_parts(const s3_path &path,
+							  const std::string &upload_id);
+		void abort_multipart(const s3_path &path,
+							 const std::string &upload_id);
 		file_desc find_mtime_and_size(const s3_path &path);
+		/**
+		  Asynchronous version of find_mtime_and_size, it doesn't hold
+		  a thread while the request is in flight. Requires the
+		  transfer engine to be enabled in the context.
+		  */
+		static void find_mtime_and_size_async(const context_ptr &ctx,
+			const s3_path &path, desc_callback_t on_done);
+		/**
+		  Asynchronous version of upload_data, the data must stay
+		  alive until the callback is called. Requires the transfer
+		  engine to be enabled in the context.
+		  */
+		static void upload_data_async(const context_ptr &ctx,
+			const s3_path &path, const char *data, size_t size,
+			const header_map_t &opts, upload_callback_t on_done);
+		/**
+		  Asynchronous version of upload_file, the file must stay open
+		  until the callback is called.
+		  */
+		static void upload_file_async(const context_ptr &ctx,
+			const s3_path &path, int fd, uint64_t offset, size_t size,
+			const header_map_t &opts, upload_callback_t on_done);
+		/**
+		  Asynchronous versions of download_data and download_file, the
+		  buffer or the file must stay alive until the callback is
+		  called. Require the transfer engine to be enabled.
+		  */
+		static void download_data_async(const context_ptr &ctx,
+			const s3_path &path, uint64_t offset, char *data, size_t size,
+			download_callback_t on_done);
+		static void download_file_async(const context_ptr &ctx,
+			const s3_path &path, uint64_t offset, size_t size, int fd,
+			download_callback_t on_done);
+
+		/**
+		  Deletes up to MAX_DELETE_BATCH objects of one bucket with a
+		  single request. Returns the keys that were not deleted.
+		  */
+		std::vector<delete_error> delete_objects(
+			const std::vector<s3_path> &paths);
 
 		std::string find_region(const std::string &bucket);
 		
 		void set_acl(const s3_path &path, const std::string &acl);
 	private:
+		/**
+		  Blocks until the request is done, even with the transfer
+		  engine. Use the _async methods to avoid holding the thread.
+		  */
+		int perform(curl_ptr_t curl);
+		std::string do_upload(const s3_path &path, upload_source &source,
+							  uint64_t size, const header_map_t& opts);
+		std::string post_data(const s3_path &path, const std::string &data,
+							  const header_map_t &opts=header_map_t());
+		void prepare_head(curl_ptr_t curl, const s3_path &path,
+						  file_desc *result);
+		void finish_head(curl_ptr_t curl, file_desc *result);
+		static void on_head_done(boost::shared_ptr<head_request> req,
+								 int curl_code);
+		void prepare_upload(curl_ptr_t curl, const s3_path &path,
+							upload_body &body, uint64_t size,
+							const header_map_t& opts);
+		std::string finish_upload(curl_ptr_t curl, upload_body &body);
+		static void on_upload_done(boost::shared_ptr<upload_request> req,
+								   int curl_code);
+		static void submit_upload(const context_ptr &ctx,
+			const s3_path &path, upload_source *source, uint64_t size,
+			const header_map_t &opts, upload_callback_t on_done);
+		void prepare_download(curl_ptr_t curl, const s3_path &path,
+							  uint64_t offset, size_t size,
+							  const header_map_t& opts);
+		void finish_download(curl_ptr_t curl, const s3_path &path,
+							 uint64_t offset, size_t size, size_t written,
+							 const std::string &error_body);
+		static boost::shared_ptr<download_request> start_download(
+			const context_ptr &ctx, const s3_path &path, uint64_t offset,
+			size_t size, download_callback_t on_done);
+		static void on_download_done(boost::shared_ptr<download_request> req,
+									 int curl_code);
+
 		void checked(curl_ptr_t curl, int curl_code);
 		void check_for_errors(curl_ptr_t curl,
 							  const std::string &curl_res);
 		void prepare(curl_ptr_t curl,
 					 const std::string &verb,
 					 const s3_path &path,
-					 const header_map_t &opts=header_map_t());
+					 const header_map_t &opts=header_map_t(),
+					 const std::string &args="");
 
-		std::string sign(const std::string &str);
 		struct curl_slist* authenticate_req(struct curl_slist *,
+				const std::string &verb, const s3_path &path,
+				const std::string &args, const header_map_t &opts);
+		struct curl_slist* authenticate_v2(struct curl_slist *,
 				const std::string &verb, const s3_path &path,
 				const header_map_t &opts);
+		struct curl_slist* authenticate_v4(struct curl_slist *,
+				const std::string &verb, const s3_path &path,
+				const std::string &args, const header_map_t &opts);
 
 		void set_url(curl_ptr_t curl,
 					 const s3_path &path, const std::string &args);
+		std::string host_of(const s3_path &path) const;
 	};
 
 }; //namespace es3
@@ -1,11 +1,28 @@
 #include "context.h"
 #include <curl/curl.h>
 #include "errors.h"
+#include "transfer.h"
+#include "state_db.h"
 
 using namespace es3;
 
+//Handles that each thread keeps for itself
+#define THREAD_CACHE_SIZE 4
+//Pooled handles and connections are dropped after this many idle
+//seconds, S3 closes idle connections shortly after that anyway
+#define POOL_IDLE_TIMEOUT 30
+
 namespace es3
 {
+	struct pooled_curl
+	{
+		CURL *curl_;
+		CURLSH *share_;
+		std::string key_;
+		time_t last_used_;
+		char err_buf_[CURL_ERROR_SIZE+1];
+	};
+
 	struct curl_deleter
 	{
 		conn_context *parent_;
@@ -15,63 +32,229 @@ namespace es3
 			parent_->release_curl(curl);
 		}
 	};
+
+	/**
+	  Handles released by a thread, it reuses them without locking.
+	  They go back to the shared pool when the thread exits.
+	  */
+	struct curl_thread_cache
+	{
+		conn_context *parent_;
+		std::vector<pooled_curl*> handles_;
+
+		curl_thread_cache(conn_context *parent) : parent_(parent) {}
+		~curl_thread_cache()
+		{
+			for(auto iter=handles_.begin();iter!=handles_.end();++iter)
+				parent_->return_to_pool(*iter);
+		}
+	};
 };
 
+static pooled_curl* handle_of(CURL *curl)
+{
+	char *res=0;
+	curl_easy_getinfo(curl, CURLINFO_PRIVATE, &res);
+	assert(res);
+	return reinterpret_cast<pooled_curl*>(res);
+}
+
+static void close_handle(pooled_curl *handle)
+{
+	curl_easy_cleanup(handle->curl_);
+	delete handle;
+}
+
+static void lock_share(CURL *, curl_lock_data data, curl_lock_access,
+					   void *userptr)
+{
+	reinterpret_cast<mutex_t*>(userptr)[data].lock();
+}
+
+static void unlock_share(CURL *, curl_lock_data data, void *userptr)
+{
+	reinterpret_cast<mutex_t*>(userptr)[data].unlock();
+}
+
+conn_context::conn_context() : use_ssl_(), do_compression_(true),
+	zero_copy_(true), stream_decompress_(), fast_compare_(), use_sigv4_(),
+	use_http2_(), codec_(codecGzip), compression_level_(),
+	share_locks_(new mutex_t[CURL_LOCK_DATA_LAST]), share_(), closed_()
+{
+}
+
 void conn_context::reset()
 {
-	assert(borrowed_curls_.empty());
+	thread_cache_.reset(); //Return this thread's handles to the pool
+
+	guard_t lock(m_);
 	for(auto iter=curls_.begin();iter!=curls_.end();++iter)
 		for(auto citer=iter->second.begin();citer!=iter->second.end();++citer)
-		{
-			curl_easy_cleanup(*citer);
-			assert(error_bufs_.count(*citer));
-			free(error_bufs_.at(*citer));
-		}
+			close_handle(*citer);
 	curls_.clear();
-	error_bufs_.clear();
 }
 
 conn_context::~conn_context()
 {
 	reset();
+	if (share_)
+		curl_share_cleanup(share_);
 }
 
-curl_ptr_t conn_context::get_curl(const std::string &zone,
-							 const std::string &bucket)
+void conn_context::shutdown()
 {
+	//Stop the event loops while CURL is still initialized
+	engine_.reset();
+	if (state_db_)
+		state_db_->save();
+
+	reset();
 	guard_t lock(m_);
-	std::vector<CURL*> &cur = curls_[zone+"/"+bucket];
-	if (!cur.empty())
+	closed_=true; //Late handles are closed as they come back
+	if (share_)
+		curl_share_cleanup(share_);
+	share_=0;
+}
+
+void conn_context::setup_curl(pooled_curl *handle)
+{
+	CURL *curl=handle->curl_;
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, handle);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, handle->err_buf_);
+	if (handle->share_)
+		curl_easy_setopt(curl, CURLOPT_SHARE, handle->share_);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, long(POOL_IDLE_TIMEOUT));
+	if (use_http2_)
 	{
-		CURL* res=cur.back();
-		cur.pop_back();
-		assert(!borrowed_curls_.count(res));
-		borrowed_curls_[res]=zone+"/"+bucket;
-		return curl_ptr_t(res, curl_deleter{this});
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+						 long(CURL_HTTP_VERSION_2TLS));
+		//Wait for a connection that can take one more stream rather
+		//than opening a new one
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
 	} else
 	{
-		CURL* res=curl_easy_init();
-		if (!res)
-			err(errFatal) << "can't init CURL";
+		//Newer CURL negotiates HTTP/2 over TLS by default
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+						 long(CURL_HTTP_VERSION_1_1));
+	}
+}
+
+void conn_context::reset_curl(curl_ptr_t curl)
+{
+	pooled_curl *handle=handle_of(curl.get());
+	curl_easy_reset(curl.get());
+	setup_curl(handle);
+}
+
+char* conn_context::err_buf_for(curl_ptr_t ptr)
+{
+	return handle_of(ptr.get())->err_buf_;
+}
+
+curl_ptr_t conn_context::get_curl(const std::string &zone,
+							 const std::string &bucket)
+{
+	std::string key=zone+"/"+bucket;
+
+	//Try this thread's own handles first
+	curl_thread_cache *cache=thread_cache_.get();
+	if (cache)
+	{
+		for(size_t f=cache->handles_.size();f>0;--f)
+		{
+			pooled_curl *cur=cache->handles_[f-1];
+			if (cur->key_!=key)
+				continue;
+			cache->handles_.erase(cache->handles_.begin()+(f-1));
+			return curl_ptr_t(cur->curl_, curl_deleter{this});
+		}
+	}
+
+	pooled_curl *res=0;
+	CURLSH *share=0;
+	{
+		guard_t lock(m_);
+		if (!share_ && !closed_)
+		{
+			//Created lazily, CURL has to be initialized first
+			share_=curl_share_init();
+			if (!share_)
+				err(errFatal) << "can't init CURL share";
+			curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, &lock_share);
+			curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, &unlock_share);
+			curl_share_setopt(share_, CURLSHOPT_USERDATA, share_locks_.get());
+			curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+			//Connections are not shared, CURL doesn't support sharing
+			//them between concurrent threads. They stay with the pooled
+			//handles (and with the multi handles of the transfer engine).
+			curl_share_setopt(share_, CURLSHOPT_SHARE,
+							  CURL_LOCK_DATA_SSL_SESSION);
+		}
+		share=share_;
 
-		char *err_buf=(char*)malloc(CURL_ERROR_SIZE+1);
-		memset(err_buf, 0, CURL_ERROR_SIZE+1);
+		std::vector<pooled_curl*> &idle=curls_[key];
+		if (!idle.empty())
+		{
+			res=idle.back();
+			idle.pop_back();
+		}
 
-		error_bufs_[res]=err_buf;
-		curl_easy_setopt(res, CURLOPT_ERRORBUFFER, err_buf);
+		//Drop the handles that have been idle for too long, the oldest
+		//ones are at the front
+		time_t now=time(NULL);
+		for(auto iter=curls_.begin();iter!=curls_.end();++iter)
+		{
+			std::vector<pooled_curl*> &cur=iter->second;
+			size_t stale=0;
+			while(stale<cur.size() &&
+				  now-cur[stale]->last_used_>POOL_IDLE_TIMEOUT)
+				close_handle(cur[stale++]);
+			cur.erase(cur.begin(), cur.begin()+stale);
+		}
+	}
+	if (res)
+		return curl_ptr_t(res->curl_, curl_deleter{this});
 
-		assert(!borrowed_curls_.count(res));
-		borrowed_curls_[res]=zone+"/"+bucket;
-		return curl_ptr_t(res, curl_deleter{this});
+	res=new pooled_curl();
+	res->curl_=curl_easy_init();
+	if (!res->curl_)
+	{
+		delete res;
+		err(errFatal) << "can't init CURL";
 	}
+	res->share_=share;
+	res->key_=key;
+	res->last_used_=0;
+	memset(res->err_buf_, 0, sizeof(res->err_buf_));
+	setup_curl(res);
+	return curl_ptr_t(res->curl_, curl_deleter{this});
 }
 
 void conn_context::release_curl(CURL* curl)
 {
-	guard_t lock(m_);
+	pooled_curl *handle=handle_of(curl);
+	handle->last_used_=time(NULL);
 
-	assert(borrowed_curls_.count(curl));
-	std::string key=borrowed_curls_.at(curl);
-	borrowed_curls_.erase(curl);
-	curls_[key].push_back(curl);
+	curl_thread_cache *cache=thread_cache_.get();
+	if (!cache)
+	{
+		cache=new curl_thread_cache(this);
+		thread_cache_.reset(cache);
+	}
+	if (cache->handles_.size()<THREAD_CACHE_SIZE)
+	{
+		cache->handles_.push_back(handle);
+		return;
+	}
+	return_to_pool(handle);
+}
+
+void conn_context::return_to_pool(pooled_curl *handle)
+{
+	guard_t lock(m_);
+	if (closed_)
+		close_handle(handle);
+	else
+		curls_[handle->key_].push_back(handle);
 }
@@ -2,43 +2,92 @@
 #define CONTEXT_H
 
 #include "common.h"
+#include "codec.h"
+#include <boost/thread/tss.hpp>
+#include <boost/scoped_array.hpp>
 #define MAX_SEGMENTS 9999
 
 typedef void CURL;
+typedef void CURLSH;
 
 namespace es3 {
 	struct s3_path;
+	class transfer_engine;
+	typedef boost::shared_ptr<transfer_engine> transfer_engine_ptr;
+	class sync_state_db;
+	typedef boost::shared_ptr<sync_state_db> sync_state_db_ptr;
+	class upload_journal;
+	typedef boost::shared_ptr<upload_journal> upload_journal_ptr;
+	class request_signer;
+	typedef boost::shared_ptr<request_signer> signer_ptr;
 
 	typedef boost::shared_ptr<CURL> curl_ptr_t;
+	struct pooled_curl;
+	struct curl_thread_cache;
 
 	class conn_context : public boost::enable_shared_from_this<conn_context>
 	{
 	public:
 		bf::path scratch_dir_;
-		bool use_ssl_, do_compression_;
+		bool use_ssl_, do_compression_, zero_copy_, stream_decompress_;
+		bool fast_compare_; //Trust the listing and the sync state database
+		bool use_sigv4_;
+		bool use_http2_; //Negotiated over TLS, falls back to HTTP/1.1
+		//Optional host[:port] of an S3-compatible service, buckets are
+		//addressed in the path there instead of the host name
+		std::string endpoint_;
+		codec_type_e codec_;
+		int compression_level_; //0 means the codec's default
 		std::string api_key_, secret_key;
+		//Optional, without it the _async requests aren't available
+		transfer_engine_ptr engine_;
+		sync_state_db_ptr state_db_; //Optional, saved on shutdown
+		upload_journal_ptr journal_; //Optional, uploads are not resumed
+		signer_ptr signer_;
 
-		conn_context() : use_ssl_(), do_compression_(true) {};
+		conn_context();
 		~conn_context();
 
+		/**
+		  Borrows a handle for the bucket. Handles are kept warm across
+		  the agenda runs, a few of them are cached by each thread and
+		  the rest are pooled by bucket. All of them share the DNS
+		  cache and the TLS sessions, each one keeps its connection.
+		  */
 		curl_ptr_t get_curl(const std::string &zone,
 					   const std::string &bucket);
+		/**
+		  Resets the options of a borrowed handle, keeping those that
+		  the pool depends on.
+		  */
+		void reset_curl(curl_ptr_t curl);
+		/**
+		  Closes the pooled handles, the ones that are borrowed are
+		  closed when they come back.
+		  */
 		void reset();
-		char* err_buf_for(curl_ptr_t ptr)
-		{
-			return error_bufs_[ptr.get()];
-		}
+		void shutdown();
+		char* err_buf_for(curl_ptr_t ptr);
 
 	private:
 		conn_context(const conn_context &);
 
 		void release_curl(CURL*);
-		boost::mutex m_;
-		std::map<std::string, std::vector<CURL*> > curls_;
-		std::map<CURL*, char*> error_bufs_;
-		std::map<CURL*, std::string> borrowed_curls_;
+		void return_to_pool(pooled_curl *handle);
+		void setup_curl(pooled_curl *handle);
 
-		friend class curl_deleter;
+		boost::thread_specific_ptr<curl_thread_cache> thread_cache_;
+		boost::scoped_array<mutex_t> share_locks_;
+
+		mutex_t m_; //This mutex protects the following data {
+		CURLSH *share_;
+		bool closed_;
+		//Idle handles by "zone/bucket", the most recently used are last
+		std::map<std::string, std::vector<pooled_curl*> > curls_;
+		//}
+
+		friend struct curl_deleter;
+		friend struct curl_thread_cache;
 	};
 	typedef boost::shared_ptr<conn_context> context_ptr;
 }; //namespace es3
@@ -0,0 +1,195 @@
+#ifndef DIR_TREE_H
+#define DIR_TREE_H
+
+#include "common.h"
+#include <algorithm>
+#include <deque>
+#include <string.h>
+#include <boost/enable_shared_from_this.hpp>
+
+//Directory names are stored in blocks of this size
+#define NAME_BLOCK_SIZE (64*1024)
+//Directories of a tree share this many locks
+#define DIR_LOCKS_NUM 64
+
+namespace es3 {
+	template<class dir_t, class path_t> class dir_tree;
+
+	/**
+	  A directory in a dir_tree. It keeps a pointer to its parent and
+	  its name in the tree's arena instead of a full path, the path is
+	  built when it's needed. Subdirectories are kept sorted by name,
+	  if they can be added concurrently then it needs the lock().
+	  */
+	template<class dir_t, class path_t> class dir_node
+	{
+		typedef dir_tree<dir_t, path_t> tree_t;
+		friend class dir_tree<dir_t, path_t>;
+
+		tree_t *tree_;
+		const dir_t *parent_;
+		const char *name_;
+		uint32_t name_len_;
+		std::vector<dir_t*> subdirs_;
+
+		struct name_less
+		{
+			bool operator()(const dir_t *l, const std::string &r) const
+			{
+				int res=memcmp(l->name_, r.data(),
+							   std::min(size_t(l->name_len_), r.size()));
+				return res<0 || (res==0 && l->name_len_<r.size());
+			}
+		};
+	public:
+		typedef boost::shared_ptr<dir_t> ptr_t;
+		static const size_t npos=size_t(-1);
+
+		dir_node() : tree_(), parent_(), name_(), name_len_() {}
+
+		std::string name() const { return std::string(name_, name_len_); }
+
+		path_t path() const
+		{
+			if (!parent_)
+				return tree_->root_path();
+			return dir_t::join(parent_->path(), name());
+		}
+
+		size_t num_subdirs() const { return subdirs_.size(); }
+		ptr_t subdir(size_t idx) const { return tree_t::ptr(subdirs_.at(idx)); }
+
+		size_t subdir_index(const std::string &name) const
+		{
+			auto pos=std::lower_bound(subdirs_.begin(), subdirs_.end(),
+									  name, name_less());
+			if (pos==subdirs_.end() || (*pos)->name()!=name)
+				return npos;
+			return pos-subdirs_.begin();
+		}
+		ptr_t find_subdir(const std::string &name) const
+		{
+			size_t idx=subdir_index(name);
+			return idx==npos ? ptr_t() : subdir(idx);
+		}
+		bool has_subdir(const std::string &name) const
+		{
+			return subdir_index(name)!=npos;
+		}
+
+		/**
+		  Returns the new subdirectory or nothing if there's already
+		  one with this name.
+		  */
+		ptr_t add_subdir(const std::string &name)
+		{
+			auto pos=std::lower_bound(subdirs_.begin(), subdirs_.end(),
+									  name, name_less());
+			if (pos!=subdirs_.end() && (*pos)->name()==name)
+				return ptr_t();
+			dir_t *res=tree_->add_node(static_cast<dir_t*>(this), name);
+			subdirs_.insert(pos, res);
+			return tree_t::ptr(res);
+		}
+
+		/**
+		  Links a directory of another tree, it keeps its path. The
+		  name must not be taken.
+		  */
+		void adopt_subdir(const ptr_t &dir)
+		{
+			std::string name=dir->name();
+			auto pos=std::lower_bound(subdirs_.begin(), subdirs_.end(),
+									  name, name_less());
+			assert(pos==subdirs_.end() || (*pos)->name()!=name);
+			tree_->adopt(dir->tree_);
+			subdirs_.insert(pos, dir.get());
+		}
+
+		void clear_subdirs() { std::vector<dir_t*>().swap(subdirs_); }
+
+		mutex_t& lock() const { return tree_->lock_for(this); }
+	};
+
+	/**
+	  Owns the directories of a listing or a scan. The nodes are kept
+	  in a deque and their names are appended to blocks that are never
+	  moved, so a directory costs a fixed-size node plus its name. The
+	  pointers to the directories share the ownership of the whole
+	  tree instead of holding a node each.
+	  */
+	template<class dir_t, class path_t> class dir_tree :
+		public boost::enable_shared_from_this<dir_tree<dir_t, path_t> >
+	{
+		friend class dir_node<dir_t, path_t>;
+		typedef boost::shared_ptr<dir_tree> tree_ptr;
+
+		const path_t root_path_;
+
+		mutex_t m_; //This mutex protects the following data {
+		std::deque<dir_t> nodes_;
+		std::deque<std::vector<char> > names_;
+		std::vector<tree_ptr> adopted_; //Trees of the linked directories
+		//}
+		mutable mutex_t locks_[DIR_LOCKS_NUM];
+
+		dir_tree(const path_t &root_path) : root_path_(root_path) {}
+		dir_tree(const dir_tree &);
+	public:
+		static boost::shared_ptr<dir_t> make_root(const path_t &root_path,
+												  const std::string &name)
+		{
+			tree_ptr tree(new dir_tree(root_path));
+			return ptr(tree->add_node(0, name));
+		}
+
+		const path_t& root_path() const { return root_path_; }
+
+	private:
+		static boost::shared_ptr<dir_t> ptr(dir_t *dir)
+		{
+			return boost::shared_ptr<dir_t>(dir->tree_->shared_from_this(),
+											dir);
+		}
+
+		dir_t* add_node(const dir_t *parent, const std::string &name)
+		{
+			guard_t lock(m_);
+			if (names_.empty() ||
+					names_.back().capacity()-names_.back().size()<name.size())
+			{
+				names_.push_back(std::vector<char>());
+				names_.back().reserve(std::max(name.size(),
+											   size_t(NAME_BLOCK_SIZE)));
+			}
+			std::vector<char> &block=names_.back();
+			block.insert(block.end(), name.begin(), name.end());
+
+			nodes_.push_back(dir_t());
+			dir_t *res=&nodes_.back();
+			res->tree_=this;
+			res->parent_=parent;
+			res->name_=block.data()+block.size()-name.size();
+			res->name_len_=safe_cast<uint32_t>(name.size());
+			return res;
+		}
+
+		void adopt(dir_tree *other)
+		{
+			if (other==this)
+				return;
+			guard_t lock(m_);
+			tree_ptr res=other->shared_from_this();
+			if (std::find(adopted_.begin(), adopted_.end(), res)==adopted_.end())
+				adopted_.push_back(res);
+		}
+
+		mutex_t& lock_for(const void *dir) const
+		{
+			return locks_[(uintptr_t(dir)/sizeof(dir_t))%DIR_LOCKS_NUM];
+		}
+	};
+
+}; //namespace es3
+
+#endif //DIR_TREE_H
@@ -9,6 +9,10 @@
 #include <iostream>
 #include "commands.h"
 #include "scope_guard.h"
+#include "state_db.h"
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <atomic>
 
 using namespace es3;
 using namespace boost::filesystem;
@@ -30,12 +34,27 @@ struct download_content
 	size_t remote_size_, raw_size_;
 
 	s3_path remote_path_;
+	std::string etag_;
 	bf::path local_file_, target_file_;
 	bool delete_temp_file_, compressed_;
+	codec_type_e codec_;
+
+	//Decompress-while-downloading state, guarded by m_ {
+	std::vector<segment_ptr> free_;
+	std::map<size_t, segment_ptr> arrived_;
+	size_t next_scheduled_, next_decoded_;
+	bool decoding_;
+	bool decode_failed_; //The decoder's state is lost, the file too
+	//}
+	//Only touched by the running decode task
+	decoder_ptr decoder_;
+	uint64_t decoded_size_;
 
 	download_content() : mtime_(), num_segments_(), segments_read_(),
 		remote_size_(), raw_size_(), delete_temp_file_(true),
-		mode_(0664), compressed_() {}
+		mode_(0664), compressed_(), codec_(codecGzip),
+		next_scheduled_(), next_decoded_(), decoding_(), decode_failed_(),
+		decoded_size_() {}
 	~download_content()
 	{
 		if (local_file_!=target_file_ && delete_temp_file_)
@@ -44,6 +63,172 @@ struct download_content
 };
 typedef boost::shared_ptr<download_content> download_content_ptr;
 
+static void record_state(download_content_ptr content)
+{
+	if (!content->ctx_->state_db_)
+		return;
+	sync_state state;
+	state.mtime_=content->mtime_;
+	state.size_=content->raw_size_;
+	state.remote_size_=content->remote_size_;
+	state.etag_=content->etag_;
+	content->ctx_->state_db_->record(content->target_file_,
+									 content->remote_path_, state);
+}
+
+static void install_file(download_content_ptr content)
+{
+	std::string local_nm=content->local_file_.string();
+	std::string tgt_nm=content->target_file_.string();
+	bf::last_write_time(local_nm, content->mtime_);
+	chmod(local_nm.c_str(), content->mode_)
+			| libc_die2("Failed to set mode on "+tgt_nm);
+	rename(local_nm.c_str(), tgt_nm.c_str())
+			| libc_die2("Failed to replace "+tgt_nm);
+	record_state(content);
+}
+
+static void on_segment_written(download_content_ptr content, agenda_ptr agenda)
+{
+	context_ptr ctx = content->ctx_;
+
+	guard_t lock(content->m_);
+	content->segments_read_++;
+	if (content->segments_read_==content->num_segments_)
+	{
+		//Check if we need to decompress the file
+		if (content->compressed_)
+		{
+			//Yep, we do need to decompress it
+			sync_task_ptr dl(new file_decompressor(ctx,
+				content->local_file_, content->target_file_,
+				content->mtime_, content->mode_, content->codec_, true,
+				boost::bind(&record_state, content)));
+			//file decompressor will delete it
+			content->delete_temp_file_=false;
+			agenda->schedule(dl);
+		} else
+			install_file(content);
+	}
+}
+
+static void pump_downloads(download_content_ptr content, agenda_ptr agenda);
+
+/**
+  Decompresses the downloaded segments in order straight into the
+  target file. At most one such task runs for a file at a time. Once
+  it fails, the whole download has failed: its retries fail too.
+  */
+class decode_segments_task: public sync_task
+{
+	download_content_ptr content_;
+public:
+	decode_segments_task(download_content_ptr content) : content_(content)
+	{
+	}
+
+	virtual task_type_e get_class() const { return taskCPUBound; }
+
+	virtual void print_to(std::ostream &str)
+	{
+		str << "Decompress segments of " << content_->local_file_;
+	}
+
+	virtual void operator()(agenda_ptr agenda)
+	{
+		{
+			guard_t lock(content_->m_);
+			if (content_->decode_failed_)
+				err(errFatal) << "Failed to decompress "
+							  << content_->remote_path_;
+		}
+		try
+		{
+			decode_arrived(agenda);
+		} catch(...)
+		{
+			//The decoder has consumed a part of the input, a retry
+			//can't continue from where this attempt stopped
+			guard_t lock(content_->m_);
+			content_->decode_failed_=true;
+			throw;
+		}
+	}
+
+private:
+	void decode_arrived(agenda_ptr agenda)
+	{
+		handle_t fl(open(content_->local_file_.c_str(), O_WRONLY)
+					| libc_die2("Failed to open "
+								+content_->local_file_.string()));
+		if (!content_->decoder_)
+			content_->decoder_=make_decoder(content_->codec_);
+
+		std::vector<char> buf_out;
+		buf_out.resize(1024*1024*2);
+
+		while(true)
+		{
+			segment_ptr seg;
+			{
+				guard_t lock(content_->m_);
+				auto iter=content_->arrived_.begin();
+				if (iter==content_->arrived_.end() ||
+						iter->first!=content_->next_decoded_)
+				{
+					content_->decoding_=false;
+					return;
+				}
+				//Stays in arrived_ until it's written out
+				seg=iter->second;
+			}
+
+			const char *in=seg->data_.data();
+			size_t in_len=seg->data_.size();
+			size_t to_write=0;
+			do
+			{
+				to_write=content_->decoder_->decode(in, in_len,
+					&buf_out[0], buf_out.size());
+				pwrite(fl.get(), &buf_out[0], to_write,
+					   content_->decoded_size_) | libc_die;
+				content_->decoded_size_+=to_write;
+				agenda->add_stat_counter("decompressed", to_write);
+			} while(in_len>0 || to_write==buf_out.size());
+
+			guard_t lock(content_->m_);
+			content_->arrived_.erase(content_->next_decoded_++);
+			seg->data_.clear();
+			content_->free_.push_back(seg);
+			if (content_->next_decoded_==content_->num_segments_)
+			{
+				content_->decoding_=false;
+				if (content_->decoded_size_!=content_->raw_size_)
+					err(errFatal) << "Decompressed size of "
+								  << content_->remote_path_
+								  << " is incorrect";
+				install_file(content_);
+				return;
+			}
+			pump_downloads(content_, agenda);
+		}
+	}
+};
+
+//Must be called with the content lock held
+static void on_segment_arrived(download_content_ptr content, size_t num,
+							   segment_ptr seg, agenda_ptr agenda)
+{
+	content->arrived_[num]=seg;
+	if (!content->decoding_ && content->arrived_.begin()->first==
+			content->next_decoded_)
+	{
+		content->decoding_=true;
+		sync_task_ptr task(new decode_segments_task(content));
+		agenda->schedule(task);
+	}
+}
+
 class write_segment_task: public sync_task,
 		public boost::enable_shared_from_this<write_segment_task>
 {
@@ -67,34 +252,8 @@ public:
 
 	virtual void operator()(agenda_ptr agenda)
 	{
-		context_ptr ctx = content_->ctx_;
 		do_write(agenda);
-
-		guard_t lock(content_->m_);
-		content_->segments_read_++;
-		if (content_->segments_read_==content_->num_segments_)
-		{
-			//Check if we need to decompress the file
-			if (content_->compressed_)
-			{
-				//Yep, we do need to decompress it
-				sync_task_ptr dl(new file_decompressor(ctx,
-					content_->local_file_, content_->target_file_,
-					content_->mtime_, content_->mode_, true));
-				//file decompressor will delete it
-				content_->delete_temp_file_=false;
-				agenda->schedule(dl);
-			} else
-			{
-				std::string local_nm=content_->local_file_.string();
-				std::string tgt_nm=content_->target_file_.string();
-				bf::last_write_time(local_nm, content_->mtime_);
-				chmod(local_nm.c_str(), content_->mode_)
-						| libc_die2("Failed to set mode on "+tgt_nm);
-				rename(local_nm.c_str(), tgt_nm.c_str())
-						| libc_die2("Failed to replace "+tgt_nm);
-			}
-		}
+		on_segment_written(content_, agenda);
 	}
 
 	void do_write(agenda_ptr agenda)
@@ -116,14 +275,32 @@ public:
 	}
 };
 
+static std::atomic<size_t> async_file_parts(0);
+
+/**
+  Downloads a segment of a file. With the transfer engine the request
+  doesn't hold the worker: the task is scheduled again from the
+  completion callback to hand the segment over, or to retry it.
+  */
 class download_segment_task: public sync_task,
 		public boost::enable_shared_from_this<download_segment_task>
 {
 	download_content_ptr content_;
 	size_t cur_segment_;
+	//Lent by the file's own window when decompressing on the fly
+	segment_ptr seg_;
+	//The segment from the agenda, kept until it's written out
+	segment_ptr held_;
+
+	size_t attempt_;
+	bool done_; //The data has arrived
+	//Kept open while the part is in the transfer engine
+	boost::scoped_ptr<handle_t> handle_;
 public:
-	download_segment_task(download_content_ptr content, size_t cur_segment) :
-		content_(content), cur_segment_(cur_segment)
+	download_segment_task(download_content_ptr content, size_t cur_segment,
+						  segment_ptr seg=segment_ptr()) :
+		content_(content), cur_segment_(cur_segment), seg_(seg),
+		attempt_(), done_()
 	{
 	}
 
@@ -133,37 +310,193 @@ public:
 			<< content_->local_file_;
 	}
 
-	virtual size_t needs_segments() const { return 1; }
+	virtual size_t needs_segments() const
+	{
+		//Streamed segments go directly into the file
+		return (seg_ || done_ || content_->ctx_->zero_copy_) ? 0 : 1;
+	}
 
 	virtual void operator()(agenda_ptr agenda,
 							const std::vector<segment_ptr> &segments)
 	{
-		segment_ptr seg=segments.at(0);
-		size_t segment_size=agenda->segment_size();
+		uint64_t start_offset=agenda->segment_size()*cur_segment_;
+		size_t size=part_size(agenda);
+		if (!done_)
+		{
+			if (attempt_)
+				sleep(TASK_RETRY_DELAY); //Retried after an asynchronous failure
+			if (!segments.empty())
+				held_=segments.at(0);
+
+			VLOG(2) << "Downloading part " << cur_segment_ << " out of "
+					<< content_->num_segments_ << " of "
+					<< content_->remote_path_;
+			if (content_->ctx_->engine_ &&
+					start_async(agenda, start_offset, size))
+				return;
+
+			s3_connection conn(content_->ctx_);
+			if (seg_ || held_)
+			{
+				segment_ptr seg=seg_ ? seg_ : held_;
+				seg->data_.resize(size);
+				conn.download_data(content_->remote_path_, start_offset,
+								   seg->data_.data(), size);
+			} else
+			{
+				handle_t fl(open(content_->local_file_.c_str(), O_RDWR)
+							| libc_die2("Failed to open "
+										+content_->local_file_.string()));
+				conn.download_file(content_->remote_path_, start_offset,
+								   size, fl.get());
+			}
+		}
+		part_downloaded(agenda, size);
+	}
 
-		uint64_t start_offset = segment_size*cur_segment_;
-		uint64_t size = content_->remote_size_-start_offset;
-		if (size>segment_size)
-			size=segment_size;
+private:
+	size_t part_size(agenda_ptr agenda) const
+	{
+		uint64_t size=content_->remote_size_-
+				uint64_t(agenda->segment_size())*cur_segment_;
+		return safe_cast<size_t>(std::min(size,
+										  uint64_t(agenda->segment_size())));
+	}
 
-		VLOG(2) << "Downloading part " << cur_segment_ << " out of "
-				<< content_->num_segments_ << " of " << content_->remote_path_;
+	bool start_async(agenda_ptr agenda, uint64_t start_offset, size_t size)
+	{
+		if (!seg_ && !held_ && ++async_file_parts>MAX_ASYNC_FILE_PARTS)
+		{
+			async_file_parts--;
+			return false;
+		}
 
-		s3_connection conn(content_->ctx_);
-		seg->data_.resize(safe_cast<size_t>(size));
-		conn.download_data(content_->remote_path_, start_offset,
-						   &seg->data_[0], safe_cast<size_t>(size));
-		agenda->add_stat_counter("downloaded", size);
+		agenda->begin_async();
+		try
+		{
+			download_callback_t on_done=boost::bind(
+				&download_segment_task::on_downloaded, shared_from_this(),
+				agenda, _1);
+			if (seg_ || held_)
+			{
+				segment_ptr seg=seg_ ? seg_ : held_;
+				seg->data_.resize(size);
+				s3_connection::download_data_async(content_->ctx_,
+					content_->remote_path_, start_offset, seg->data_.data(),
+					size, on_done);
+			} else
+			{
+				handle_.reset(new handle_t(
+					open(content_->local_file_.c_str(), O_RDWR)
+					| libc_die2("Failed to open "
+								+content_->local_file_.string())));
+				s3_connection::download_file_async(content_->ctx_,
+					content_->remote_path_, start_offset, size,
+					handle_->get(), on_done);
+			}
+		} catch(...)
+		{
+			release_file();
+			agenda->end_async(shared_from_this(), sok, attempt_);
+			throw;
+		}
+		return true;
+	}
+
+	//Called from the transfer engine, must not block
+	void on_downloaded(agenda_ptr agenda, const result_code_t &res)
+	{
+		release_file();
+		size_t attempt=attempt_++;
+		if (res.ok())
+		{
+			done_=true;
+			agenda->schedule(shared_from_this());
+		} else
+			held_.reset(); //The retry waits for a segment of its own
+		agenda->end_async(shared_from_this(), res, attempt);
+	}
+
+	void release_file()
+	{
+		if (seg_ || held_)
+			return;
+		handle_.reset();
+		async_file_parts--;
+	}
 
+	void part_downloaded(agenda_ptr agenda, size_t size)
+	{
+		agenda->add_stat_counter("downloaded", size);
 		VLOG(2) << "Finished downloading part " << cur_segment_ << " out of "
 				<< content_->num_segments_ << " of " << content_->remote_path_;
 
+		if (seg_)
+		{
+			guard_t lock(content_->m_);
+			on_segment_arrived(content_, cur_segment_, seg_, agenda);
+			seg_.reset();
+			return;
+		}
+		if (!held_)
+		{
+			on_segment_written(content_, agenda);
+			return;
+		}
+
 		//Now write the resulting segment
-		sync_task_ptr dl(new write_segment_task(content_, cur_segment_, seg));
+		sync_task_ptr dl(new write_segment_task(content_, cur_segment_,
+												held_));
+		held_.reset();
 		agenda->schedule(dl);
 	}
 };
 
+//Must be called with the content lock held
+static void pump_downloads(download_content_ptr content, agenda_ptr agenda)
+{
+	//Segments are requested in order, so the next segment to decode
+	//always has its buffer and the window can't get stuck
+	while(!content->free_.empty() &&
+		  content->next_scheduled_<content->num_segments_)
+	{
+		sync_task_ptr dl(new download_segment_task(content,
+			content->next_scheduled_++, content->free_.back()));
+		content->free_.pop_back();
+		agenda->schedule(dl);
+	}
+}
+
+/**
+  Reserves a window of segments for a file that is decompressed while
+  it's being downloaded, so that files can't starve each other.
+  */
+class stream_download_task: public sync_task
+{
+	download_content_ptr content_;
+	size_t window_;
+public:
+	stream_download_task(download_content_ptr content, size_t window)
+		: content_(content), window_(window)
+	{
+	}
+
+	virtual size_t needs_segments() const { return window_; }
+
+	virtual void print_to(std::ostream &str)
+	{
+		str << "Start streaming download of " << content_->remote_path_;
+	}
+
+	virtual void operator()(agenda_ptr agenda,
+							const std::vector<segment_ptr> &segments)
+	{
+		guard_t lock(content_->m_);
+		content_->free_=segments;
+		pump_downloads(content_, agenda);
+	}
+};
+
 void file_downloader::operator()(agenda_ptr agenda)
 {
 	if (delete_dir_)
@@ -187,16 +520,26 @@ void file_downloader::operator()(agenda_ptr agenda)
 	if (!mod.found_)
 		err(errFatal) << "Document not found at: " << remote_;
 	
+	//We need to download the file, unless it's up to date
+	download_content_ptr dc(new download_content());
+	dc->ctx_=conn_;
+	dc->mtime_=mod.mtime_;
+	dc->raw_size_=mod.raw_size_;
+	dc->remote_size_=mod.remote_size_;
+	dc->etag_=mod.etag_;
+	dc->remote_path_=remote_;
+	dc->target_file_=path_;
+
 	if(mod.mtime_)
 	{
 		if (mod.mtime_==mtime && mod.raw_size_==file_sz)
+		{
+			dc->delete_temp_file_=false; //Nothing was created
+			record_state(dc);
 			return; //TODO: add an optional MD5 check?
+		}
 	}
 
-	//We need to download the file
-	download_content_ptr dc(new download_content());
-	dc->ctx_=conn_;
-
 	size_t seg_size = agenda->segment_size();
 	size_t seg_num = safe_cast<size_t>(mod.remote_size_/seg_size +
 				((mod.remote_size_%seg_size)==0?0:1));
@@ -208,20 +551,16 @@ void file_downloader::operator()(agenda_ptr agenda)
 		seg_num=1;
 	}
 
-	dc->mtime_=mod.mtime_;
 	dc->mode_=mod.mode_;
 	dc->num_segments_=seg_num;
 	dc->segments_read_=0;
-	dc->remote_size_=mod.remote_size_;
-	dc->raw_size_=mod.raw_size_;
 	dc->compressed_=mod.compressed_;
-
-	dc->remote_path_=remote_;
-	dc->target_file_=path_;
+	dc->codec_=mod.codec_;
 
 	VLOG(2) << "Downloading " << path_ << " from " << remote_;
 
-	if (mod.compressed_)
+	bool streaming=mod.compressed_ && conn_->stream_decompress_;
+	if (mod.compressed_ && !streaming)
 	{
 		path tmp_nm = conn_->scratch_dir_ /
 				bf::unique_path("scratchy-%%%%-%%%%-%%%%-%%%%-dl");
@@ -237,18 +576,28 @@ void file_downloader::operator()(agenda_ptr agenda)
 		handle_t fl(open(dc->local_file_.c_str(), O_RDWR|O_CREAT, 0600)
 					| libc_die2("Failed to create file "
 							   +dc->local_file_.string()));
+		uint64_t alloc_size=streaming ? dc->raw_size_ : dc->remote_size_;
 #ifndef __MACH__		
-		fallocate64(fl.get(), 0, 0, dc->remote_size_);
+		fallocate64(fl.get(), 0, 0, alloc_size);
 #else
-		fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)dc->remote_size_};
+		fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, (off_t)alloc_size};
 		// OK, perhaps we are too fragmented, allocate non-continuous
 	    store.fst_flags = F_ALLOCATEALL;
 	    int ret = fcntl(fl.get(), F_PREALLOCATE, &store);
 	    if (ret!=-1)
-			ftruncate(fl.get(), (off_t)dc->remote_size_);
+			ftruncate(fl.get(), (off_t)alloc_size);
 #endif
 	}
 
+	if (streaming)
+	{
+		size_t window=std::min(agenda->max_in_flight()/2, seg_num);
+		sync_task_ptr dl(new stream_download_task(dc, std::max(window,
+															   size_t(1))));
+		agenda->schedule(dl);
+		return;
+	}
+
 	for(size_t f=0;f<seg_num;++f)
 	{
 		sync_task_ptr dl(new download_segment_task(dc, f));
@@ -0,0 +1,121 @@
+#ifndef FILE_TABLE_H
+#define FILE_TABLE_H
+
+#include "common.h"
+#include <algorithm>
+#include <string.h>
+
+namespace es3 {
+	/**
+	  Files of one directory in a single vector. Names (and an optional
+	  extra string per file) are stored back to back in an arena, so a
+	  file costs a fixed-size entry plus its name bytes instead of a
+	  separately allocated node with its own full path.
+	  Files can be added in any order, seal() sorts them by name and
+	  lookups need a sealed table.
+	  */
+	template<class entry_t> class file_table
+	{
+		struct slot
+		{
+			uint32_t name_off_, name_len_, extra_len_;
+			entry_t entry_;
+		};
+		struct slot_less
+		{
+			const std::string &arena_;
+			slot_less(const std::string &arena) : arena_(arena) {}
+			bool operator()(const slot &l, const slot &r) const
+			{
+				int res=memcmp(arena_.data()+l.name_off_,
+							   arena_.data()+r.name_off_,
+							   std::min(l.name_len_, r.name_len_));
+				return res<0 || (res==0 && l.name_len_<r.name_len_);
+			}
+		};
+
+		std::string arena_;
+		std::vector<slot> slots_;
+		bool sealed_;
+	public:
+		static const size_t npos=size_t(-1);
+
+		file_table() : sealed_(true) {}
+
+		void add(const std::string &name, const entry_t &entry,
+				 const std::string &extra=std::string())
+		{
+			slot s;
+			s.name_off_=safe_cast<uint32_t>(arena_.size());
+			s.name_len_=name.size();
+			s.extra_len_=extra.size();
+			s.entry_=entry;
+			arena_.append(name).append(extra);
+			slots_.push_back(s);
+			sealed_=false;
+		}
+
+		/**
+		  Sorts the files by name. If a name was added more than once
+		  then the last entry wins.
+		  */
+		void seal()
+		{
+			if (sealed_)
+				return;
+			std::stable_sort(slots_.begin(), slots_.end(), slot_less(arena_));
+			size_t out=0;
+			for(size_t f=0;f<slots_.size();++f)
+			{
+				if (f+1<slots_.size() && !slot_less(arena_)(
+						slots_[f], slots_[f+1]))
+					continue; //Superseded by the next one
+				slots_[out++]=slots_[f];
+			}
+			slots_.resize(out);
+			sealed_=true;
+		}
+
+		size_t size() const { return slots_.size(); }
+		bool empty() const { return slots_.empty(); }
+
+		std::string name(size_t idx) const
+		{
+			const slot &s=slots_.at(idx);
+			return arena_.substr(s.name_off_, s.name_len_);
+		}
+		std::string extra(size_t idx) const
+		{
+			const slot &s=slots_.at(idx);
+			return arena_.substr(s.name_off_+s.name_len_, s.extra_len_);
+		}
+		const entry_t& at(size_t idx) const { return slots_.at(idx).entry_; }
+
+		size_t find(const std::string &name) const
+		{
+			assert(sealed_);
+			size_t lo=0, hi=slots_.size();
+			while(lo<hi)
+			{
+				size_t mid=lo+(hi-lo)/2;
+				const slot &s=slots_[mid];
+				int res=memcmp(arena_.data()+s.name_off_, name.data(),
+							   std::min(size_t(s.name_len_), name.size()));
+				if (res==0 && s.name_len_==name.size())
+					return mid;
+				if (res<0 || (res==0 && s.name_len_<name.size()))
+					lo=mid+1;
+				else
+					hi=mid;
+			}
+			return npos;
+		}
+		bool contains(const std::string &name) const
+		{
+			return find(name)!=npos;
+		}
+	};
+
+}; //namespace es3
+
+#endif //FILE_TABLE_H
@@ -0,0 +1,219 @@
+#include "journal.h"
+#include "connection.h"
+#include "errors.h"
+#include "state_db.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace es3;
+
+//Records are text lines of tab-separated fields:
+//  B <upload id> <mtime> <size> <part size> <key of the file pair>
+//  P <upload id> <part number> <etag>
+//  F <upload id>
+//A torn line at the end (the process died while writing it) is ignored.
+
+/**
+  Splits the line into num fields, the last one gets the rest of the
+  line. Returns false if there are fewer fields.
+  */
+static bool split_fields(const std::string &line, size_t num,
+						 std::vector<std::string> *res)
+{
+	res->clear();
+	size_t pos=0;
+	while(res->size()+1<num)
+	{
+		size_t end=line.find('\t', pos);
+		if (end==std::string::npos)
+			return false;
+		res->push_back(line.substr(pos, end-pos));
+		pos=end+1;
+	}
+	res->push_back(line.substr(pos));
+	return true;
+}
+
+upload_journal::upload_journal(const bf::path &path)
+	: path_(path), fd_(-1)
+{
+	load();
+}
+
+upload_journal::~upload_journal()
+{
+	if (fd_>=0)
+		close(fd_);
+}
+
+void upload_journal::load()
+{
+	std::string data;
+	int in=open(path_.c_str(), O_RDONLY);
+	if (in>=0)
+	{
+		handle_t fl(in);
+		data.resize(fl.size());
+		size_t done=0;
+		while(done<data.size())
+		{
+			size_t res=read(fl.get(), &data[done], data.size()-done)
+					| libc_die2("Can't read "+path_.string());
+			if (res==0)
+				break;
+			done+=res;
+		}
+		data.resize(done);
+	}
+
+	size_t pos=0;
+	std::vector<std::string> fields;
+	while(pos<data.size())
+	{
+		size_t end=data.find('\n', pos);
+		if (end==std::string::npos)
+			break; //Torn write
+		std::string line=data.substr(pos, end-pos);
+		pos=end+1;
+
+		if (line.compare(0, 2, "B\t")==0 && split_fields(line, 6, &fields))
+		{
+			journal_entry entry;
+			entry.upload_id_=fields[1];
+			entry.mtime_=atoll(fields[2].c_str());
+			entry.size_=strtoull(fields[3].c_str(), 0, 10);
+			entry.part_size_=strtoull(fields[4].c_str(), 0, 10);
+			const std::string &key=fields[5];
+			entries_[key]=entry;
+			keys_[entry.upload_id_]=key;
+		} else if (line.compare(0, 2, "P\t")==0 &&
+				   split_fields(line, 4, &fields))
+		{
+			auto iter=keys_.find(fields[1]);
+			if (iter!=keys_.end())
+				entries_[iter->second].etags_[
+						strtoull(fields[2].c_str(), 0, 10)]=fields[3];
+		} else if (line.compare(0, 2, "F\t")==0 &&
+				   split_fields(line, 2, &fields))
+		{
+			auto iter=keys_.find(fields[1]);
+			if (iter!=keys_.end())
+			{
+				entries_.erase(iter->second);
+				keys_.erase(iter);
+			}
+		}
+	}
+
+	//Rewrite the log with the unfinished uploads only
+	std::string compacted;
+	for(auto iter=entries_.begin();iter!=entries_.end();++iter)
+	{
+		const journal_entry &entry=iter->second;
+		compacted.append("B\t").append(entry.upload_id_).append("\t");
+		append_int_to_string(entry.mtime_, compacted);
+		compacted.append("\t");
+		append_int_to_string(entry.size_, compacted);
+		compacted.append("\t");
+		append_int_to_string(entry.part_size_, compacted);
+		compacted.append("\t").append(iter->first).append("\n");
+		for(auto part=entry.etags_.begin();part!=entry.etags_.end();++part)
+		{
+			compacted.append("P\t").append(entry.upload_id_).append("\t");
+			append_int_to_string(part->first, compacted);
+			compacted.append("\t").append(part->second).append("\n");
+		}
+	}
+
+	bf::path tmp_path=path_.string()+".tmp";
+	{
+		handle_t fl(open(tmp_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600)
+					| libc_die2("Can't create "+tmp_path.string()));
+		size_t done=0;
+		while(done<compacted.size())
+			done+=write(fl.get(), compacted.data()+done,
+						compacted.size()-done) | libc_die;
+		fsync(fl.get());
+	}
+	rename(tmp_path.c_str(), path_.c_str())
+			| libc_die2("Can't replace "+path_.string());
+
+	fd_=open(path_.c_str(), O_WRONLY|O_APPEND)
+			| libc_die2("Can't open "+path_.string());
+	VLOG(2) << "Loaded " << entries_.size() << " unfinished uploads from "
+			<< path_;
+}
+
+void upload_journal::append(const std::string &line)
+{
+	//Must be called with the lock held. Each record is a single
+	//append, the page cache keeps it if the process dies.
+	size_t done=0;
+	while(done<line.size())
+		done+=write(fd_, line.data()+done, line.size()-done)
+				| libc_die2("Can't write to "+path_.string());
+}
+
+bool upload_journal::find(const bf::path &local, const s3_path &remote,
+						  journal_entry *res) const
+{
+	guard_t lock(m_);
+	auto iter=entries_.find(sync_key(local, remote));
+	if (iter==entries_.end())
+		return false;
+	*res=iter->second;
+	return true;
+}
+
+void upload_journal::begin(const bf::path &local, const s3_path &remote,
+						   const journal_entry &entry)
+{
+	std::string key=sync_key(local, remote);
+	if (key.find('\n')!=std::string::npos)
+		return; //Can't be written as a line, such uploads aren't resumed
+
+	std::string line="B\t"+entry.upload_id_+"\t";
+	append_int_to_string(entry.mtime_, line);
+	line.append("\t");
+	append_int_to_string(entry.size_, line);
+	line.append("\t");
+	append_int_to_string(entry.part_size_, line);
+	line.append("\t").append(key).append("\n");
+
+	guard_t lock(m_);
+	auto iter=entries_.find(key);
+	if (iter!=entries_.end())
+		keys_.erase(iter->second.upload_id_);
+	entries_[key]=entry;
+	keys_[entry.upload_id_]=key;
+	append(line);
+}
+
+void upload_journal::part_done(const std::string &upload_id, size_t num,
+							   const std::string &etag)
+{
+	std::string line="P\t"+upload_id+"\t";
+	append_int_to_string(num, line);
+	line.append("\t").append(etag).append("\n");
+
+	guard_t lock(m_);
+	auto iter=keys_.find(upload_id);
+	if (iter==keys_.end())
+		return;
+	entries_[iter->second].etags_[num]=etag;
+	append(line);
+}
+
+void upload_journal::finish(const std::string &upload_id)
+{
+	guard_t lock(m_);
+	auto iter=keys_.find(upload_id);
+	if (iter==keys_.end())
+		return;
+	entries_.erase(iter->second);
+	keys_.erase(iter);
+	append("F\t"+upload_id+"\n");
+}
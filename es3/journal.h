@@ -0,0 +1,63 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "common.h"
+
+namespace es3 {
+	struct s3_path;
+
+	/**
+	  A multipart upload in progress and the file that it was started
+	  for. Parts are numbered from 0, all of them but the last one are
+	  part_size_ bytes long.
+	  */
+	struct journal_entry
+	{
+		std::string upload_id_;
+		time_t mtime_;
+		uint64_t size_, part_size_;
+		std::map<size_t, std::string> etags_;
+
+		journal_entry() : mtime_(), size_(), part_size_() {}
+	};
+
+	/**
+	  Append-only log of the multipart uploads in progress, so that the
+	  next run can resume an interrupted upload instead of starting it
+	  over. Finished uploads are dropped when the log is opened.
+	  */
+	class upload_journal
+	{
+		const bf::path path_;
+
+		mutable mutex_t m_; //This mutex protects the following data {
+		int fd_;
+		//By the local and remote paths
+		std::map<std::string, journal_entry> entries_;
+		std::map<std::string, std::string> keys_; //By upload ID
+		//}
+	public:
+		upload_journal(const bf::path &path);
+		~upload_journal();
+
+		bool find(const bf::path &local, const s3_path &remote,
+				  journal_entry *res) const;
+		void begin(const bf::path &local, const s3_path &remote,
+				   const journal_entry &entry);
+		void part_done(const std::string &upload_id, size_t num,
+					   const std::string &etag);
+		/**
+		  The upload is completed or abandoned.
+		  */
+		void finish(const std::string &upload_id);
+
+	private:
+		upload_journal(const upload_journal &);
+		void load();
+		void append(const std::string &line);
+	};
+	typedef boost::shared_ptr<upload_journal> upload_journal_ptr;
+
+}; //namespace es3
+
+#endif //JOURNAL_H
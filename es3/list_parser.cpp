@@ -0,0 +1,236 @@
+#include "list_parser.h"
+#include <stdlib.h>
+#include <string.h>
+
+using namespace es3;
+
+//Longer entities are malformed and are kept as text
+#define MAX_ENTITY_LEN 10
+
+listing_parser::listing_parser(const listing_callback &callback)
+	: callback_(callback), state_(stText), section_(secNone), field_(fNone),
+	  depth_(), closing_(), self_closing_(), stopped_(), quote_()
+{
+}
+
+void listing_parser::feed(const char *data, size_t len)
+{
+	const char *end=data+len;
+	const char *cur=data;
+	while(cur<end && !stopped_)
+	{
+		char c=*cur;
+		switch(state_)
+		{
+		case stText:
+			{
+				//Copy the text up to the next markup in one go
+				const char *run=cur;
+				while(cur<end && *cur!='<' && *cur!='&')
+					++cur;
+				add_text(run, cur-run);
+				if (cur==end)
+					return;
+				state_=(*cur=='<') ? stTagStart : stEntity;
+				tag_.clear();
+				entity_.clear();
+				closing_=self_closing_=false;
+				++cur;
+			}
+			continue;
+		case stTagStart:
+			if (c=='/')
+			{
+				closing_=true;
+				state_=stTagName;
+			} else if (c=='?' || c=='!')
+				state_=stSkip;
+			else
+			{
+				tag_.push_back(c);
+				state_=stTagName;
+			}
+			break;
+		case stTagName:
+			if (c=='/')
+			{
+				self_closing_=true;
+				state_=stTagRest;
+			} else if (c==' ' || c=='\t' || c=='\r' || c=='\n')
+				state_=stTagRest;
+			else if (c!='>')
+				tag_.push_back(c);
+			break;
+		case stTagRest:
+			//Attributes are skipped, but a quoted '>' doesn't end the tag
+			if (quote_)
+			{
+				if (c==quote_)
+					quote_=0;
+			} else if (c=='"' || c=='\'')
+				quote_=c;
+			else if (c!='>')
+				self_closing_=(c=='/');
+			break;
+		case stEntity:
+			if (c==';')
+			{
+				add_entity();
+				state_=stText;
+			} else if (entity_.size()>=MAX_ENTITY_LEN)
+			{
+				add_text("&", 1);
+				add_text(entity_.data(), entity_.size());
+				state_=stText;
+				continue; //Reprocess this character as text
+			} else
+				entity_.push_back(c);
+			break;
+		case stSkip:
+			if (c=='>')
+				state_=stText;
+			break;
+		}
+
+		if (c=='>' && !quote_ && (state_==stTagName || state_==stTagRest))
+		{
+			if (!closing_)
+				open_element();
+			if (closing_ || self_closing_)
+				close_element();
+			state_=stText;
+		}
+		++cur;
+	}
+}
+
+void listing_parser::open_element()
+{
+	depth_++;
+	if (depth_==2)
+	{
+		section_=secNone;
+		if (tag_=="Contents" || tag_=="CommonPrefixes")
+		{
+			section_=(tag_=="Contents") ? secContents : secPrefixes;
+			entry_.name_.clear();
+			entry_.mtime_str_.clear();
+			entry_.etag_.clear();
+			entry_.size_=0;
+			entry_.is_prefix_=(section_==secPrefixes);
+		} else if (tag_=="IsTruncated")
+		{
+			field_=fTruncated;
+			truncated_str_.clear();
+		} else if (tag_=="NextMarker")
+		{
+			field_=fNextMarker;
+			next_marker_.clear();
+		}
+	} else if (depth_==3 && section_==secContents)
+	{
+		if (tag_=="Key")
+			field_=fName;
+		else if (tag_=="Size")
+			field_=fSize;
+		else if (tag_=="LastModified")
+			field_=fMtime;
+		else if (tag_=="ETag")
+			field_=fEtag;
+	} else if (depth_==3 && section_==secPrefixes && tag_=="Prefix")
+		field_=fName;
+}
+
+void listing_parser::close_element()
+{
+	if (depth_==2 && section_!=secNone)
+	{
+		last_name_=entry_.name_;
+		if (!callback_(entry_))
+			stopped_=true;
+		section_=secNone;
+	}
+	if (depth_<=3)
+		field_=fNone;
+	depth_--;
+}
+
+void listing_parser::add_text(const char *text, size_t len)
+{
+	switch(field_)
+	{
+	case fNone:
+		break;
+	case fName:
+		entry_.name_.append(text, len);
+		break;
+	case fSize:
+		for(size_t f=0;f<len;++f)
+			if (text[f]>='0' && text[f]<='9')
+				entry_.size_=entry_.size_*10+(text[f]-'0');
+		break;
+	case fMtime:
+		entry_.mtime_str_.append(text, len);
+		break;
+	case fEtag:
+		entry_.etag_.append(text, len);
+		break;
+	case fTruncated:
+		truncated_str_.append(text, len);
+		break;
+	case fNextMarker:
+		next_marker_.append(text, len);
+		break;
+	}
+}
+
+void listing_parser::add_entity()
+{
+	char buf[4];
+	size_t len=1;
+	if (entity_=="amp")
+		buf[0]='&';
+	else if (entity_=="lt")
+		buf[0]='<';
+	else if (entity_=="gt")
+		buf[0]='>';
+	else if (entity_=="quot")
+		buf[0]='"';
+	else if (entity_=="apos")
+		buf[0]='\'';
+	else if (!entity_.empty() && entity_[0]=='#')
+	{
+		//Character reference, encoded as UTF-8
+		unsigned long code=(entity_.size()>1 && entity_[1]=='x') ?
+			strtoul(entity_.c_str()+2, 0, 16) :
+			strtoul(entity_.c_str()+1, 0, 10);
+		if (code<0x80)
+			buf[0]=char(code);
+		else if (code<0x800)
+		{
+			buf[0]=char(0xC0|(code>>6));
+			buf[1]=char(0x80|(code&0x3F));
+			len=2;
+		} else if (code<0x10000)
+		{
+			buf[0]=char(0xE0|(code>>12));
+			buf[1]=char(0x80|((code>>6)&0x3F));
+			buf[2]=char(0x80|(code&0x3F));
+			len=3;
+		} else
+		{
+			buf[0]=char(0xF0|((code>>18)&0x07));
+			buf[1]=char(0x80|((code>>12)&0x3F));
+			buf[2]=char(0x80|((code>>6)&0x3F));
+			buf[3]=char(0x80|(code&0x3F));
+			len=4;
+		}
+	} else
+	{
+		add_text("&", 1);
+		add_text(entity_.data(), entity_.size());
+		add_text(";", 1);
+		return;
+	}
+	add_text(buf, len);
+}
@@ -0,0 +1,90 @@
+#ifndef LIST_PARSER_H
+#define LIST_PARSER_H
+
+#include "common.h"
+#include <boost/function.hpp>
+
+namespace es3 {
+	struct listing_entry
+	{
+		std::string name_; //The key or the common prefix
+		std::string mtime_str_, etag_;
+		uint64_t size_;
+		bool is_prefix_;
+
+		listing_entry() : size_(), is_prefix_() {}
+	};
+	//Returns false if the rest of the listing is not needed
+	typedef boost::function<bool(const listing_entry&)> listing_callback;
+
+	/**
+	  Incremental parser of ListBucketResult documents. The response is
+	  fed in chunks as it arrives and each entry is reported as soon as
+	  its element is closed, without building a DOM. Elements that are
+	  not needed for the listing are skipped.
+	  */
+	class listing_parser
+	{
+		enum state_e
+		{
+			stText,
+			stTagStart,
+			stTagName,
+			stTagRest,
+			stEntity,
+			stSkip, //Declarations and processing instructions
+		};
+		enum section_e
+		{
+			secNone,
+			secContents,
+			secPrefixes,
+		};
+		enum field_e
+		{
+			fNone,
+			fName,
+			fSize,
+			fMtime,
+			fEtag,
+			fTruncated,
+			fNextMarker,
+		};
+
+		const listing_callback callback_;
+		state_e state_;
+		section_e section_;
+		field_e field_;
+		int depth_;
+		bool closing_, self_closing_, stopped_;
+		char quote_;
+		std::string tag_, entity_, truncated_str_;
+
+		listing_entry entry_;
+		std::string last_name_, next_marker_;
+	public:
+		listing_parser(const listing_callback &callback);
+
+		void feed(const char *data, size_t len);
+
+		bool is_truncated() const { return truncated_str_=="true"; }
+		bool stopped() const { return stopped_; }
+		/**
+		  The marker to continue the listing from.
+		  */
+		const std::string& next_marker() const
+		{
+			return next_marker_.empty() ? last_name_ : next_marker_;
+		}
+
+	private:
+		listing_parser(const listing_parser &);
+		void open_element();
+		void close_element();
+		void add_text(const char *text, size_t len);
+		void add_entity();
+	};
+
+}; //namespace es3
+
+#endif //LIST_PARSER_H
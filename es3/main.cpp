@@ -10,6 +10,10 @@
 #include <boost/bind.hpp>
 #include <curl/curl.h>
 #include "mimes.h"
+#include "transfer.h"
+#include "state_db.h"
+#include "journal.h"
+#include "signer.h"
 
 using namespace es3;
 namespace po = boost::program_options;
@@ -68,6 +72,7 @@ int main(int argc, char **argv)
 
 	init_mimes();
 	context_ptr cd(new conn_context());
+	bf::path state_db, journal;
 
 	po::options_description generic("Generic options", term_width);
 	generic.add_options()
@@ -81,8 +86,20 @@ int main(int argc, char **argv)
 		("scratch-dir,i", po::value<bf::path>(&cd->scratch_dir_)
 			->default_value(bf::temp_directory_path())->required(),
 			"Path to the scratch directory")
+		("state-db", po::value<bf::path>(&state_db),
+			"Path to the sync state database. Files that haven't "
+			"changed since they were last synced are skipped")
+		("upload-journal", po::value<bf::path>(&journal),
+			"Path to the journal of multipart uploads in progress. "
+			"Uploads interrupted by a previous run are resumed")
+		("fast-compare", po::value<bool>(
+			 &cd->fast_compare_)->default_value(false),
+			"Decide which files differ using the listing and the sync "
+			"state database, without per-file HEAD requests. Requires "
+			"--state-db")
 	;
 
+	std::string codec;
 	po::options_description access("Access settings", term_width);
 	access.add_options()
 		("access-key,a", po::value<std::string>(
@@ -96,13 +113,41 @@ int main(int argc, char **argv)
 		("use-ssl,l", po::value<bool>(
 			 &cd->use_ssl_)->default_value(false),
 			"Use SSL for communications with the Amazon S3 servers")
+		("sigv4", po::value<bool>(
+			 &cd->use_sigv4_)->default_value(false),
+			"Sign the requests with AWS Signature Version 4, the newer "
+			"regions accept only it")
+		("endpoint", po::value<std::string>(
+			 &cd->endpoint_)->default_value(""),
+			"host[:port] of an S3-compatible service to use instead of "
+			"Amazon S3, buckets are addressed path-style")
+		("http2", po::value<bool>(
+			 &cd->use_http2_)->default_value(false),
+			"Multiplex the requests over HTTP/2 connections, requires "
+			"--use-ssl and a server that supports HTTP/2")
 		("compression,m", po::value<bool>(
 			 &cd->do_compression_)->default_value(true)->required(),
-			"Use GZIP compression")
+			"Compress the uploaded files")
+		("codec", po::value<std::string>(
+			 &codec)->default_value("gzip"),
+			"Compression codec [gzip, zstd, lz4]")
+		("compression-level", po::value<int>(
+			 &cd->compression_level_)->default_value(0),
+			"Compression level [0 - the codec's default]")
+		("zero-copy,z", po::value<bool>(
+			 &cd->zero_copy_)->default_value(true),
+			"Stream uncompressed data directly between files and "
+			"the network, bypassing segment buffers")
+		("stream-decompress", po::value<bool>(
+			 &cd->stream_decompress_)->default_value(false),
+			"Decompress files while they are being downloaded instead "
+			"of using a scratch file")
 	;
 	generic.add(access);
 
 	int thread_num=0, io_threads=0, cpu_threads=0, segment_size=0, segments=0;
+	int transfer_threads=0, http2_streams=0;
+	bool huge_pages=false;
 	po::options_description tuning("Tuning", term_width);
 	tuning.add_options()
 		("thread-num,n", po::value<int>(&thread_num)->default_value(0),
@@ -119,6 +164,17 @@ int main(int argc, char **argv)
 		("segments-in-flight,f", po::value<int>(
 			 &segments)->default_value(0),
 			"Number of segments in-flight [0 - autodetect]")
+		("transfer-threads,x", po::value<int>(
+			 &transfer_threads)->default_value(0),
+			"Number of event loop threads driving the HTTP transfers. "
+			"Listing HEADs and small uploads then don't hold a thread "
+			"each [0 - use blocking transfers]")
+		("http2-streams", po::value<int>(
+			 &http2_streams)->default_value(100),
+			"Maximum number of concurrent HTTP/2 streams per connection")
+		("huge-pages", po::value<bool>(
+			 &huge_pages)->default_value(false),
+			"Back segment buffers with transparent huge pages")
 	;
 	generic.add(tuning);
 
@@ -262,6 +318,27 @@ int main(int argc, char **argv)
 	}
 
 	logger::set_verbosity(verbosity);
+	try
+	{
+		cd->codec_=parse_codec(codec);
+	} catch(const es3_exception &ex)
+	{
+		std::cerr << ex.what() << std::endl;
+		return 2;
+	}
+	if (cd->use_http2_ && !cd->use_ssl_)
+	{
+		//HTTP/2 is only negotiated over TLS, plain HTTP would silently
+		//stay HTTP/1.1
+		std::cerr << "ERR: --http2 requires --use-ssl" << std::endl;
+		return 2;
+	}
+	if (cd->fast_compare_ && state_db.empty())
+	{
+		//Without the recorded state every file would still be HEADed
+		std::cerr << "ERR: --fast-compare requires --state-db" << std::endl;
+		return 2;
+	}
 	curl_global_init(CURL_GLOBAL_ALL);
 	ON_BLOCK_EXIT(&curl_global_cleanup);
 
@@ -278,6 +355,24 @@ int main(int argc, char **argv)
 	if (thread_num<=0)
 		thread_num=sysconf(_SC_NPROCESSORS_ONLN)*6+40;
 
+	if (cd->use_http2_)
+	{
+		//Only the requests of one multi handle can share a connection
+		if (transfer_threads<=0)
+			transfer_threads=1;
+		if (http2_streams<=0)
+			http2_streams=1;
+	}
+	if (transfer_threads>0)
+		cd->engine_=transfer_engine_ptr(new transfer_engine(transfer_threads,
+			thread_num, cd->use_http2_ ? http2_streams : 0));
+	cd->signer_=signer_ptr(new request_signer(cd->api_key_, cd->secret_key));
+	if (!state_db.empty())
+		cd->state_db_=sync_state_db_ptr(new sync_state_db(state_db));
+	if (!journal.empty())
+		cd->journal_=upload_journal_ptr(new upload_journal(journal));
+	ON_BLOCK_EXIT_OBJ(*cd, &conn_context::shutdown);
+
 	if (cur_subcommand=="cat")
 	{
 		no_progress=no_stats=true; //A special hack
@@ -285,7 +380,7 @@ int main(int argc, char **argv)
 	
 	agenda_ptr ag(new agenda(thread_num, cpu_threads, io_threads,
 							 no_progress, no_stats,
-							 segment_size, segments));
+							 segment_size, segments, huge_pages));
 
 	try
 	{
@@ -0,0 +1,191 @@
+#include "signer.h"
+#include "errors.h"
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
+//The HMAC_CTX functions are deprecated since OpenSSL 3.0
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+typedef EVP_MAC_CTX mac_ctx_t;
+#else
+typedef HMAC_CTX mac_ctx_t;
+#endif
+
+using namespace es3;
+
+static void free_mac(mac_ctx_t *ctx)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MAC_CTX_free(ctx);
+#else
+	HMAC_CTX_free(ctx);
+#endif
+}
+
+namespace es3
+{
+	struct signer_state
+	{
+		mac_ctx_t *sha1_; //Loaded with the secret key
+		std::string buf_;
+
+		//SigV4 contexts loaded with the signing keys of the current day,
+		//by "region/service"
+		std::string v4_date_;
+		std::map<std::string, mac_ctx_t*> v4_;
+
+		signer_state() : sha1_() {}
+		~signer_state()
+		{
+			free_mac(sha1_);
+			clear_v4();
+		}
+
+		void clear_v4()
+		{
+			for(auto iter=v4_.begin();iter!=v4_.end();++iter)
+				free_mac(iter->second);
+			v4_.clear();
+		}
+	};
+};
+
+/**
+  Creates an HMAC context with the key loaded, the digest is given by
+  its OpenSSL name.
+  */
+static mac_ctx_t* new_hmac(const char *digest, const void *key,
+						   size_t key_len)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	EVP_MAC *mac=EVP_MAC_fetch(0, "HMAC", 0);
+	mac_ctx_t *res=mac ? EVP_MAC_CTX_new(mac) : 0;
+	EVP_MAC_free(mac); //The context keeps its own reference
+	OSSL_PARAM params[]={
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+										 const_cast<char*>(digest), 0),
+		OSSL_PARAM_construct_end()
+	};
+	bool ok=res && EVP_MAC_init(res,
+		reinterpret_cast<const unsigned char*>(key), key_len, params);
+#else
+	mac_ctx_t *res=HMAC_CTX_new();
+	bool ok=res && HMAC_Init_ex(res, key, key_len,
+								EVP_get_digestbyname(digest), 0);
+#endif
+	if (!ok)
+	{
+		free_mac(res);
+		err(errFatal) << "Can't initialize HMAC";
+	}
+	return res;
+}
+
+/**
+  Runs the HMAC with the key that is already loaded into the context.
+  */
+static unsigned int run_hmac(mac_ctx_t *ctx, const std::string &str,
+							 unsigned char *md)
+{
+	const unsigned char *data=
+			reinterpret_cast<const unsigned char*>(str.data());
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	//No key restarts the context with the key pads it already has
+	size_t md_len=0;
+	if (!EVP_MAC_init(ctx, 0, 0, 0))
+		err(errFatal) << "Can't restart HMAC";
+	EVP_MAC_update(ctx, data, str.size());
+	EVP_MAC_final(ctx, md, &md_len, EVP_MAX_MD_SIZE);
+	return md_len;
+#else
+	unsigned int md_len=0;
+	HMAC_Init_ex(ctx, 0, 0, 0, 0);
+	HMAC_Update(ctx, data, str.size());
+	HMAC_Final(ctx, md, &md_len);
+	return md_len;
+#endif
+}
+
+request_signer::request_signer(const std::string &api_key,
+							   const std::string &secret_key)
+	: api_key_(api_key), secret_key_(secret_key)
+{
+}
+
+request_signer::~request_signer()
+{
+}
+
+signer_state* request_signer::get_state()
+{
+	signer_state *res=state_.get();
+	if (!res)
+	{
+		res=new signer_state();
+		state_.reset(res);
+		res->sha1_=new_hmac("SHA1", secret_key_.data(), secret_key_.size());
+	}
+	return res;
+}
+
+std::string& request_signer::buffer()
+{
+	std::string &res=get_state()->buf_;
+	res.clear();
+	return res;
+}
+
+std::string request_signer::sign_v2(const std::string &str)
+{
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len=run_hmac(get_state()->sha1_, str, md);
+
+	char res[EVP_MAX_MD_SIZE*2];
+	int len=EVP_EncodeBlock(reinterpret_cast<unsigned char*>(res),
+							md, md_len);
+	return std::string(res, len);
+}
+
+std::string request_signer::sign_v4(const std::string &str,
+									const std::string &date,
+									const std::string &region,
+									const std::string &service)
+{
+	signer_state *state=get_state();
+	if (state->v4_date_!=date)
+	{
+		state->clear_v4();
+		state->v4_date_=date;
+	}
+
+	mac_ctx_t *&ctx=state->v4_[region+"/"+service];
+	if (!ctx)
+	{
+		//Derive the signing key for the day
+		static const std::string terminator("aws4_request");
+		const std::string *parts[]={&date, &region, &service, &terminator};
+		std::string key="AWS4"+secret_key_;
+		for(int f=0;f<4;++f)
+		{
+			unsigned char md[EVP_MAX_MD_SIZE];
+			unsigned int md_len=0;
+			HMAC(EVP_sha256(), key.data(), key.size(),
+				 reinterpret_cast<const unsigned char*>(parts[f]->data()),
+				 parts[f]->size(), md, &md_len);
+			key.assign(reinterpret_cast<const char*>(md), md_len);
+		}
+		ctx=new_hmac("SHA256", key.data(), key.size());
+	}
+
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int md_len=run_hmac(ctx, str, md);
+	return tobinhex(md, md_len);
+}
+
+std::string request_signer::sha256_hex(const char *data, size_t len)
+{
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	SHA256(reinterpret_cast<const unsigned char*>(data), len, md);
+	return tobinhex(md, SHA256_DIGEST_LENGTH);
+}
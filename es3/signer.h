@@ -0,0 +1,54 @@
+#ifndef SIGNER_H
+#define SIGNER_H
+
+#include "common.h"
+#include <boost/thread/tss.hpp>
+
+namespace es3 {
+	struct signer_state;
+
+	/**
+	  Signs the requests. Each thread keeps an HMAC context with the
+	  secret key already loaded and a buffer for the strings to sign,
+	  so a signature doesn't allocate or re-derive the key pads.
+	  SigV4 signing keys are derived once per day and region.
+	  */
+	class request_signer
+	{
+		const std::string api_key_, secret_key_;
+		boost::thread_specific_ptr<signer_state> state_;
+	public:
+		request_signer(const std::string &api_key,
+					   const std::string &secret_key);
+		~request_signer();
+
+		const std::string& api_key() const { return api_key_; }
+
+		/**
+		  The buffer of the current thread for the string to sign. It's
+		  returned empty, but it keeps its capacity.
+		  */
+		std::string& buffer();
+
+		/**
+		  Base64 of the HMAC-SHA1 of the string, as used by SigV2.
+		  */
+		std::string sign_v2(const std::string &str);
+		/**
+		  Hex of the SigV4 signature of the string. The date is in the
+		  YYYYMMDD form.
+		  */
+		std::string sign_v4(const std::string &str, const std::string &date,
+							const std::string &region,
+							const std::string &service="s3");
+
+		static std::string sha256_hex(const char *data, size_t len);
+	private:
+		request_signer(const request_signer &);
+		signer_state* get_state();
+	};
+	typedef boost::shared_ptr<request_signer> signer_ptr;
+
+}; //namespace es3
+
+#endif //SIGNER_H
@@ -0,0 +1,306 @@
+#include "state_db.h"
+#include "connection.h"
+#include "errors.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace es3;
+
+//File layout: magic, number of records, record offsets, records sorted
+//by key. A record is a fixed header followed by the key and the ETag.
+#define STATE_DB_MAGIC "ES3STAT1"
+#define MAGIC_LEN 8
+#define RECORD_HEADER_LEN 32
+//Seconds between the saves during a run, a killed run keeps most of
+//its records
+#define SAVE_INTERVAL 300
+
+std::string es3::normalize_etag(const std::string &etag)
+{
+	std::string res=trim(etag);
+	if (res.size()>=2 && res[0]=='"' && *res.rbegin()=='"')
+		res=res.substr(1, res.size()-2);
+	return res;
+}
+
+std::string es3::sync_key(const bf::path &local, const s3_path &remote)
+{
+	//The local path may contain any character, its length keeps the
+	//key unambiguous
+	const std::string &local_str=local.string();
+	std::string res;
+	append_int_to_string(local_str.size(), res);
+	res.append(":").append(local_str);
+	return res.append(remote.bucket_).append(remote.path_);
+}
+
+static void put_record(std::string &out, const std::string &key,
+					   const sync_state &state)
+{
+	char hdr[RECORD_HEADER_LEN];
+	uint32_t key_len=key.size(), etag_len=state.etag_.size();
+	int64_t mtime=state.mtime_;
+	memcpy(hdr, &key_len, 4);
+	memcpy(hdr+4, &etag_len, 4);
+	memcpy(hdr+8, &mtime, 8);
+	memcpy(hdr+16, &state.size_, 8);
+	memcpy(hdr+24, &state.remote_size_, 8);
+	out.append(hdr, RECORD_HEADER_LEN);
+	out.append(key);
+	out.append(state.etag_);
+}
+
+sync_state_db::sync_state_db(const bf::path &path)
+	: path_(path), fd_(-1), map_(), map_size_(), num_records_(), offsets_(),
+	  etags_indexed_(), last_save_(time(NULL))
+{
+	open_map();
+}
+
+void sync_state_db::open_map()
+{
+	fd_=open(path_.c_str(), O_RDONLY);
+	if (fd_<0)
+		return; //There's no database yet
+
+	struct stat st={0};
+	fstat(fd_, &st) | libc_die2("Can't stat "+path_.string());
+	map_size_=st.st_size;
+	bool valid=map_size_>=MAGIC_LEN+8;
+	if (valid)
+	{
+		void *res=mmap(0, map_size_, PROT_READ, MAP_SHARED, fd_, 0);
+		if (res==MAP_FAILED)
+			err(errFatal) << "Can't map " << path_;
+		map_=reinterpret_cast<const char*>(res);
+		memcpy(&num_records_, map_+MAGIC_LEN, 8);
+		offsets_=reinterpret_cast<const uint64_t*>(map_+MAGIC_LEN+8);
+		valid=memcmp(map_, STATE_DB_MAGIC, MAGIC_LEN)==0 && check_records();
+	}
+	if (!valid)
+	{
+		//The records are synced again and a new database is saved
+		VLOG(0) << "WARN: State database " << path_
+				<< " is corrupted, it will be started over";
+		close_map();
+		return;
+	}
+	VLOG(2) << "Loaded " << num_records_ << " sync states from " << path_;
+}
+
+/**
+  Makes sure that every record lies within the file, so that a
+  truncated or damaged database is never read past its end.
+  */
+bool sync_state_db::check_records() const
+{
+	if (num_records_>(map_size_-MAGIC_LEN-8)/8)
+		return false;
+	for(size_t f=0;f<num_records_;++f)
+	{
+		uint64_t off=offsets_[f];
+		if (off>map_size_ || map_size_-off<RECORD_HEADER_LEN)
+			return false;
+		uint32_t key_len=0, etag_len=0;
+		memcpy(&key_len, map_+off, 4);
+		memcpy(&etag_len, map_+off+4, 4);
+		if (map_size_-off-RECORD_HEADER_LEN<uint64_t(key_len)+etag_len)
+			return false;
+	}
+	return true;
+}
+
+sync_state_db::~sync_state_db()
+{
+	close_map();
+}
+
+void sync_state_db::close_map()
+{
+	if (map_)
+		munmap(const_cast<char*>(map_), map_size_);
+	if (fd_>=0)
+		close(fd_);
+	map_=0;
+	fd_=-1;
+	map_size_=num_records_=0;
+	offsets_=0;
+}
+
+std::string sync_state_db::key_at(size_t idx) const
+{
+	const char *rec=map_+offsets_[idx];
+	uint32_t key_len=0;
+	memcpy(&key_len, rec, 4);
+	return std::string(rec+RECORD_HEADER_LEN, key_len);
+}
+
+void sync_state_db::read_at(size_t idx, sync_state *res) const
+{
+	const char *rec=map_+offsets_[idx];
+	uint32_t key_len=0, etag_len=0;
+	int64_t mtime=0;
+	memcpy(&key_len, rec, 4);
+	memcpy(&etag_len, rec+4, 4);
+	memcpy(&mtime, rec+8, 8);
+	memcpy(&res->size_, rec+16, 8);
+	memcpy(&res->remote_size_, rec+24, 8);
+	res->mtime_=mtime;
+	res->etag_.assign(rec+RECORD_HEADER_LEN+key_len, etag_len);
+}
+
+bool sync_state_db::find_mapped(const std::string &key,
+								sync_state *res) const
+{
+	size_t lo=0, hi=num_records_;
+	while(lo<hi)
+	{
+		size_t mid=lo+(hi-lo)/2;
+		int cmp=key_at(mid).compare(key);
+		if (cmp==0)
+		{
+			read_at(mid, res);
+			return true;
+		}
+		if (cmp<0)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return false;
+}
+
+bool sync_state_db::find(const bf::path &local, const s3_path &remote,
+						 sync_state *res) const
+{
+	std::string key=sync_key(local, remote);
+	guard_t lock(m_);
+	auto iter=updates_.find(key);
+	if (iter!=updates_.end())
+	{
+		*res=iter->second;
+		return true;
+	}
+	return find_mapped(key, res);
+}
+
+void sync_state_db::record(const bf::path &local, const s3_path &remote,
+						   const sync_state &state)
+{
+	sync_state cur=state;
+	cur.etag_=normalize_etag(cur.etag_);
+	guard_t lock(m_);
+	updates_[sync_key(local, remote)]=cur;
+	if (etags_indexed_ && !cur.etag_.empty())
+		by_etag_[cur.etag_]=cur;
+	if (time(NULL)>=last_save_+SAVE_INTERVAL)
+		save_locked();
+}
+
+bool sync_state_db::find_by_etag(const std::string &etag,
+								 sync_state *res) const
+{
+	if (etag.empty())
+		return false;
+
+	guard_t lock(m_);
+	if (!etags_indexed_)
+	{
+		for(size_t f=0;f<num_records_;++f)
+		{
+			sync_state state;
+			read_at(f, &state);
+			if (!state.etag_.empty())
+				by_etag_[state.etag_]=state;
+		}
+		for(auto iter=updates_.begin();iter!=updates_.end();++iter)
+			if (!iter->second.etag_.empty())
+				by_etag_[iter->second.etag_]=iter->second;
+		etags_indexed_=true;
+		VLOG(2) << "Indexed " << by_etag_.size() << " ETags from " << path_;
+	}
+
+	auto iter=by_etag_.find(etag);
+	if (iter==by_etag_.end())
+		return false;
+	*res=iter->second;
+	return true;
+}
+
+void sync_state_db::save()
+{
+	guard_t lock(m_);
+	save_locked();
+}
+
+void sync_state_db::save_locked()
+{
+	last_save_=time(NULL);
+	if (updates_.empty())
+		return;
+
+	//Merge the mapped records with the updates, both are sorted
+	std::string records;
+	std::vector<uint64_t> offsets;
+	offsets.reserve(num_records_+updates_.size());
+	size_t idx=0;
+	auto iter=updates_.begin();
+	while(idx<num_records_ || iter!=updates_.end())
+	{
+		std::string key;
+		sync_state state;
+		if (idx<num_records_)
+			key=key_at(idx);
+
+		if (iter!=updates_.end() && (idx==num_records_ || iter->first<=key))
+		{
+			if (idx<num_records_ && iter->first==key)
+				idx++; //The update replaces the old record
+			key=iter->first;
+			state=iter->second;
+			++iter;
+		} else
+		{
+			read_at(idx, &state);
+			idx++;
+		}
+		offsets.push_back(records.size());
+		put_record(records, key, state);
+	}
+
+	uint64_t num=offsets.size();
+	uint64_t base=MAGIC_LEN+8+num*8;
+	for(auto f=offsets.begin();f!=offsets.end();++f)
+		*f+=base;
+
+	bf::path tmp_path=path_.string()+".tmp";
+	{
+		handle_t fl(open(tmp_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600)
+					| libc_die2("Can't create "+tmp_path.string()));
+		std::string hdr(STATE_DB_MAGIC, MAGIC_LEN);
+		hdr.append(reinterpret_cast<const char*>(&num), 8);
+		if (num)
+			hdr.append(reinterpret_cast<const char*>(&offsets[0]), num*8);
+		const std::string *parts[]={&hdr, &records};
+		for(int f=0;f<2;++f)
+		{
+			size_t done=0;
+			while(done<parts[f]->size())
+				done+=write(fl.get(), parts[f]->data()+done,
+							parts[f]->size()-done) | libc_die;
+		}
+		fsync(fl.get());
+	}
+
+	close_map();
+	rename(tmp_path.c_str(), path_.c_str())
+			| libc_die2("Can't replace "+path_.string());
+	updates_.clear();
+	open_map();
+	VLOG(2) << "Saved " << num << " sync states to " << path_;
+}
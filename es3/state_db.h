@@ -0,0 +1,79 @@
+#ifndef STATE_DB_H
+#define STATE_DB_H
+
+#include "common.h"
+
+namespace es3 {
+	struct s3_path;
+
+	/**
+	  The state of a file pair after its last successful sync.
+	  */
+	struct sync_state
+	{
+		time_t mtime_;
+		uint64_t size_, remote_size_;
+		std::string etag_;
+
+		sync_state() : mtime_(), size_(), remote_size_() {}
+	};
+
+	/**
+	  Persistent index of synced files, keyed by the local and remote
+	  paths. The database written by the previous run is memory-mapped
+	  and searched in place, new records are kept in memory until
+	  save() merges them into a fresh file. That also happens every
+	  few minutes during a run.
+	  */
+	class sync_state_db
+	{
+		const bf::path path_;
+
+		mutable mutex_t m_; //This mutex protects the following data {
+		int fd_;
+		const char *map_;
+		size_t map_size_, num_records_;
+		const uint64_t *offsets_;
+		std::map<std::string, sync_state> updates_;
+		//Built on the first lookup by ETag
+		mutable bool etags_indexed_;
+		mutable std::map<std::string, sync_state> by_etag_;
+		time_t last_save_;
+		//}
+	public:
+		sync_state_db(const bf::path &path);
+		~sync_state_db();
+
+		bool find(const bf::path &local, const s3_path &remote,
+				  sync_state *res) const;
+		/**
+		  Finds any record of an object with this ETag. The raw size and
+		  mtime of an object are known from it even if the object was
+		  synced under a different name.
+		  */
+		bool find_by_etag(const std::string &etag, sync_state *res) const;
+		void record(const bf::path &local, const s3_path &remote,
+					const sync_state &state);
+		void save();
+
+	private:
+		sync_state_db(const sync_state_db &);
+		void open_map();
+		void close_map();
+		bool check_records() const;
+		void save_locked();
+		bool find_mapped(const std::string &key, sync_state *res) const;
+		std::string key_at(size_t idx) const;
+		void read_at(size_t idx, sync_state *res) const;
+	};
+	typedef boost::shared_ptr<sync_state_db> sync_state_db_ptr;
+
+	//ETags are compared without the surrounding quotes
+	std::string normalize_etag(const std::string &etag);
+	//Identifies a pair of a local file and its object, both in the sync
+	//state database and in the upload journal
+	std::string sync_key(const bf::path &local, const s3_path &remote);
+
+}; //namespace es3
+
+#endif //STATE_DB_H
@@ -3,9 +3,16 @@
 #include "downloader.h"
 #include "context.h"
 #include "errors.h"
+#include "state_db.h"
+#include "scope_guard.h"
 #include <set>
 #include <iostream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include "pattern_match.hpp"
 
@@ -15,68 +22,199 @@ namespace es3
 {
 	struct local_file
 	{
-		bf::path absolute_name_;
-		std::string name_;
 		bool unsyncable_;
+		local_stat stat_;
 	};
+	typedef file_table<local_file> local_file_table;
 
-	struct local_dir
+	/**
+	  A directory of a local scan, see dir_tree. Each directory is
+	  scanned by a single task, so it needs no locking.
+	  */
+	struct local_dir : public dir_node<local_dir, bf::path>
 	{
-		bf::path absolute_name_;
-		std::string name_;
+		local_file_table files_; //Sealed once the directory is scanned
 
-		std::map<std::string, local_file_ptr> files_;
-		std::map<std::string, local_dir_ptr> subdirs_;
+		static bf::path join(const bf::path &parent, const std::string &name)
+		{
+			return parent / name;
+		}
+		bf::path file_path(size_t idx) const
+		{
+			return path() / files_.name(idx);
+		}
 	};
+	typedef dir_tree<local_dir, bf::path> local_dir_tree;
 }; //namespace es3
 
-static void check_entry(local_dir_ptr parent,
-				   const bf::directory_entry &dent, synchronizer *sync)
+//Directory entries are read in chunks of this size
+#define SCAN_BUFFER_SIZE (64*1024)
+
+//The record returned by getdents64
+struct linux_dirent64_t
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+};
+
+static void scan_local_dir(local_dir_ptr dir, agenda_ptr agenda);
+
+/**
+  Scans a local directory on the IO pool, see scan_local_dir().
+  */
+class local_scan_task : public sync_task
+{
+	local_dir_ptr dir_;
+public:
+	local_scan_task(local_dir_ptr dir) : dir_(dir) {}
+
+	virtual void print_to(std::ostream &str)
+	{
+		str << "Scan " << dir_->path();
+	}
+	virtual task_type_e get_class() const { return taskIOBound; }
+	virtual void operator()(agenda_ptr agenda)
+	{
+		scan_local_dir(dir_, agenda);
+	}
+};
+
+static void add_entry(local_dir_ptr parent, const std::string &name,
+					  const struct stat &st, agenda_ptr agenda)
 {
-	if (dent.path().string().find(" ")!=std::string::npos)
+	if (S_ISDIR(st.st_mode))
+	{
+		local_dir_ptr target=parent->add_subdir(name);
+		//Without an agenda it'll be scanned later
+		if (target && agenda)
+			agenda->schedule(sync_task_ptr(new local_scan_task(target)));
 		return;
+	}
 
-	if (dent.status().type()==bf::directory_file &&
-			dent.symlink_status().type()!=bf::symlink_file)
+	local_file file;
+	file.unsyncable_ = true;
+	if (S_ISREG(st.st_mode))
 	{
-		//Recurse into subdir
-		local_dir_ptr target(new local_dir());
-		target->absolute_name_ = bf::absolute(dent.path());
-		target->name_ = dent.path().filename().string();
-		parent->subdirs_[target->name_]=target;
+		file.unsyncable_ = false;
+		file.stat_.size_ = st.st_size;
+		file.stat_.mtime_ = st.st_mtime;
+		file.stat_.mode_ = st.st_mode;
+	} else if (S_ISLNK(st.st_mode))
+		VLOG(2) << "Symlink skipped "<< parent->path() / name;
+	else
+		VLOG(1) << "Unknown local file type "<< parent->path() / name;
+	parent->files_.add(name, file);
+}
 
-		for(bf::directory_iterator iter=bf::directory_iterator(dent.path());
-			iter!=bf::directory_iterator(); ++iter)
-		{
-			check_entry(target, *iter, sync);
-		}
-	} else
+/**
+  Reads the entries of an unscanned directory. The names are read with
+  getdents64 and stat-ed relative to the directory descriptor, so that
+  no full paths are resolved. If an agenda is given then the
+  subdirectories are scanned by their own tasks, otherwise they are
+  left unscanned.
+  */
+static void scan_local_dir(local_dir_ptr dir, agenda_ptr agenda)
+{
+	//Paths with spaces are never synced
+	bf::path dir_path=dir->path();
+	if (dir_path.string().find(" ")!=std::string::npos)
 	{
-		local_file_ptr file(new local_file());
-		file->absolute_name_=bf::absolute(dent.path());
-		file->name_ = file->absolute_name_.filename().string();
-		parent->files_[file->name_] = file;
+		dir->files_.seal();
+		return;
+	}
 
-		if (dent.status().type()==bf::regular_file &&
-				dent.symlink_status().type()!=bf::symlink_file)
-		{
-			file->unsyncable_ = false;
-		} else if (dent.symlink_status().type()==bf::symlink_file)
-		{
-			file->unsyncable_ = true;
-			VLOG(2) << "Symlink skipped "<< dent.path();
-		} else
+	//A directory that can't be read is left sealed, though incomplete.
+	//The error fails the scan, so it's never compared with the remote.
+	ON_BLOCK_EXIT_OBJ(dir->files_, &local_file_table::seal);
+
+	handle_t dfd(open(dir_path.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC)
+				 | libc_die2("Can't open "+dir_path.string()));
+	std::vector<char> buf(SCAN_BUFFER_SIZE);
+	while(true)
+	{
+		long len=syscall(SYS_getdents64, dfd.get(), &buf[0], buf.size())
+				| libc_die2("Can't read "+dir_path.string());
+		if (len==0)
+			break;
+
+		for(long pos=0;pos<len;)
 		{
-			file->unsyncable_ = true;
-			VLOG(1) << "Unknown local file type "<< dent.path();
+			const linux_dirent64_t *dent=
+					reinterpret_cast<const linux_dirent64_t*>(&buf[pos]);
+			pos+=dent->d_reclen;
+			const char *name=dent->d_name;
+			if (!strcmp(name, ".") || !strcmp(name, "..") || strchr(name, ' '))
+				continue;
+
+			struct stat st={0};
+			if (dent->d_type==DT_DIR)
+				st.st_mode=S_IFDIR; //No need to stat directories
+			else if (dent->d_type==DT_LNK)
+				st.st_mode=S_IFLNK;
+			else if (fstatat(dfd.get(), name, &st, AT_SYMLINK_NOFOLLOW))
+			{
+				if (errno==ENOENT)
+					continue; //Deleted while we're scanning
+				-1 | libc_die2("Can't stat "+(dir_path/name).string());
+			}
+			add_entry(dir, name, st, agenda);
 		}
 	}
 }
 
+enum compare_result_e
+{
+	cmpUnchanged,
+	cmpChanged,
+	cmpUnknown, //Transfer tasks have to HEAD the object to find out
+};
+
+/**
+  Compares a local file with its listing entry without HEAD requests.
+  A sync state record of the pair tells if neither side has changed
+  since the last sync. In the fast-compare mode the raw size and mtime
+  of a (possibly compressed) object are also looked up by its ETag.
+  */
+static compare_result_e compare_with_listing(const context_ptr &ctx,
+	const bf::path &local, const local_stat &st, const s3_path &remote,
+	const s3_file *remote_file, const std::string &remote_etag)
+{
+	if (!remote_file || !st.mtime_)
+		return cmpChanged; //One of the sides is missing
+	if (!ctx->state_db_)
+		return cmpUnknown;
+
+	sync_state state;
+	bool found=ctx->state_db_->find(local, remote, &state) &&
+			remote_etag==state.etag_;
+	if (!found && ctx->fast_compare_ &&
+			ctx->state_db_->find_by_etag(remote_etag, &state))
+	{
+		//The record might be of another file with the same content, it
+		//only tells something if it's also the same as the local file
+		found=st.mtime_==state.mtime_ && st.size_==state.size_;
+		if (found)
+			ctx->state_db_->record(local, remote, state);
+	}
+	if (!found || remote_file->size_!=state.remote_size_)
+		return cmpUnknown;
+
+	if (st.mtime_==state.mtime_ && st.size_==state.size_)
+		return cmpUnchanged;
+	return cmpChanged;
+}
+
+/**
+  Prepares the root of a local tree. With an agenda the whole tree is
+  scanned by the IO tasks, otherwise only the root level is read.
+  */
 static local_dir_ptr build_local_dir(const std::string &start_path,
-									 synchronizer *sync, bool upload)
+									 bool upload, agenda_ptr agenda)
 {
-	local_dir_ptr res(new local_dir());
+	local_dir_ptr res;
 	bf::path start(bf::absolute(start_path));
 	if (start.filename()==".")
 		start=start.parent_path();
@@ -84,83 +222,87 @@ static local_dir_ptr build_local_dir(const std::string &start_path,
 	if (*start_path.rbegin() != '/' && upload)
 	{
 		//A tricky bit - we're actually synchronizing path/../path, not path/*
-		res->absolute_name_ = start.parent_path();
-		res->name_ = res->absolute_name_.filename().string();
-		check_entry(res, bf::directory_entry(start, bf::status(start)),
-					sync);
+		bf::path parent=start.parent_path();
+		res=local_dir_tree::make_root(parent, parent.filename().string());
+		std::string name=start.filename().string();
+		struct stat st={0};
+		lstat(start.c_str(), &st) | libc_die2("Can't stat "+start.string());
+		if (name.find(" ")==std::string::npos)
+			add_entry(res, name, st, agenda);
+		res->files_.seal();
 	} else
 	{
-		res->absolute_name_ = start;
-		res->name_ = res->absolute_name_.filename().string();
-		for(bf::directory_iterator iter=bf::directory_iterator(start);
-			iter!=bf::directory_iterator(); ++iter)
-		{
-			check_entry(res, *iter, sync);
-		}
+		res=local_dir_tree::make_root(start, start.filename().string());
+		scan_local_dir(res, agenda);
 	}
 
 	return res;
 }
 
-template<class dir_ptr_t, class file_ptr_t>
+template<class dir_ptr_t>
 	static void merge_to_left(dir_ptr_t left, dir_ptr_t right)
 {
 	//Merge files
-	for(auto iter=right->files_.begin(), iend=right->files_.end();
-		iter!=iend; ++iter)
+	for(size_t f=0;f<right->files_.size();++f)
 	{
-		file_ptr_t right_file = iter->second;
-		if (left->files_.count(right_file->name_))
+		std::string name=right->files_.name(f);
+		size_t left_idx=left->files_.find(name);
+		if (left_idx!=left->files_.npos)
 		{
 			err(errFatal) << "File name collision: "
-						  << right_file->absolute_name_
+						  << right->file_path(f)
 						  << " collides with  "
-						  << left->files_[right_file->name_]->absolute_name_;
+						  << left->file_path(left_idx);
 		}
 
-		if (left->subdirs_.count(right_file->name_))
+		dir_ptr_t left_dir=left->find_subdir(name);
+		if (left_dir)
 		{
 			//Uh-oh.
 			err(errFatal) << "File "
-						  << right_file->absolute_name_
+						  << right->file_path(f)
 						  << " shadows directory "
-						  << left->subdirs_[right_file->name_]->absolute_name_;
+						  << left_dir->path();
 		}
-
-		left->files_[right_file->name_] = right_file;
 	}
+	for(size_t f=0;f<right->files_.size();++f)
+		left->files_.add(right->files_.name(f), right->files_.at(f),
+						 right->files_.extra(f));
+	left->files_.seal();
 
 	//Merge directories
-	for(auto iter=right->subdirs_.begin(), iend=right->subdirs_.end();
-		iter!=iend; ++iter)
+	for(size_t f=0;f<right->num_subdirs();++f)
 	{
-		dir_ptr_t right_dir= iter->second;
+		dir_ptr_t right_dir=right->subdir(f);
+		std::string name=right_dir->name();
 
-		if (left->files_.count(right_dir->name_))
+		size_t left_idx=left->files_.find(name);
+		if (left_idx!=left->files_.npos)
 		{
 			//Uh-oh.
 			err(errFatal) << "Directory "
-						  << right_dir->absolute_name_
+						  << right_dir->path()
 						  << " is shadowed by "
-						  << left->files_[right_dir->name_]->absolute_name_;
+						  << left->file_path(left_idx);
 		}
 
-		if (left->subdirs_.count(right_dir->name_))
-		{
-			merge_to_left<dir_ptr_t, file_ptr_t>(
-						left->subdirs_[right_dir->name_], right_dir);
-		} else
-			left->subdirs_[right_dir->name_] = right_dir;
+		dir_ptr_t left_dir=left->find_subdir(name);
+		if (left_dir)
+			merge_to_left(left_dir, right_dir);
+		else
+			left->adopt_subdir(right_dir);
 	}
 }
 
 synchronizer::synchronizer(agenda_ptr agenda, const context_ptr &ctx,
 						   std::vector<s3_path> remote,stringvec local,
 						   bool do_upload, bool delete_missing,
-						   const stringvec &included, const stringvec &excluded)
+						   const stringvec &included, const stringvec &excluded,
+						   bool streaming)
 	: agenda_(agenda), ctx_(ctx), remote_(remote), local_(local),
 	  do_upload_(do_upload), delete_missing_(delete_missing),
-	  included_(included), excluded_(excluded)
+	  included_(included), excluded_(excluded), streaming_(streaming),
+	  dirs_in_flight_(0)
 {
 }
 
@@ -186,18 +328,72 @@ static bool check_included(const std::string &name,
 	return true;
 }
 
+//Digits of the key space used to pick split points, keeping them in
+//printable ASCII so that they are valid markers
+#define SPLIT_FIRST_CHAR 0x20
+#define SPLIT_BASE 96
+#define SPLIT_DIGITS 4
+
+/**
+  Picks a key roughly in the middle between two keys. Returns an empty
+  string if they are too close to be split.
+  */
+static std::string split_point(const std::string &lo, const std::string &hi)
+{
+	size_t common=0;
+	while(common<lo.size() && common<hi.size() && lo[common]==hi[common])
+		common++;
+
+	uint64_t a=0, b=0;
+	for(size_t f=common;f<common+SPLIT_DIGITS;++f)
+	{
+		int lc=f<lo.size() ? (unsigned char)lo[f] : SPLIT_FIRST_CHAR;
+		int hc=f<hi.size() ? (unsigned char)hi[f] : SPLIT_FIRST_CHAR;
+		a=a*SPLIT_BASE+std::min(std::max(lc-SPLIT_FIRST_CHAR, 0),
+								SPLIT_BASE-1);
+		b=b*SPLIT_BASE+std::min(std::max(hc-SPLIT_FIRST_CHAR, 0),
+								SPLIT_BASE-1);
+	}
+	if (b<=a+1)
+		return "";
+
+	uint64_t mid=a+(b-a)/2;
+	std::string res(SPLIT_DIGITS, ' ');
+	for(int f=SPLIT_DIGITS-1;f>=0;--f)
+	{
+		res[f]=char(SPLIT_FIRST_CHAR+mid%SPLIT_BASE);
+		mid/=SPLIT_BASE;
+	}
+	res=hi.substr(0, common)+res.substr(0, res.find_last_not_of(' ')+1);
+	if (res<=lo || res>=hi)
+		return "";
+	return res;
+}
+
+/**
+  Lists the keys of a directory after the marker and up to 'last'
+  inclusive (no limit if it's empty). While the pages come back full
+  the upper half of the remaining range is handed over to a new task,
+  so a large flat directory is listed by many concurrent streams.
+  */
 class list_subdir_task : public sync_task,
 		public boost::enable_shared_from_this<list_subdir_task>
 {
+	s3_path path_;
 	s3_directory_ptr dir_;
 	context_ptr ctx_;
+	std::string marker_, last_;
 public:
-	list_subdir_task(s3_directory_ptr dir, context_ptr ctx) :
-		dir_(dir), ctx_(ctx) {}
+	list_subdir_task(const s3_path &path, s3_directory_ptr dir,
+					 context_ptr ctx, const std::string &marker="",
+					 const std::string &last="") :
+		path_(path), dir_(dir), ctx_(ctx), marker_(marker), last_(last) {}
 
 	virtual void print_to(std::ostream &str)
 	{
-		str << "Read dir " << dir_;
+		str << "Read dir " << path_;
+		if (!marker_.empty())
+			str << " after " << marker_;
 	}
 
 	virtual task_type_e get_class() const { return taskUnbound; }
@@ -205,13 +401,140 @@ public:
 	virtual void operator()(agenda_ptr agenda)
 	{
 		s3_connection conn(ctx_);
-		conn.list_files_shallow(dir_->absolute_name_, dir_, false);
+		std::string marker=marker_;
+		while(true)
+		{
+			std::vector<s3_directory_ptr> new_dirs;
+			bool more=conn.list_page(path_, dir_, marker, last_,
+									 &marker, &new_dirs);
+			for(auto iter=new_dirs.begin();iter!=new_dirs.end();++iter)
+				agenda->schedule(sync_task_ptr(new list_subdir_task(
+					(*iter)->path(), *iter, ctx_)));
+			if (!more)
+				break; //The page had names past last_, or it's the end
+
+			//Keys are listed in UTF-8 binary order, unbounded ranges are
+			//split as if they ended with the last ASCII character
+			std::string hi=last_;
+			if (hi.empty())
+				hi=path_.path_.substr(1)+"\x7f";
+			std::string mid=split_point(marker, hi);
+			if (!mid.empty())
+			{
+				agenda->schedule(sync_task_ptr(new list_subdir_task(
+					path_, dir_, ctx_, mid, last_)));
+				last_=mid;
+			}
+		}
+	}
+};
+
+/**
+  Creates the directory for the listing and schedules the tasks that
+  fill it in recursively.
+  */
+static s3_directory_ptr schedule_listing(const s3_path &remote,
+	context_ptr ctx, agenda_ptr ag, bool try_to_root)
+{
+	s3_directory_ptr root=s3_connection::make_listing_target(remote,
+															 try_to_root);
+	ag->schedule(sync_task_ptr(new list_subdir_task(remote, root, ctx)));
+	return root;
+}
+
+/**
+  Compares a pair of directories in the streaming mode. Both sides are
+  read shallowly and the transfers are scheduled right away, while the
+  pairs of subdirectories become tasks of their own. Only the
+  directories that are in flight are kept in memory.
+  */
+class es3::sync_dir_task : public sync_task
+{
+public:
+	enum mode_e
+	{
+		modeUpload,
+		modeDownload,
+		modeDelete,
+	};
+private:
+	synchronizer *sync_;
+	const mode_e mode_;
+	local_dir_ptr locals_;
+	s3_directory_ptr remotes_;
+	const s3_path remote_path_;
+	const bf::path local_path_;
+	const bool check_mode_;
+	bool scheduled_; //The transfers have been scheduled, maybe partially
+public:
+	sync_dir_task(synchronizer *sync, mode_e mode, local_dir_ptr locals,
+				  s3_directory_ptr remotes, const s3_path &remote_path,
+				  const bf::path &local_path, bool check_mode)
+		: sync_(sync), mode_(mode), locals_(locals), remotes_(remotes),
+		  remote_path_(remote_path), local_path_(local_path),
+		  check_mode_(check_mode), scheduled_()
+	{
+	}
 
-		for(auto iter=dir_->subdirs_.begin();
-			iter!=dir_->subdirs_.end();++iter)
+	virtual void print_to(std::ostream &str)
+	{
+		if (mode_==modeDelete)
+			str << "Delete dir " << remote_path_;
+		else
+			str << "Sync dir " << local_path_ << " with " << remote_path_;
+	}
+
+	virtual task_type_e get_class() const { return taskUnbound; }
+
+	virtual void operator()(agenda_ptr agenda)
+	{
+		//A retry would schedule the same transfers and subdirectories
+		//again, so only the listing and the scan are retried
+		if (scheduled_)
+			err(errFatal) << "Failed to schedule the sync of "
+						  << remote_path_;
+
+		release_tables(); //Left from a failed attempt
+		if (remotes_)
 		{
-			agenda->schedule(sync_task_ptr(
-								  new list_subdir_task(iter->second, ctx_)));
+			s3_connection conn(sync_->ctx_);
+			conn.list_files_shallow(remotes_->path(), remotes_, false);
+		}
+		if (locals_)
+			scan_local_dir(locals_, agenda_ptr());
+
+		scheduled_=true;
+		ON_BLOCK_EXIT_OBJ(*sync_, &synchronizer::finish_dir);
+		//The subdirectories belong to their own tasks now
+		ON_BLOCK_EXIT_OBJ(*this, &sync_dir_task::release_tables);
+		switch(mode_)
+		{
+		case modeUpload:
+			sync_->process_upload(locals_, remotes_, remote_path_,
+								  check_mode_);
+			break;
+		case modeDownload:
+			sync_->process_downloads(remotes_, locals_, local_path_,
+									 check_mode_);
+			break;
+		case modeDelete:
+			sync_->delete_possibly_recursive(remotes_, false);
+			break;
+		}
+	}
+
+private:
+	void release_tables()
+	{
+		if (locals_)
+		{
+			locals_->files_=local_file_table();
+			locals_->clear_subdirs();
+		}
+		if (remotes_)
+		{
+			remotes_->files_=s3_file_table();
+			remotes_->clear_subdirs();
 		}
 	}
 };
@@ -219,43 +542,61 @@ public:
 bool synchronizer::create_schedule(bool check_mode, bool delete_mode, 
 								   bool non_recursive_delete)
 {
-	//Retrieve the list of remote files
-	s3_connection conn(ctx_);
+	//Merging several sources needs their complete trees
+	if (streaming_ && (remote_.size()!=1 || local_.size()>1))
+	{
+		VLOG(1)<<"Streaming sync needs a single source, "
+			   <<"preparing the complete file lists instead.";
+		streaming_=false;
+	}
 
-	local_dir_ptr locals;
+	//Local trees are scanned by the IO tasks along with the listing
+	std::vector<local_dir_ptr> local_lists;
 	for(auto iter=local_.begin();iter!=local_.end();++iter)
 	{
 		assert(!delete_mode);
-		local_dir_ptr cur(build_local_dir(*iter, this, do_upload_));
-		if (locals)
-			merge_to_left<local_dir_ptr, local_file_ptr>(locals, cur);
-		else
-			locals=cur;
+		local_lists.push_back(build_local_dir(*iter, do_upload_,
+			streaming_ ? agenda_ptr() : agenda_));
 	}
 
-	VLOG(1)<<"Preparing S3 file list.";
 	std::vector<s3_directory_ptr> remote_lists;
-	for(auto iter=remote_.begin();iter!=remote_.end();++iter)
+	if (streaming_)
 	{
-		s3_directory_ptr cur_root=conn.list_files_shallow(
-				*iter, s3_directory_ptr(), !do_upload_ || delete_mode);
+		//Only the roots are listed here, the rest is listed on the go
+		s3_connection conn(ctx_);
+		remote_lists.push_back(conn.list_files_shallow(remote_.front(),
+			s3_directory_ptr(), !do_upload_ || delete_mode));
+	} else
+	{
+		VLOG(1)<<"Preparing S3 file list.";
+		for(auto iter=remote_.begin();iter!=remote_.end();++iter)
+			remote_lists.push_back(schedule_listing(*iter, ctx_, agenda_,
+				!do_upload_ || delete_mode));
+		//An incomplete tree would look like deleted files
+		if (agenda_->run()!=0)
+			err(errFatal) << "Failed to scan the local files or to list "
+						  << "the remote ones";
+		for(auto iter=remote_lists.begin();iter!=remote_lists.end();++iter)
+			seal_listing(*iter);
+		VLOG(1)<<"Preparing file list - done.";
+	}
 
-		for(auto iter=cur_root->subdirs_.begin();
-			iter!=cur_root->subdirs_.end();++iter)
-		{
-			agenda_->schedule(sync_task_ptr(
-								  new list_subdir_task(iter->second, ctx_)));
-		}
-		remote_lists.push_back(cur_root);
+	local_dir_ptr locals;
+	for(auto iter=local_lists.begin();iter!=local_lists.end();++iter)
+	{
+		if (locals)
+			merge_to_left(locals, *iter);
+		else
+			locals=*iter;
 	}
-	agenda_->run();
-	VLOG(1)<<"Preparing file list - done.";
 
-	ctx_->reset(); //Reset CURLs	
+	//The roots are processed right here
+	dirs_in_flight_=1;
 	if (delete_mode)
 	{
 		for(auto iter=remote_lists.begin();iter!=remote_lists.end();++iter)
 			delete_possibly_recursive(*iter, non_recursive_delete);
+		finish_dir();
 		return true;
 	}
 	
@@ -263,182 +604,326 @@ bool synchronizer::create_schedule(bool check_mode, bool delete_mode,
 	for(auto iter=remote_lists.begin();iter!=remote_lists.end();++iter)
 	{
 		if (remotes)
-			merge_to_left<s3_directory_ptr,s3_file_ptr>(remotes, *iter);
+			merge_to_left(remotes, *iter);
 		else
 			remotes=*iter;
 	}
 
 	if (do_upload_)
 	{
-		process_upload(locals, remotes, remotes->absolute_name_, check_mode);
+		process_upload(locals, remotes, remotes->path(), check_mode);
+		finish_dir();
 		return true;
 	} else
 	{
-		process_downloads(remotes, locals, locals->absolute_name_, check_mode);
-		return !remotes->files_.empty() || !remotes->subdirs_.empty();
+		process_downloads(remotes, locals, locals->path(), check_mode);
+		finish_dir();
+		return !remotes->files_.empty() || remotes->num_subdirs()!=0;
 	}
 }
 
 void synchronizer::delete_possibly_recursive(s3_directory_ptr dir, 
 											 bool non_recursive)
 {
-	if (non_recursive && !dir->subdirs_.empty())
+	if (non_recursive && dir->num_subdirs()!=0)
 		err(errFatal) << "There are subdirectories present, but no --recursive flag is specified";
 
-	for(auto iter=dir->files_.begin();iter!=dir->files_.end();++iter)
+	s3_path dir_path=dir->path();
+	for(size_t f=0;f<dir->files_.size();++f)
 	{
-		if (!check_included(iter->second->absolute_name_.path_, 
-							included_, excluded_))
+		s3_path path=derive(dir_path, dir->files_.name(f));
+		if (!check_included(path.path_, included_, excluded_))
 			continue;		
-		sync_task_ptr task
-				(new remote_file_deleter(ctx_, iter->second->absolute_name_));
-		agenda_->schedule(task);
+		delete_remote_file(path);
 	}
-	for(auto iter=dir->subdirs_.begin();iter!=dir->subdirs_.end();++iter)
-		delete_possibly_recursive(iter->second, false);
+	for(size_t f=0;f<dir->num_subdirs();++f)
+		delete_remote_dir(dir->subdir(f));
 }
 
-void synchronizer::process_upload(local_dir_ptr locals,
+void synchronizer::delete_remote_file(const s3_path &path)
+{
+	std::vector<s3_path> batch;
+	{
+		guard_t lock(m_);
+		std::vector<s3_path> &pending=
+				pending_deletes_[path.zone_+"/"+path.bucket_];
+		pending.push_back(path);
+		if (pending.size()<MAX_DELETE_BATCH)
+			return;
+		batch.swap(pending);
+	}
+	agenda_->schedule(sync_task_ptr(new remote_batch_deleter(ctx_, batch)));
+}
+
+void synchronizer::finish_dir()
+{
+	if (--dirs_in_flight_)
+		return;
+
+	//That was the last directory, delete the rest of the keys
+	flush_deletes();
+}
+
+bool synchronizer::flush_deletes()
+{
+	bool res=false;
+	guard_t lock(m_);
+	for(auto iter=pending_deletes_.begin();iter!=pending_deletes_.end();++iter)
+		if (!iter->second.empty())
+		{
+			agenda_->schedule(sync_task_ptr(
+				new remote_batch_deleter(ctx_, iter->second)));
+			res=true;
+		}
+	pending_deletes_.clear();
+	return res;
+}
+
+void synchronizer::delete_remote_dir(s3_directory_ptr dir)
+{
+	if (streaming_)
+	{
+		dirs_in_flight_++;
+		agenda_->schedule(sync_task_ptr(new sync_dir_task(this,
+			sync_dir_task::modeDelete, local_dir_ptr(), dir,
+			dir->path(), bf::path(), false)));
+	} else
+		delete_possibly_recursive(dir, false);
+}
+
+void synchronizer::descend_upload(local_dir_ptr locals,
 								  s3_directory_ptr remotes,
 								  const s3_path &remote_path, bool check_mode)
 {
-	std::map<std::string, s3_file_ptr> unseen;
-	std::map<std::string, s3_directory_ptr> unseen_dirs;
-	if (remotes)
+	if (streaming_)
 	{
-		unseen.insert(remotes->files_.begin(), remotes->files_.end());
-		unseen_dirs.insert(remotes->subdirs_.begin(), remotes->subdirs_.end());
-	}
+		dirs_in_flight_++;
+		agenda_->schedule(sync_task_ptr(new sync_dir_task(this,
+			sync_dir_task::modeUpload, locals, remotes, remote_path,
+			locals->path(), check_mode)));
+	} else
+		process_upload(locals, remotes, remote_path, check_mode);
+}
 
-	for(auto iter=locals->files_.begin(); iter!=locals->files_.end();++iter)
+void synchronizer::descend_downloads(s3_directory_ptr remotes,
+									 local_dir_ptr locals,
+									 const bf::path &local_path,
+									 bool check_mode)
+{
+	if (streaming_)
 	{
-		local_file_ptr file = iter->second;
-		unseen.erase(file->name_);
-		unseen_dirs.erase(file->name_);
-		if (file->unsyncable_) //Skip bad files
+		dirs_in_flight_++;
+		agenda_->schedule(sync_task_ptr(new sync_dir_task(this,
+			sync_dir_task::modeDownload, locals, remotes,
+			remotes->path(), local_path, check_mode)));
+	} else
+		process_downloads(remotes, locals, local_path, check_mode);
+}
+
+void synchronizer::process_upload(local_dir_ptr locals,
+								  s3_directory_ptr remotes,
+								  const s3_path &remote_path, bool check_mode)
+{
+	std::vector<bool> seen_files(remotes ? remotes->files_.size() : 0);
+	std::vector<bool> seen_dirs(remotes ? remotes->num_subdirs() : 0);
+	std::vector<small_file> small_files;
+	bf::path local_path=locals->path();
+
+	for(size_t f=0; f<locals->files_.size();++f)
+	{
+		const local_file &file = locals->files_.at(f);
+		std::string name = locals->files_.name(f);
+		bf::path file_path = local_path / name;
+		size_t remote_idx = remotes ?
+					remotes->files_.find(name) : s3_file_table::npos;
+		if (remote_idx!=s3_file_table::npos)
+			seen_files[remote_idx]=true;
+		size_t dir_idx = remotes ?
+					remotes->subdir_index(name) : s3_directory::npos;
+		if (dir_idx!=s3_directory::npos)
+			seen_dirs[dir_idx]=true;
+		if (file.unsyncable_) //Skip bad files
 			continue;
-		if (!check_included(file->absolute_name_.string(), included_, excluded_))
+		if (!check_included(file_path.string(), included_, excluded_))
 			continue;
 
-		s3_path cur_remote_path = derive(remote_path, file->name_);
-		if (remotes && remotes->subdirs_.count(file->name_))
+		s3_path cur_remote_path = derive(remote_path, name);
+		if (dir_idx!=s3_directory::npos)
 		{
 			if (delete_missing_)
 			{
-				delete_possibly_recursive(remotes->subdirs_[file->name_], false);
+				delete_remote_dir(remotes->subdir(dir_idx));
 				sync_task_ptr task(new file_uploader(
-					ctx_, file->absolute_name_, cur_remote_path));
+					ctx_, file_path, cur_remote_path, false, file.stat_));
 				agenda_->schedule(task);
 			} else
 			{
-				VLOG(0) << "Local file "<< file->absolute_name_ << " "
+				VLOG(0) << "Local file "<< file_path << " "
 						<< "shadows directory on the remote side, but we're "
 						<< "not allowed to remove it.";
 			}
 		} else
 		{
-			if (!check_mode || !remotes->files_.count(file->name_))
+			const s3_file *remote_file=0;
+			std::string remote_etag;
+			if (remote_idx!=s3_file_table::npos)
+			{
+				remote_file=&remotes->files_.at(remote_idx);
+				remote_etag=remotes->files_.extra(remote_idx);
+			}
+			compare_result_e cmp=compare_with_listing(ctx_,
+				file_path, file.stat_, cur_remote_path, remote_file,
+				remote_etag);
+			if (cmp==cmpUnchanged)
+				continue;
+			if (check_mode && remote_file)
+				continue;
+			bool known_changed=ctx_->fast_compare_ && cmp==cmpChanged;
+			if (ctx_->engine_ && file.stat_.mtime_ &&
+					file.stat_.size_<=SMALL_FILE_SIZE)
+			{
+				//Tiny files are uploaded together, their requests are
+				//multiplexed by the transfer engine. Without it a task
+				//per file keeps more of them in flight.
+				small_file small={file_path, cur_remote_path,
+								  known_changed, file.stat_};
+				small_files.push_back(small);
+				if (small_files.size()>=SMALL_BATCH_FILES)
+				{
+					agenda_->schedule(sync_task_ptr(
+						new small_files_uploader(ctx_, small_files)));
+					small_files.clear();
+				}
+			} else
 			{
 				sync_task_ptr task(new file_uploader(
-					ctx_, file->absolute_name_, cur_remote_path));
+					ctx_, file_path, cur_remote_path, known_changed,
+					file.stat_));
 				agenda_->schedule(task);
 			}
 		}
 	}
+	if (!small_files.empty())
+		agenda_->schedule(sync_task_ptr(
+			new small_files_uploader(ctx_, small_files)));
 
-	for(auto iter=locals->subdirs_.begin(); iter!=locals->subdirs_.end();++iter)
+	for(size_t d=0; d<locals->num_subdirs();++d)
 	{
-		local_dir_ptr dir = iter->second;
-		unseen.erase(dir->name_);
-		unseen_dirs.erase(dir->name_);
-		s3_path cur_remote_path = derive(remote_path, dir->name_);
+		local_dir_ptr dir = locals->subdir(d);
+		std::string name = dir->name();
+		size_t dir_idx = remotes ?
+					remotes->subdir_index(name) : s3_directory::npos;
+		if (dir_idx!=s3_directory::npos)
+			seen_dirs[dir_idx]=true;
+		s3_path cur_remote_path = derive(remote_path, name);
 
-		if (remotes && remotes->files_.count(dir->name_))
+		size_t remote_idx = remotes ?
+					remotes->files_.find(name) : s3_file_table::npos;
+		if (remote_idx!=s3_file_table::npos)
 		{
+			seen_files[remote_idx]=true;
 			if (delete_missing_)
 			{
-				sync_task_ptr task(new remote_file_deleter(ctx_,
-					remotes->files_[dir->name_]->absolute_name_));
-				agenda_->schedule(task);
-				process_upload(dir, s3_directory_ptr(), cur_remote_path, check_mode);
+				delete_remote_file(remotes->file_path(remote_idx));
+				descend_upload(dir, s3_directory_ptr(), cur_remote_path, check_mode);
 			} else
 			{
-				VLOG(0) << "Local dir "<< dir->absolute_name_ << " "
+				VLOG(0) << "Local dir "<< local_path / name << " "
 						<< "is shadowed by file on the remote side, but we're "
 						<< "not allowed to remove it.";
 			}
 		} else
 		{
-			process_upload(dir, remotes?try_get(remotes->subdirs_, dir->name_):
-					s3_directory_ptr(), cur_remote_path, check_mode);
+			descend_upload(dir, dir_idx!=s3_directory::npos ?
+					remotes->subdir(dir_idx) : s3_directory_ptr(),
+					cur_remote_path, check_mode);
 		}
 	}
 
 	if (delete_missing_)
 	{
-		for(auto iter=unseen.begin();iter!=unseen.end();++iter)
+		for(size_t f=0;f<seen_files.size();++f)
 		{
-			sync_task_ptr task(new remote_file_deleter(ctx_,
-				iter->second->absolute_name_));
-			agenda_->schedule(task);
+			if (seen_files[f])
+				continue;
+			delete_remote_file(remotes->file_path(f));
 		}
-		for(auto iter=unseen_dirs.begin();iter!=unseen_dirs.end();++iter)
-			delete_possibly_recursive(iter->second, false);
+		for(size_t d=0;d<seen_dirs.size();++d)
+			if (!seen_dirs[d])
+				delete_remote_dir(remotes->subdir(d));
 	}
 }
 
 void synchronizer::process_downloads(s3_directory_ptr remotes,
 	local_dir_ptr locals, const bf::path &local_path, bool check_mode)
 {
-	std::map<std::string, bf::path> unseen;
-	if (locals)
-	{
-		for(auto f=locals->files_.begin();f!=locals->files_.end();++f)
-			unseen[f->first]=f->second->absolute_name_;
-		for(auto f=locals->subdirs_.begin();f!=locals->subdirs_.end();++f)
-			unseen[f->first]=f->second->absolute_name_;
-	}
+	std::vector<bool> seen_files(locals ? locals->files_.size() : 0);
+	std::vector<bool> seen_dirs(locals ? locals->num_subdirs() : 0);
+	s3_path dir_path=remotes->path();
 
-	for(auto iter=remotes->files_.begin(); iter!=remotes->files_.end();++iter)
+	for(size_t f=0; f<remotes->files_.size();++f)
 	{
-		s3_file_ptr file = iter->second;
-		unseen.erase(file->name_);
-		if (!check_included(file->absolute_name_.path_, included_, excluded_))
+		std::string name = remotes->files_.name(f);
+		s3_path remote_path = derive(dir_path, name);
+		size_t local_idx = locals ?
+					locals->files_.find(name) : local_file_table::npos;
+		if (local_idx!=local_file_table::npos)
+			seen_files[local_idx]=true;
+		size_t dir_idx = locals ?
+					locals->subdir_index(name) : local_dir::npos;
+		if (dir_idx!=local_dir::npos)
+			seen_dirs[dir_idx]=true;
+		if (!check_included(remote_path.path_, included_, excluded_))
 			continue;
 
-		bf::path cur_local_path = local_path / file->name_;
-		bool shadowed=locals && locals->subdirs_.count(file->name_);
+		bf::path cur_local_path = local_path / name;
+		bool shadowed=dir_idx!=local_dir::npos;
 		if (shadowed && !delete_missing_)
 		{
-			VLOG(0) << "Remote file "<< file->absolute_name_ << " "
+			VLOG(0) << "Remote file "<< remote_path << " "
 					<< "is shadowed by a local directory, "
 					<< "but we're not allowed to remove it.";
 		} else
 		{
-			if (!check_mode || !locals->files_.count(file->name_))
+			local_stat st;
+			if (local_idx!=local_file_table::npos)
+				st=locals->files_.at(local_idx).stat_;
+			if (!shadowed && compare_with_listing(ctx_, cur_local_path, st,
+					remote_path, &remotes->files_.at(f),
+					remotes->files_.extra(f))==cmpUnchanged)
+				continue;
+			if (!check_mode || local_idx==local_file_table::npos)
 			{
 				sync_task_ptr task(new file_downloader(
-					ctx_, cur_local_path, file->absolute_name_, shadowed));
+					ctx_, cur_local_path, remote_path, shadowed));
 				agenda_->schedule(task);
 			}
 		}
 	}
 
-	for(auto iter=remotes->subdirs_.begin(); iter!=remotes->subdirs_.end();++iter)
+	for(size_t d=0; d<remotes->num_subdirs();++d)
 	{
-		s3_directory_ptr dir = iter->second;
-		unseen.erase(dir->name_);
-
-		bf::path cur_local_path = local_path / dir->name_;
+		s3_directory_ptr dir = remotes->subdir(d);
+		std::string name = dir->name();
+		bf::path cur_local_path = local_path / name;
 
 		local_dir_ptr new_dir;
-		if (locals)
-			new_dir=try_get(locals->subdirs_, dir->name_);
+		size_t dir_idx = locals ?
+					locals->subdir_index(name) : local_dir::npos;
+		if (dir_idx!=local_dir::npos)
+		{
+			seen_dirs[dir_idx]=true;
+			new_dir=locals->subdir(dir_idx);
+		}
 
-		bool shadowed=locals && locals->files_.count(dir->name_) ;
+		size_t local_idx = locals ?
+					locals->files_.find(name) : local_file_table::npos;
+		bool shadowed=local_idx!=local_file_table::npos;
+		if (shadowed)
+			seen_files[local_idx]=true;
 		if (shadowed && !delete_missing_)
 		{
-			VLOG(0) << "Remote dir "<< dir->absolute_name_ << " "
+			VLOG(0) << "Remote dir "<< derive(dir_path, name+"/") << " "
 					<< "is shadowed by a local file, but we're "
 					<< "not allowed to remove it.";
 		} else
@@ -452,61 +937,57 @@ void synchronizer::process_downloads(s3_directory_ptr remotes,
 				if (res && errno!=EEXIST)
 					res | libc_die2("Failed to create "+cur_local_path.string());
 			}
-			process_downloads(dir, new_dir, cur_local_path, check_mode);
+			descend_downloads(dir, new_dir, cur_local_path, check_mode);
 		}
 	}
 
 	if (delete_missing_)
 	{
-		for(auto iter=unseen.begin();iter!=unseen.end();++iter)
-			agenda_->schedule(sync_task_ptr(
-								  new local_file_deleter(iter->second)));
+		for(size_t f=0;f<seen_files.size();++f)
+			if (!seen_files[f])
+				agenda_->schedule(sync_task_ptr(
+					new local_file_deleter(locals->file_path(f))));
+		for(size_t d=0;d<seen_dirs.size();++d)
+			if (!seen_dirs[d])
+				agenda_->schedule(sync_task_ptr(
+					new local_file_deleter(locals->subdir(d)->path())));
 	}
 }
 
 s3_directory_ptr es3::schedule_recursive_walk(const s3_path &remote,
 											  context_ptr ctx, agenda_ptr ag)
 {
-	s3_connection conn(ctx);
-	s3_directory_ptr cur_root=conn.list_files_shallow(remote, 
-													  s3_directory_ptr(), true);
-	for(auto iter=cur_root->subdirs_.begin();
-		iter!=cur_root->subdirs_.end();++iter)
-	{
-		ag->schedule(sync_task_ptr(
-							  new list_subdir_task(iter->second, ctx)));
-	}
-	return cur_root;	
+	return schedule_listing(remote, ctx, ag, true);
 }
 
 class publish_file_task : public sync_task,
 		public boost::enable_shared_from_this<publish_file_task>
 {
-	s3_file_ptr fl_;
+	s3_path path_;
 	context_ptr ctx_;
 	size_t *result_;
 	const stringvec &included_;
 	const stringvec &excluded_;	
 public:
-	publish_file_task(s3_file_ptr fl, context_ptr ctx, size_t *result,
+	publish_file_task(const s3_path &path, context_ptr ctx, size_t *result,
 					  const stringvec &included, const stringvec &excluded) :
-		fl_(fl), ctx_(ctx), result_(result), 
+		path_(path), ctx_(ctx), result_(result), 
 		included_(included), excluded_(excluded) {}
 
 	virtual void print_to(std::ostream &str)
 	{
-		str << "Publish file " << fl_;
+		str << "Publish file " << path_;
 	}
 
 	virtual task_type_e get_class() const { return taskUnbound; }
 
 	virtual void operator()(agenda_ptr agenda)
 	{
-		if (!check_included(fl_->absolute_name_.path_, included_, excluded_))
+		if (!check_included(path_.path_, included_, excluded_))
 			return;
 		
 		s3_connection conn(ctx_);
-		conn.set_acl(fl_->absolute_name_, "public-read");
+		conn.set_acl(path_, "public-read");
 		//We don't care about signedness - it's informational data only, anyway
 		boost::detail::atomic_increment((int*)result_);
 	}
@@ -536,15 +1017,14 @@ public:
 	virtual void operator()(agenda_ptr agenda)
 	{
 		s3_connection conn(ctx_);
-		conn.list_files_shallow(dir_->absolute_name_, dir_, false);
-		for(auto iter=dir_->files_.begin(); iter!=dir_->files_.end();++iter)
+		conn.list_files_shallow(dir_->path(), dir_, false);
+		for(size_t f=0; f<dir_->files_.size();++f)
 			agenda->schedule(sync_task_ptr(
-								  new publish_file_task(iter->second, ctx_, result_, included_, excluded_)));
-		for(auto iter=dir_->subdirs_.begin();
-			iter!=dir_->subdirs_.end();++iter)
+								  new publish_file_task(dir_->file_path(f), ctx_, result_, included_, excluded_)));
+		for(size_t f=0;f<dir_->num_subdirs();++f)
 		{
 			agenda->schedule(sync_task_ptr(
-								  new publish_subdir_task(iter->second, ctx_, result_, included_, excluded_)));
+								  new publish_subdir_task(dir_->subdir(f), ctx_, result_, included_, excluded_)));
 		}
 	}
 };
@@ -555,15 +1035,14 @@ void es3::schedule_recursive_publication(const s3_path &remote,
 {
 	s3_connection conn(ctx);
 	s3_directory_ptr cur_root=conn.list_files_shallow(remote, s3_directory_ptr(), true);
-	for(auto iter=cur_root->files_.begin(); iter!=cur_root->files_.end();++iter)
-		ag->schedule(sync_task_ptr(new publish_file_task(iter->second, ctx, 
+	for(size_t f=0; f<cur_root->files_.size();++f)
+		ag->schedule(sync_task_ptr(new publish_file_task(cur_root->file_path(f), ctx, 
 														 num_files, included, excluded)));
 	
-	for(auto iter=cur_root->subdirs_.begin();
-		iter!=cur_root->subdirs_.end();++iter)
+	for(size_t f=0;f<cur_root->num_subdirs();++f)
 	{
 		ag->schedule(sync_task_ptr(
-						   new publish_subdir_task(iter->second, ctx, 
+						   new publish_subdir_task(cur_root->subdir(f), ctx, 
 												   num_files, included, excluded)));
 	}
 }
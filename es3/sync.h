@@ -7,10 +7,9 @@
 #include <stdint.h>
 
 namespace es3 {
-	struct local_file;
 	struct local_dir;
-	typedef boost::shared_ptr<local_file> local_file_ptr;
 	typedef boost::shared_ptr<local_dir> local_dir_ptr;
+	class sync_dir_task;
 
 	class synchronizer
 	{
@@ -21,20 +20,48 @@ namespace es3 {
 		bool do_upload_;
 		bool delete_missing_;
 		stringvec included_, excluded_;
+		//Directories are listed and compared pair by pair while the
+		//transfers are already running
+		bool streaming_;
+
+		mutex_t m_; //This mutex protects the following data {
+		//Keys waiting for a batch delete, by bucket
+		std::map<std::string, std::vector<s3_path> > pending_deletes_;
+		//}
+		//Directories that are not processed yet, the last one flushes
+		//the pending deletes
+		std::atomic<size_t> dirs_in_flight_;
 	public:
 		synchronizer(agenda_ptr agenda, const context_ptr &ctx,
 					 std::vector<s3_path> remote, stringvec local,
 					 bool do_upload, bool delete_missing,
-					 const stringvec &included, const stringvec &excluded);
+					 const stringvec &included, const stringvec &excluded,
+					 bool streaming=false);
 		bool create_schedule(bool check_mode, bool delete_mode, 
 							 bool non_recursive_delete);
+		/**
+		  Schedules the deletes that are still waiting for a full batch.
+		  Returns false if there were none. Needed after the agenda run
+		  if a directory failed and so the last one never finished.
+		  */
+		bool flush_deletes();
 	private:
 		void process_upload(local_dir_ptr locals, s3_directory_ptr remotes,
 							const s3_path &remote_path, bool check_mode);
 		void process_downloads(s3_directory_ptr remotes, local_dir_ptr locals,
 							   const bf::path &local_path, bool check_mode);
 
+		void descend_upload(local_dir_ptr locals, s3_directory_ptr remotes,
+							const s3_path &remote_path, bool check_mode);
+		void descend_downloads(s3_directory_ptr remotes, local_dir_ptr locals,
+							   const bf::path &local_path, bool check_mode);
+
 		void delete_possibly_recursive(s3_directory_ptr dir, bool non_recursive);
+		void delete_remote_dir(s3_directory_ptr dir);
+		void delete_remote_file(const s3_path &path);
+		void finish_dir();
+
+		friend class sync_dir_task;
 	};
 
 	s3_directory_ptr schedule_recursive_walk(const s3_path &remote, 
@@ -0,0 +1,354 @@
+#include "transfer.h"
+#include <curl/curl.h>
+#include "errors.h"
+#include <time.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+
+#ifdef __MACH__
+#include <sys/time.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+using namespace es3;
+
+#define MAX_EVENTS 256
+#define IDLE_WAIT_MS 1000
+
+static uint64_t monotonic_millis()
+{
+#ifdef __MACH__
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return uint64_t(tv.tv_sec)*1000+tv.tv_usec/1000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec)*1000+ts.tv_nsec/1000000;
+#endif
+}
+
+namespace es3
+{
+	struct transfer_request
+	{
+		curl_ptr_t curl_;
+		transfer_callback_t on_done_;
+	};
+
+	struct transfer_loop
+	{
+		CURLM *multi_;
+		int epoll_fd_, wake_fd_;
+		int64_t deadline_; //Timer requested by curl, -1 if none
+		bool stop_;
+
+		mutex_t m_; //This mutex protects the following data {
+		std::vector<transfer_request> pending_;
+		//}
+
+		//Only touched by the loop thread
+		std::map<CURL*, transfer_request> active_;
+		boost::shared_ptr<boost::thread> thread_;
+
+		transfer_loop() : multi_(), epoll_fd_(-1), wake_fd_(-1),
+			deadline_(-1), stop_() {}
+
+		void start(size_t max_connections, size_t max_streams);
+		void stop();
+		void add(const transfer_request &req);
+		void run();
+
+	private:
+		void wakeup();
+		void add_pending();
+		void socket_action(curl_socket_t sock, int flags);
+		void finish_completed();
+
+		static int on_socket(CURL *easy, curl_socket_t s, int what,
+							 void *userp, void *socketp);
+		static int on_timer(CURLM *multi, long timeout_ms, void *userp);
+	};
+}; //namespace es3
+
+void transfer_loop::start(size_t max_connections, size_t max_streams)
+{
+	multi_=curl_multi_init();
+	if (!multi_)
+		err(errFatal) << "can't init CURL multi handle";
+	//Transfers above the limit are queued by CURL itself
+	if (max_connections)
+		curl_multi_setopt(multi_, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+						  long(max_connections));
+	if (max_streams)
+	{
+		curl_multi_setopt(multi_, CURLMOPT_PIPELINING, long(CURLPIPE_MULTIPLEX));
+		curl_multi_setopt(multi_, CURLMOPT_MAX_CONCURRENT_STREAMS,
+						  long(max_streams));
+		curl_multi_setopt(multi_, CURLMOPT_MAX_HOST_CONNECTIONS,
+						  long(max_connections/max_streams+1));
+	} else
+		curl_multi_setopt(multi_, CURLMOPT_PIPELINING, long(CURLPIPE_NOTHING));
+#ifdef __linux__
+	epoll_fd_=epoll_create1(EPOLL_CLOEXEC) | libc_die2("Can't create epoll");
+	wake_fd_=eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)
+			| libc_die2("Can't create eventfd");
+	struct epoll_event ev={};
+	ev.events=EPOLLIN;
+	ev.data.fd=wake_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev)
+			| libc_die2("Can't register eventfd");
+
+	curl_multi_setopt(multi_, CURLMOPT_SOCKETFUNCTION, &on_socket);
+	curl_multi_setopt(multi_, CURLMOPT_SOCKETDATA, this);
+	curl_multi_setopt(multi_, CURLMOPT_TIMERFUNCTION, &on_timer);
+	curl_multi_setopt(multi_, CURLMOPT_TIMERDATA, this);
+#endif
+	thread_.reset(new boost::thread(boost::bind(&transfer_loop::run, this)));
+}
+
+void transfer_loop::stop()
+{
+	if (!thread_)
+		return;
+	{
+		guard_t lock(m_);
+		stop_=true;
+	}
+	wakeup();
+	thread_->join();
+	thread_.reset();
+
+	//Whatever is left is cancelled
+	for(auto iter=active_.begin();iter!=active_.end();++iter)
+	{
+		curl_multi_remove_handle(multi_, iter->first);
+		iter->second.on_done_(CURLE_ABORTED_BY_CALLBACK);
+	}
+	active_.clear();
+	for(auto iter=pending_.begin();iter!=pending_.end();++iter)
+		iter->on_done_(CURLE_ABORTED_BY_CALLBACK);
+	pending_.clear();
+
+	curl_multi_cleanup(multi_);
+#ifdef __linux__
+	close(wake_fd_);
+	close(epoll_fd_);
+#endif
+}
+
+void transfer_loop::add(const transfer_request &req)
+{
+	{
+		guard_t lock(m_);
+		pending_.push_back(req);
+	}
+	wakeup();
+}
+
+void transfer_loop::wakeup()
+{
+#ifdef __linux__
+	uint64_t one=1;
+	write(wake_fd_, &one, sizeof(one));
+#endif
+}
+
+void transfer_loop::add_pending()
+{
+	std::vector<transfer_request> cur;
+	{
+		guard_t lock(m_);
+		cur.swap(pending_);
+	}
+
+	for(auto iter=cur.begin();iter!=cur.end();++iter)
+	{
+		CURL *easy=iter->curl_.get();
+		int res=curl_multi_add_handle(multi_, easy);
+		if (res!=CURLM_OK)
+		{
+			iter->on_done_(CURLE_FAILED_INIT);
+			continue;
+		}
+		active_[easy]=*iter;
+	}
+}
+
+int transfer_loop::on_socket(CURL *, curl_socket_t s, int what,
+							 void *userp, void *)
+{
+#ifdef __linux__
+	transfer_loop *loop=reinterpret_cast<transfer_loop*>(userp);
+	if (what==CURL_POLL_REMOVE)
+	{
+		epoll_ctl(loop->epoll_fd_, EPOLL_CTL_DEL, s, NULL);
+		return 0;
+	}
+
+	struct epoll_event ev={};
+	ev.data.fd=s;
+	if (what & CURL_POLL_IN)
+		ev.events|=EPOLLIN;
+	if (what & CURL_POLL_OUT)
+		ev.events|=EPOLLOUT;
+	if (epoll_ctl(loop->epoll_fd_, EPOLL_CTL_MOD, s, &ev)!=0)
+		epoll_ctl(loop->epoll_fd_, EPOLL_CTL_ADD, s, &ev);
+#endif
+	return 0;
+}
+
+int transfer_loop::on_timer(CURLM *, long timeout_ms, void *userp)
+{
+	transfer_loop *loop=reinterpret_cast<transfer_loop*>(userp);
+	if (timeout_ms<0)
+		loop->deadline_=-1;
+	else
+		loop->deadline_=monotonic_millis()+timeout_ms;
+	return 0;
+}
+
+void transfer_loop::socket_action(curl_socket_t sock, int flags)
+{
+	int running=0;
+	curl_multi_socket_action(multi_, sock, flags, &running);
+}
+
+void transfer_loop::finish_completed()
+{
+	int msgs_left=0;
+	while(CURLMsg *msg=curl_multi_info_read(multi_, &msgs_left))
+	{
+		if (msg->msg!=CURLMSG_DONE)
+			continue;
+		CURL *easy=msg->easy_handle;
+		int code=msg->data.result;
+		curl_multi_remove_handle(multi_, easy);
+
+		auto iter=active_.find(easy);
+		assert(iter!=active_.end());
+		transfer_request req=iter->second;
+		active_.erase(iter);
+		//Note, the callback might well release the last reference to
+		//the CURL handle
+		req.on_done_(code);
+	}
+}
+
+void transfer_loop::run()
+{
+	while(true)
+	{
+		{
+			guard_t lock(m_);
+			if (stop_)
+				break;
+		}
+		add_pending();
+
+#ifdef __linux__
+		int timeout=IDLE_WAIT_MS;
+		if (deadline_>=0)
+		{
+			int64_t left=deadline_-int64_t(monotonic_millis());
+			timeout=left<0 ? 0 : std::min(left, int64_t(IDLE_WAIT_MS));
+		}
+
+		struct epoll_event events[MAX_EVENTS];
+		int num=epoll_wait(epoll_fd_, events, MAX_EVENTS, timeout);
+		if (num<0 && errno!=EINTR)
+			num | libc_die2("epoll_wait failed");
+
+		for(int f=0;f<num;++f)
+		{
+			int fd=events[f].data.fd;
+			if (fd==wake_fd_)
+			{
+				uint64_t val=0;
+				read(wake_fd_, &val, sizeof(val));
+				continue;
+			}
+
+			int flags=0;
+			if (events[f].events & EPOLLIN)
+				flags|=CURL_CSELECT_IN;
+			if (events[f].events & EPOLLOUT)
+				flags|=CURL_CSELECT_OUT;
+			if (events[f].events & (EPOLLERR|EPOLLHUP))
+				flags|=CURL_CSELECT_ERR;
+			socket_action(fd, flags);
+		}
+
+		if (deadline_>=0 && int64_t(monotonic_millis())>=deadline_)
+		{
+			deadline_=-1;
+			socket_action(CURL_SOCKET_TIMEOUT, 0);
+		}
+#else
+		//No epoll here, let curl do the polling
+		int running=0, numfds=0;
+		curl_multi_perform(multi_, &running);
+		curl_multi_wait(multi_, NULL, 0, 50, &numfds);
+#endif
+		finish_completed();
+	}
+}
+
+transfer_engine::transfer_engine(size_t num_loops, size_t max_connections,
+								 size_t max_streams)
+	: num_loops_(num_loops==0 ? 1 : num_loops), next_loop_(0)
+{
+	loops_.reset(new transfer_loop[num_loops_]);
+	for(size_t f=0;f<num_loops_;++f)
+		loops_[f].start(max_connections/num_loops_+1, max_streams);
+}
+
+transfer_engine::~transfer_engine()
+{
+	for(size_t f=0;f<num_loops_;++f)
+		loops_[f].stop();
+}
+
+void transfer_engine::submit(curl_ptr_t curl, transfer_callback_t on_done)
+{
+	transfer_request req;
+	req.curl_=curl;
+	req.on_done_=on_done;
+	loops_[(next_loop_++)%num_loops_].add(req);
+}
+
+namespace es3
+{
+	struct transfer_waiter
+	{
+		mutex_t m_;
+		boost::condition_variable cond_;
+		bool done_;
+		int code_;
+
+		transfer_waiter() : done_(), code_() {}
+
+		void on_done(int code)
+		{
+			guard_t lock(m_);
+			code_=code;
+			done_=true;
+			cond_.notify_all();
+		}
+	};
+}; //namespace es3
+
+int transfer_engine::perform(curl_ptr_t curl)
+{
+	transfer_waiter waiter;
+	submit(curl, boost::bind(&transfer_waiter::on_done, &waiter, _1));
+
+	u_guard_t lock(waiter.m_);
+	while(!waiter.done_)
+		waiter.cond_.wait(lock);
+	return waiter.code_;
+}
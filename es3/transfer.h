@@ -0,0 +1,60 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include "common.h"
+#include "context.h"
+#include <boost/function.hpp>
+#include <boost/scoped_array.hpp>
+#include <atomic>
+
+namespace es3 {
+	struct transfer_loop;
+
+	//Receives the CURLcode of the finished transfer
+	typedef boost::function<void(int)> transfer_callback_t;
+
+	/**
+	  Event-driven transfer engine. A few event loop threads drive
+	  any number of concurrent requests through curl_multi. Only the
+	  requests that are submitted with a callback don't need an OS
+	  thread of their own: the HEADs of the listing, the batched
+	  small-file uploads and the parts of the uploads and downloads.
+	  The short control requests (listing pages, initiating and
+	  completing multipart uploads, single PUTs) go through perform(),
+	  which still holds the agenda thread.
+	  */
+	class transfer_engine
+	{
+		size_t num_loops_;
+		boost::scoped_array<transfer_loop> loops_;
+		std::atomic<size_t> next_loop_;
+	public:
+		/**
+		  If max_streams is not zero then the requests to a host are
+		  multiplexed as HTTP/2 streams over a few connections, with up
+		  to max_streams streams on each of them.
+		  */
+		transfer_engine(size_t num_loops, size_t max_connections,
+						size_t max_streams=0);
+		~transfer_engine();
+
+		/**
+		  Start the transfer of a prepared CURL handle. The callback is
+		  invoked from the event loop thread, so it must not block.
+		  */
+		void submit(curl_ptr_t curl, transfer_callback_t on_done);
+
+		/**
+		  Run the transfer and wait for its completion. Behaves just
+		  like curl_easy_perform and blocks the calling thread, but the
+		  connection is shared with the asynchronous requests.
+		  */
+		int perform(curl_ptr_t curl);
+
+	private:
+		transfer_engine(const transfer_engine &);
+	};
+
+}; //namespace es3
+
+#endif //TRANSFER_H
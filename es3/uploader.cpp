@@ -12,39 +12,151 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <atomic>
 #include "compressor.h"
 #include "mimes.h"
+#include "state_db.h"
+#include "journal.h"
 
 #define MIN_PART_SIZE (16*1024*1024)
 #define MIN_ALLOWED_PART_SIZE (16*1024*1024)
 #define MAX_PART_NUM 10000
+//S3 doesn't accept larger parts
+#define MAX_PART_SIZE (5ULL*1024*1024*1024)
+//Parts are rounded up to this
+#define PART_SIZE_STEP (1024*1024)
+//A part should keep its connection busy for at least this long, so
+//that the per-request latency doesn't matter
+#define TARGET_PART_SECONDS 4
+//Parts smaller than this are not used to measure the throughput
+#define MIN_SAMPLE_SIZE (1024*1024)
+//Files that would fit into one part are sent with a single PUT
+#define SIMPLE_UPLOAD_THRESHOLD MIN_PART_SIZE
 
 using namespace es3;
 
+static double monotonic_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+/**
+  Picks the part size of each multipart upload. Parts start at the
+  segment size and grow with the throughput of a single connection
+  measured on the previous parts, but they're kept small enough to
+  spread the file over all the connections. The part limit always
+  wins, so files up to the S3 maximum can be uploaded.
+  */
+class part_planner
+{
+	mutex_t m_; //This mutex protects the following data {
+	double throughput_; //Bytes per second of one connection, smoothed
+	//}
+public:
+	part_planner() : throughput_() {}
+
+	void add_sample(uint64_t bytes, double seconds)
+	{
+		if (bytes<MIN_SAMPLE_SIZE || seconds<=0)
+			return;
+		guard_t lock(m_);
+		double cur=bytes/seconds;
+		throughput_=throughput_==0 ? cur : throughput_*0.8+cur*0.2;
+	}
+
+	uint64_t plan(uint64_t size, size_t segment_size, size_t connections)
+	{
+		double throughput;
+		{
+			guard_t lock(m_);
+			throughput=throughput_;
+		}
+
+		uint64_t res=std::max(uint64_t(segment_size),
+							  uint64_t(throughput*TARGET_PART_SECONDS));
+		uint64_t spread=size/std::max(connections, size_t(1));
+		res=std::min(res, std::max(spread, uint64_t(segment_size)));
+		res=std::max(res, (size+MAX_PART_NUM-1)/MAX_PART_NUM);
+		res=(res+PART_SIZE_STEP-1)/PART_SIZE_STEP*PART_SIZE_STEP;
+		return std::min(res, uint64_t(MAX_PART_SIZE));
+	}
+};
+static part_planner planner;
+
 struct es3::upload_content
 {
-	upload_content() : num_parts_(), num_completed_() {}
+	upload_content() : journaled_(), num_parts_(), num_completed_(),
+		all_parts_known_() {}
 
 	context_ptr conn_;
 	std::string upload_id_;
+	bool journaled_; //The upload can be resumed by the next run
 	s3_path remote_;
+	bf::path local_;
 
 	mutex_t lock_;
 	size_t num_parts_;
 	size_t num_completed_;
+	//Compressed files learn their number of parts only at the end
+	bool all_parts_known_;
 	std::vector<std::string> etags_;
+	sync_state state_; //The remote size is summed up by the parts
+
+	//Must be called with the lock held
+	void complete_if_done(agenda_ptr ag)
+	{
+		if (!all_parts_known_ || num_completed_!=num_parts_)
+			return;
+		VLOG(2) << "Assembling "<< remote_ <<".";
+		//We've completed the upload!
+		s3_connection up(conn_);
+		state_.etag_=up.complete_multipart(remote_, upload_id_, etags_);
+		if (journaled_)
+			conn_->journal_->finish(upload_id_);
+		if (conn_->state_db_)
+			conn_->state_db_->record(local_, remote_, state_);
+		ag->add_stat_counter("files_uploaded", 1);
+	}
 };
 
-class part_upload_task : public sync_task
+static std::atomic<size_t> async_file_parts(0);
+
+/**
+  Uploads a part of a multipart upload. With the transfer engine the
+  request doesn't hold the worker: the task is scheduled again from the
+  completion callback to record the part, or to retry it.
+  */
+class part_upload_task : public sync_task,
+		public boost::enable_shared_from_this<part_upload_task>
 {
 	size_t num_;
 	upload_content_ptr content_;
 
 	segment_ptr segment_;
+	//The part is read directly from this file if there's no segment
+	bf::path file_;
+	uint64_t offset_, size_;
+
+	size_t attempt_;
+	//Set once the part is on the server
+	std::string etag_;
+	double elapsed_;
+	//Kept open while the part is in the transfer engine
+	boost::scoped_ptr<handle_t> handle_;
 public:
 	part_upload_task(size_t num, upload_content_ptr content,
 					 segment_ptr segment)
-		: num_(num), content_(content), segment_(segment)
+		: num_(num), content_(content), segment_(segment), offset_(), size_(),
+		  attempt_(), elapsed_()
+	{
+	}
+	part_upload_task(size_t num, upload_content_ptr content,
+					 const bf::path &file, uint64_t offset, uint64_t size)
+		: num_(num), content_(content), file_(file),
+		  offset_(offset), size_(size), attempt_(), elapsed_()
 	{
 	}
 
@@ -55,42 +167,126 @@ public:
 
 	virtual void operator()(agenda_ptr agenda)
 	{
+		if (!etag_.empty())
+		{
+			part_uploaded(agenda);
+			return;
+		}
+		if (attempt_)
+			sleep(TASK_RETRY_DELAY); //Retried after an asynchronous failure
+
 		VLOG(2) << "Starting upload of a part " << num_ << " of "
 				<< content_->remote_;
 
-		struct sched_param param;
-		param.sched_priority = 1+num_*90/content_->num_parts_;
-		pthread_setschedparam(pthread_self(), SCHED_RR, &param);
-
 		s3_path part_path=content_->remote_;
 		part_path.path_+="?partNumber="+int_to_string(num_+1)
 				+"&uploadId="+content_->upload_id_;
+		if (content_->conn_->engine_ && start_async(agenda, part_path))
+			return;
+
+		struct sched_param param;
+		param.sched_priority = 1+num_*90/
+				std::max(content_->num_parts_, num_+1);
+		pthread_setschedparam(pthread_self(), SCHED_RR, &param);
 
 		s3_connection up(content_->conn_);
-		std::string etag=up.upload_data(part_path,
-										&segment_->data_[0],
-										segment_->data_.size());
-		assert(!etag.empty());
-		agenda->add_stat_counter("uploaded", segment_->data_.size());
+		double start=monotonic_seconds();
+		if (segment_)
+			etag_=up.upload_data(part_path, &segment_->data_[0],
+								 segment_->data_.size());
+		else
+		{
+			handle_t fl(open(file_.c_str(), O_RDONLY)
+						| libc_die2("Failed to open "+file_.string()));
+			etag_=up.upload_file(part_path, fl.get(), offset_,
+								 safe_cast<size_t>(size_));
+		}
+		elapsed_=monotonic_seconds()-start;
+		part_uploaded(agenda);
+	}
+
+private:
+	bool start_async(agenda_ptr agenda, const s3_path &part_path)
+	{
+		if (!segment_ && ++async_file_parts>MAX_ASYNC_FILE_PARTS)
+		{
+			async_file_parts--;
+			return false;
+		}
+
+		agenda->begin_async();
+		try
+		{
+			upload_callback_t on_done=boost::bind(
+				&part_upload_task::on_uploaded, shared_from_this(), agenda,
+				monotonic_seconds(), _1, _2);
+			if (segment_)
+				s3_connection::upload_data_async(content_->conn_, part_path,
+					&segment_->data_[0], segment_->data_.size(),
+					header_map_t(), on_done);
+			else
+			{
+				handle_.reset(new handle_t(open(file_.c_str(), O_RDONLY)
+							  | libc_die2("Failed to open "+file_.string())));
+				s3_connection::upload_file_async(content_->conn_, part_path,
+					handle_->get(), offset_, safe_cast<size_t>(size_),
+					header_map_t(), on_done);
+			}
+		} catch(...)
+		{
+			release_file();
+			agenda->end_async(shared_from_this(), sok, attempt_);
+			throw;
+		}
+		return true;
+	}
+
+	//Called from the transfer engine, must not block
+	void on_uploaded(agenda_ptr agenda, double start,
+					 const std::string &etag, const result_code_t &res)
+	{
+		release_file();
+		size_t attempt=attempt_++;
+		if (res.ok())
+		{
+			etag_=etag;
+			elapsed_=monotonic_seconds()-start;
+			agenda->schedule(shared_from_this());
+		}
+		agenda->end_async(shared_from_this(), res, attempt);
+	}
+
+	void release_file()
+	{
+		if (segment_)
+			return;
+		handle_.reset();
+		async_file_parts--;
+	}
+
+	void part_uploaded(agenda_ptr agenda)
+	{
+		assert(!etag_.empty());
+		uint64_t uploaded=segment_ ? segment_->data_.size() : size_;
+		if (!segment_)
+			agenda->add_stat_counter("read", uploaded);
+		agenda->add_stat_counter("uploaded", uploaded);
+		planner.add_sample(uploaded, elapsed_);
+		if (content_->journaled_)
+			content_->conn_->journal_->part_done(content_->upload_id_,
+												 num_, etag_);
 
 		//Check if the upload is completed
 		guard_t g(content_->lock_);
 		content_->num_completed_++;
-		content_->etags_.at(num_) = etag;
+		content_->etags_.at(num_) = etag_;
+		content_->state_.remote_size_+=uploaded;
 
 		VLOG(2) << "Uploaded part " << num_ << " of "<< content_->remote_
-				<< " with etag=" << etag
+				<< " with etag=" << etag_
 				<< ", total=" << content_->num_parts_
 				<< ", sent=" << content_->num_completed_ << ".";
-
-		if (content_->num_completed_ == content_->num_parts_)
-		{
-			VLOG(2) << "Assembling "<< content_->remote_ <<".";
-			//We've completed the upload!
-			s3_connection up2(content_->conn_);
-			up2.complete_multipart(content_->remote_, content_->upload_id_,
-								   content_->etags_);
-		}
+		content_->complete_if_done(agenda);
 	}
 };
 
@@ -100,14 +296,11 @@ class file_pump : public sync_task,
 	upload_content_ptr content_;
 	files_ptr files_;
 	size_t cur_segment_, number_of_segments_;
-	bool update_log_;
 public:
 	file_pump(upload_content_ptr content,
-		files_ptr files, size_t cur_segment, size_t number_of_segments,
-		bool update_log) :
+		files_ptr files, size_t cur_segment, size_t number_of_segments) :
 		content_(content), files_(files),
-		cur_segment_(cur_segment), number_of_segments_(number_of_segments),
-		update_log_(update_log)
+		cur_segment_(cur_segment), number_of_segments_(number_of_segments)
 	{
 	}
 
@@ -149,7 +342,7 @@ public:
 		for(int f=0;f<number_of_segments_;++f)
 		{
 			segment_ptr seg = segments.at(f);
-			seg->data_.resize(segment_size, 0);
+			seg->data_.resize(segment_size);
 
 			uint64_t segment_read_so_far=0;
 			while(segment_read_so_far<seg->data_.size())
@@ -166,13 +359,14 @@ public:
 								 cur_piece_size-offset_within_);
 				while(remaining_size>0)
 				{
-					char buf[65536*8];
-					//No overflow is possible since sizeof(buf)<MAX_SIZE_T.
-					size_t chunk=std::min(remaining_size,
-										  uint64_t(sizeof(buf)));
-					size_t res=read(cur_fl.get(), buf, chunk) | libc_die;
+					//Read directly into the segment, no bounce buffer is
+					//needed. No overflow is possible since the chunk is
+					//less than the segment size.
+					size_t chunk=safe_cast<size_t>(remaining_size);
+					size_t res=read(cur_fl.get(),
+									&seg->data_[segment_read_so_far],
+									chunk) | libc_die;
 					assert(res!=0);
-					memcpy(&seg->data_[segment_read_so_far], buf, res);
 
 					segment_read_so_far+=res;
 					offset_within_+=res;
@@ -199,8 +393,7 @@ public:
 			assert(segment_read_so_far==segment_size
 				   || f==number_of_segments_-1);
 
-			if (update_log_)
-				agenda->add_stat_counter("read", seg->data_.size());
+			agenda->add_stat_counter("read", seg->data_.size());
 			sync_task_ptr task(new part_upload_task(cur_segment_+f,
 													content_, seg));
 			agenda->schedule(task);
@@ -208,76 +401,259 @@ public:
 	}
 };
 
-void file_uploader::operator()(agenda_ptr agenda)
+/**
+  Checks the remote file against the local one. If they are the same
+  then the file is remembered, so that the next sync doesn't HEAD it.
+  */
+static bool is_up_to_date(const context_ptr &conn, const bf::path &path,
+						  const s3_path &remote, const local_stat &st,
+						  const file_desc &mod)
+{
+	//We don't check file mode here, because it doesn't really work
+	//on Windows - we'll get permission loops.
+	if (!mod.mtime_ || mod.mtime_!=st.mtime_ || mod.raw_size_!=st.size_)
+		return false;
+	if (conn->state_db_)
+	{
+		sync_state state;
+		state.mtime_=st.mtime_;
+		state.size_=st.size_;
+		state.remote_size_=mod.remote_size_;
+		state.etag_=mod.etag_;
+		conn->state_db_->record(path, remote, state);
+	}
+	return true;
+}
+
+static header_map_t upload_headers(const context_ptr &conn,
+								   const bf::path &path,
+								   const local_stat &st, bool compressed)
 {
-	uint64_t file_sz=file_size(path_);
-	time_t mtime=last_write_time(path_);
+	header_map_t hmap;
+	hmap["x-amz-meta-compressed"] = compressed ? "true" : "false";
+	//hmap["Content-Type"] = "application/x-binary";
+	hmap["Content-Type"] = find_mime(path.extension().c_str());
+	if (compressed)
+	{
+		hmap["x-amz-meta-codec"] = codec_name(conn->codec_);
+		//Other codecs are not understood by HTTP clients
+		if (conn->codec_==codecGzip)
+			hmap["Content-Encoding"] = "gzip";
+	}
+	hmap["x-amz-meta-last-modified"] = int_to_string(st.mtime_);
+	hmap["x-amz-meta-size"] = int_to_string(st.size_);
+	hmap["x-amz-meta-file-mode"] = int_to_string(st.mode_ & 0777);
+	return hmap;
+}
 
-	struct stat stbuf={0};
-	::stat(path_.c_str(), &stbuf) | libc_die;
-	mode_t mode=stbuf.st_mode & 0777; //Get permissions
+void file_uploader::operator()(agenda_ptr agenda)
+{
+	//The scanner has usually stat-ed the file already
+	local_stat st=stat_;
+	if (!st.mtime_)
+	{
+		struct stat stbuf={0};
+		::stat(path_.c_str(), &stbuf) | libc_die;
+		st.size_=stbuf.st_size;
+		st.mtime_=stbuf.st_mtime;
+		st.mode_=stbuf.st_mode;
+	}
+	uint64_t file_sz=st.size_;
+	time_t mtime=st.mtime_;
 
 	//Check the modification date of the file locally and on the
 	//remote side
-	s3_connection up(conn_);
-	file_desc mod=up.find_mtime_and_size(remote_);
-	if(mod.mtime_)
+	if (!known_changed_)
 	{
-		if (mod.mtime_==mtime && mod.raw_size_==file_sz)
+		s3_connection up(conn_);
+		if (is_up_to_date(conn_, path_, remote_, st,
+						  up.find_mtime_and_size(remote_)))
 			return; //TODO: add an optional MD5 check?
 	}
-	//We don't check file mode here, because it doesn't really work
-	//on Windows - we'll get permission loops.
 
 	//Woohoo! We need to upload the file.
 	upload_content_ptr up_data(new upload_content());
 	up_data->conn_ = conn_;
 	up_data->remote_ = remote_;
+	up_data->local_ = path_;
+	up_data->state_.mtime_ = mtime;
+	up_data->state_.size_ = file_sz;
 
 	VLOG(2) << "Starting upload of " << path_ << " as "
 			  << remote_;
 
+	//Compressed parts are segments, too many of them would be needed for
+	//a huge file (with a margin, the data might not shrink at all)
 	bool do_compress = should_compress(path_, file_sz) &&
-			conn_->do_compression_;
+			conn_->do_compression_ &&
+			file_sz/9*10 < uint64_t(agenda->segment_size())*MAX_PART_NUM;
 	//Prepare upload
-	header_map_t hmap;
-	hmap["x-amz-meta-compressed"] = do_compress ? "true" : "false";
-	//hmap["Content-Type"] = "application/x-binary";
-	hmap["Content-Type"] = find_mime(path_.extension().c_str());
-	if (do_compress)
-		hmap["Content-Encoding"] = "gzip";
-	hmap["x-amz-meta-last-modified"] = int_to_string(mtime);
-	hmap["x-amz-meta-size"] = int_to_string(file_sz);
-	hmap["x-amz-meta-file-mode"] = int_to_string(mode);
+	header_map_t hmap=upload_headers(conn_, path_, st, do_compress);
+	if (!do_compress && file_sz<=SIMPLE_UPLOAD_THRESHOLD)
+	{
+		simple_upload(agenda, up_data, hmap);
+		return;
+	}
+
+	if (!do_compress && resume_upload(agenda, up_data))
+		return;
+
 	s3_connection up_prep(conn_);
 	up_data->upload_id_=up_prep.initiate_multipart(remote_, hmap);
 
 	if (do_compress)
 	{
-		files_finished_callback on_finish=boost::bind(
-					&file_uploader::start_upload, shared_from_this(),
-					agenda, up_data, _1, true);
-
-		sync_task_ptr task(new file_compressor(path_, conn_, on_finish));
+		//Parts are uploaded as soon as they are compressed
+		sync_task_ptr task(new file_compressor(path_, conn_, agenda,
+			boost::bind(&file_uploader::on_compressed_part,
+						shared_from_this(), agenda, up_data, _1, _2),
+			boost::bind(&file_uploader::on_compressed,
+						shared_from_this(), agenda, up_data, _1)));
 		agenda->schedule(task);
 	} else
 	{
 		handle_t fl(open(path_.c_str(), O_RDONLY) | libc_die);
 		files_ptr files(new scattered_files(path_, fl.size()));
-		start_upload(agenda, up_data, files, false);
+		start_upload(agenda, up_data, files);
+	}
+}
+
+void file_uploader::simple_upload(agenda_ptr ag, upload_content_ptr content,
+								  const header_map_t &hmap)
+{
+	size_t size=safe_cast<size_t>(content->state_.size_);
+	handle_t fl(open(path_.c_str(), O_RDONLY)
+				| libc_die2("Failed to open "+path_.string()));
+	s3_connection up(conn_);
+	double start=monotonic_seconds();
+	std::string etag=up.upload_file(remote_, fl.get(), 0, size, hmap);
+	planner.add_sample(size, monotonic_seconds()-start);
+	ag->add_stat_counter("read", size);
+	ag->add_stat_counter("uploaded", size);
+	VLOG(2) << "Uploaded " << remote_ << " with a single PUT, etag=" << etag;
+
+	content->state_.remote_size_=size;
+	content->state_.etag_=normalize_etag(etag);
+	if (conn_->state_db_)
+		conn_->state_db_->record(path_, remote_, content->state_);
+	ag->add_stat_counter("files_uploaded", 1);
+}
+
+void file_uploader::on_compressed_part(agenda_ptr ag,
+									   upload_content_ptr content,
+									   size_t num, segment_ptr part)
+{
+	if (num>=MAX_PART_NUM)
+		err(errFatal) << "File "<<remote_ <<" is too big";
+	{
+		guard_t g(content->lock_);
+		if (content->etags_.size()<=num)
+			content->etags_.resize(num+1);
 	}
+	sync_task_ptr task(new part_upload_task(num, content, part));
+	ag->schedule(task);
+}
+
+void file_uploader::on_compressed(agenda_ptr ag,
+								  upload_content_ptr content,
+								  size_t num_parts)
+{
+	guard_t g(content->lock_);
+	content->num_parts_=num_parts;
+	content->all_parts_known_=true;
+	content->complete_if_done(ag);
+}
+
+bool file_uploader::resume_upload(agenda_ptr ag, upload_content_ptr content)
+{
+	journal_entry entry;
+	if (!conn_->journal_ || !conn_->journal_->find(path_, remote_, &entry))
+		return false;
+
+	s3_connection up(conn_);
+	if (entry.mtime_!=content->state_.mtime_ ||
+			entry.size_!=content->state_.size_)
+	{
+		//The file has changed since, the parts are of no use
+		VLOG(1) << "Abandoning the unfinished upload of " << path_;
+		try
+		{
+			up.abort_multipart(remote_, entry.upload_id_);
+		} catch(const es3_exception &ex)
+		{
+			VLOG(1) << "Failed to abort the upload of " << remote_ << ": "
+					<< ex.what();
+		}
+		conn_->journal_->finish(entry.upload_id_);
+		return false;
+	}
+
+	part_map_t uploaded;
+	try
+	{
+		uploaded=up.list_parts(remote_, entry.upload_id_);
+	} catch(const es3_exception &ex)
+	{
+		if (ex.err().desc().find("NoSuchUpload")==std::string::npos)
+			throw;
+		VLOG(1) << "The unfinished upload of " << path_ << " has expired";
+		conn_->journal_->finish(entry.upload_id_);
+		return false;
+	}
+
+	VLOG(1) << "Resuming the upload of " << path_ << ", "
+			<< uploaded.size() << " parts are already uploaded";
+	content->upload_id_=entry.upload_id_;
+	content->journaled_=true;
+	handle_t fl(open(path_.c_str(), O_RDONLY) | libc_die);
+	files_ptr files(new scattered_files(path_, fl.size()));
+	start_upload(ag, content, files, &entry, &uploaded);
+	return true;
+}
+
+/**
+  Checks that the part of a resumed upload is on the server and, if the
+  journal has its ETag, that it's the data that was sent.
+  */
+static bool is_uploaded(const journal_entry &entry,
+						const part_map_t &uploaded, size_t num,
+						uint64_t size, std::string *etag)
+{
+	auto iter=uploaded.find(num+1);
+	if (iter==uploaded.end() || iter->second.size_!=size)
+		return false;
+	auto known=entry.etags_.find(num);
+	if (known!=entry.etags_.end() &&
+			normalize_etag(known->second)!=iter->second.etag_)
+		return false;
+	*etag="\""+iter->second.etag_+"\"";
+	return true;
 }
 
 void file_uploader::start_upload(agenda_ptr ag,
 								 upload_content_ptr content,
 								 files_ptr files,
-								 bool compressed)
+								 const journal_entry *resumed,
+								 const part_map_t *uploaded)
 {
 	uint64_t size = 0;
 	for(int f=0;f<files->sizes_.size();++f)
 		size+=files->sizes_.at(f);
 
-	size_t segment_size = ag->segment_size();
+	uint64_t segment_size = ag->segment_size();
+	//Parts that don't fit into segments are streamed from the file
+	bool zero_copy=conn_->zero_copy_;
+	if (resumed)
+	{
+		//The parts have to line up with the uploaded ones
+		segment_size=resumed->part_size_;
+		zero_copy=true;
+	} else if (zero_copy || size>segment_size*MAX_PART_NUM)
+	{
+		segment_size=planner.plan(size, segment_size,
+								  ag->get_capability(taskUnbound));
+		zero_copy=true;
+	}
 	size_t number_of_segments = safe_cast<size_t>(size/segment_size +
 			((size%segment_size)==0 ? 0:1));
 	if (number_of_segments>MAX_PART_NUM)
@@ -289,8 +665,56 @@ void file_uploader::start_upload(agenda_ptr ag,
 	}
 
 	content->num_parts_ = number_of_segments;
+	content->all_parts_known_ = true;
 	content->etags_.resize(number_of_segments);
 
+	if (!resumed && conn_->journal_)
+	{
+		journal_entry entry;
+		entry.upload_id_=content->upload_id_;
+		entry.mtime_=content->state_.mtime_;
+		entry.size_=size;
+		entry.part_size_=segment_size;
+		conn_->journal_->begin(path_, remote_, entry);
+		content->journaled_=true;
+	}
+
+	if (zero_copy)
+	{
+		//Parts are streamed straight from the file, no segments needed
+		assert(files->files_.size()==1);
+		std::vector<size_t> to_send;
+		{
+			guard_t g(content->lock_);
+			for(size_t f=0;f<number_of_segments;++f)
+			{
+				uint64_t part_size=std::min(segment_size,
+											size-segment_size*f);
+				if (resumed && is_uploaded(*resumed, *uploaded, f,
+										   part_size, &content->etags_[f]))
+				{
+					content->num_completed_++;
+					content->state_.remote_size_+=part_size;
+				} else
+					to_send.push_back(f);
+			}
+			if (to_send.empty())
+				content->complete_if_done(ag);
+		}
+
+		VLOG(2) << "Uploading " << remote_ << " in " << to_send.size()
+				<< " parts of " << segment_size << " bytes";
+		for(auto iter=to_send.begin();iter!=to_send.end();++iter)
+		{
+			uint64_t offset=segment_size*(*iter);
+			uint64_t part_size=std::min(segment_size, size-offset);
+			sync_task_ptr task(new part_upload_task(*iter, content,
+				files->files_.at(0), offset, part_size));
+			ag->schedule(task);
+		}
+		return;
+	}
+
 	//Now create file pumps
 	size_t num_per_pump = number_of_segments /
 			ag->get_capability(taskIOBound) + 1;
@@ -304,15 +728,229 @@ void file_uploader::start_upload(agenda_ptr ag,
 		if (num_cur > num_per_pump)
 			num_cur = num_per_pump;
 
-		sync_task_ptr task(new file_pump(content, files, f, num_cur,
-										 !compressed));
+		sync_task_ptr task(new file_pump(content, files, f, num_cur));
 		ag->schedule(task);
 	}
 }
 
-void remote_file_deleter::operator()(agenda_ptr agenda)
+/**
+  Results of the requests of a small files batch, they're sent in
+  through the callbacks of the transfer engine.
+  */
+struct batch_results
 {
-	VLOG(2) << "Removing " << remote_;
+	mutex_t m_; //This mutex protects the following data {
+	boost::condition_variable cond_;
+	size_t pending_;
+	std::vector<file_desc> descs_;
+	std::vector<std::string> etags_;
+	std::vector<result_code_t> results_;
+	//}
+
+	batch_results(size_t num) : pending_(), descs_(num), etags_(num),
+		results_(num) {}
+
+	void on_head(size_t idx, const file_desc &desc, const result_code_t &res)
+	{
+		guard_t lock(m_);
+		descs_.at(idx)=desc;
+		finish(idx, res);
+	}
+
+	void on_upload(size_t idx, const std::string &etag,
+				   const result_code_t &res)
+	{
+		guard_t lock(m_);
+		etags_.at(idx)=etag;
+		finish(idx, res);
+	}
+
+	void wait()
+	{
+		u_guard_t lock(m_);
+		while(pending_!=0)
+			cond_.wait(lock);
+	}
+private:
+	//Must be called with the lock held
+	void finish(size_t idx, const result_code_t &res)
+	{
+		results_.at(idx)=res;
+		pending_--;
+		cond_.notify_all();
+	}
+};
+
+void small_files_uploader::operator()(agenda_ptr agenda)
+{
+	assert(conn_->engine_);
+	//Read all the files of the batch in one go
+	std::vector<std::string> data(files_.size());
+	uint64_t total_read=0;
+	for(size_t f=0;f<files_.size();++f)
+	{
+		if (done_[f])
+			continue;
+		small_file &file=files_[f];
+		handle_t fl(open(file.path_.c_str(), O_RDONLY)
+					| libc_die2("Failed to open "+file.path_.string()));
+		struct stat stbuf={0};
+		fstat(fl.get(), &stbuf)
+				| libc_die2("Failed to stat "+file.path_.string());
+		file.stat_.size_=stbuf.st_size;
+		file.stat_.mtime_=stbuf.st_mtime;
+		file.stat_.mode_=stbuf.st_mode;
+		if (file.stat_.size_>SMALL_FILE_SIZE)
+		{
+			//Grew since the scan, it gets a task of its own
+			agenda->schedule(sync_task_ptr(new file_uploader(conn_,
+				file.path_, file.remote_, file.known_changed_, file.stat_)));
+			done_[f]=true;
+			continue;
+		}
+
+		std::string &buf=data[f];
+		buf.resize(file.stat_.size_);
+		size_t done=0;
+		while(done<buf.size())
+		{
+			size_t res=pread(fl.get(), &buf[done], buf.size()-done, done)
+					| libc_die2("Failed to read "+file.path_.string());
+			if (res==0)
+				err(errWarn) << "File " << file.path_ << " got truncated";
+			done+=res;
+		}
+		total_read+=done;
+	}
+	agenda->add_stat_counter("read", total_read);
+
+	//HEAD the files that the listing doesn't tell about
+	batch_results results(files_.size());
+	std::vector<size_t> to_check;
+	for(size_t f=0;f<files_.size();++f)
+		if (!done_[f] && !files_[f].known_changed_)
+			to_check.push_back(f);
+	results.pending_=to_check.size();
+	for(auto iter=to_check.begin();iter!=to_check.end();++iter)
+	{
+		try
+		{
+			s3_connection::find_mtime_and_size_async(conn_,
+				files_[*iter].remote_, boost::bind(&batch_results::on_head,
+												   &results, *iter, _1, _2));
+		} catch(const es3_exception &ex)
+		{
+			results.on_head(*iter, file_desc(), ex.err());
+		}
+	}
+	results.wait();
+
+	//Then PUT the changed ones
+	std::vector<size_t> to_upload;
+	for(size_t f=0;f<files_.size();++f)
+	{
+		const small_file &file=files_[f];
+		if (done_[f] || !results.results_[f].ok())
+			continue;
+		if (!file.known_changed_ && is_up_to_date(conn_, file.path_,
+				file.remote_, file.stat_, results.descs_[f]))
+			done_[f]=true;
+		else
+			to_upload.push_back(f);
+	}
+	results.pending_=to_upload.size();
+	for(auto iter=to_upload.begin();iter!=to_upload.end();++iter)
+	{
+		const small_file &file=files_[*iter];
+		header_map_t hmap=upload_headers(conn_, file.path_, file.stat_, false);
+		const std::string &buf=data[*iter];
+		try
+		{
+			s3_connection::upload_data_async(conn_, file.remote_,
+				buf.data(), buf.size(), hmap,
+				boost::bind(&batch_results::on_upload, &results,
+							*iter, _1, _2));
+		} catch(const es3_exception &ex)
+		{
+			results.on_upload(*iter, std::string(), ex.err());
+		}
+	}
+	results.wait();
+
+	for(auto iter=to_upload.begin();iter!=to_upload.end();++iter)
+	{
+		if (!results.results_[*iter].ok())
+			continue;
+		const small_file &file=files_[*iter];
+		done_[*iter]=true;
+		if (conn_->state_db_)
+		{
+			sync_state state;
+			state.mtime_=file.stat_.mtime_;
+			state.size_=file.stat_.size_;
+			state.remote_size_=file.stat_.size_;
+			state.etag_=normalize_etag(results.etags_[*iter]);
+			conn_->state_db_->record(file.path_, file.remote_, state);
+		}
+		agenda->add_stat_counter("uploaded", file.stat_.size_);
+		agenda->add_stat_counter("files_uploaded", 1);
+	}
+
+	//Transient failures are retried, the finished files are not redone
+	size_t num_failed=0;
+	code_e level=errFatal;
+	for(size_t f=0;f<files_.size();++f)
+	{
+		if (done_[f])
+			continue;
+		const result_code_t &res=results.results_[f];
+		VLOG(1) << "Failed to upload " << files_[f].path_ << ": "
+				<< res.desc();
+		if (res.code()!=errFatal)
+			level=errWarn;
+		num_failed++;
+	}
+	if (num_failed)
+		err(level) << "Failed to upload " << num_failed << " files from "
+				   << files_.front().path_.parent_path();
+}
+
+static bool is_transient_error(const std::string &code)
+{
+	return code=="InternalError" || code=="SlowDown" ||
+			code=="ServiceUnavailable" || code=="RequestTimeout" ||
+			code=="OperationAborted";
+}
+
+void remote_batch_deleter::operator()(agenda_ptr agenda)
+{
+	VLOG(2) << "Removing " << remotes_.size() << " keys from "
+			<< remotes_.front().bucket_;
 	s3_connection up(conn_);
-	up.read_fully("DELETE", remote_);
+	std::vector<delete_error> errors=up.delete_objects(remotes_);
+
+	std::vector<s3_path> retry;
+	for(auto iter=errors.begin();iter!=errors.end();++iter)
+	{
+		if (is_transient_error(iter->second))
+			retry.push_back(iter->first);
+		else
+		{
+			VLOG(0) << "Failed to delete " << iter->first << ": "
+					<< iter->second;
+			num_failed_++;
+		}
+	}
+
+	if (!retry.empty())
+	{
+		//The agenda restarts the task with the failed keys only, the
+		//permanent failures are reported once they're done
+		remotes_.swap(retry);
+		err(errWarn) << "Failed to delete " << remotes_.size()
+					 << " keys, retrying (" << num_failed_
+					 << " other keys can't be deleted)";
+	}
+	if (num_failed_)
+		err(errFatal) << "Failed to delete " << num_failed_ << " keys";
 }
@@ -10,6 +10,20 @@ namespace es3 {
 	typedef boost::shared_ptr<upload_content> upload_content_ptr;
 	struct scattered_files;
 	typedef boost::shared_ptr<scattered_files> files_ptr;
+	struct journal_entry;
+
+	/**
+	  What the scanner has found out about a local file. A zero mtime
+	  means that the file hasn't been stat-ed yet.
+	  */
+	struct local_stat
+	{
+		uint64_t size_;
+		time_t mtime_;
+		uint32_t mode_;
+
+		local_stat() : size_(), mtime_(), mode_() {}
+	};
 
 	class file_uploader : public sync_task,
 			public boost::enable_shared_from_this<file_uploader>
@@ -17,13 +31,17 @@ namespace es3 {
 		const context_ptr conn_;
 		const bf::path path_;
 		const s3_path remote_;
-		const bool just_touch_;
+		//The listing already shows that the file differs, skip the HEAD
+		const bool known_changed_;
+		const local_stat stat_;
 	public:
 		file_uploader(const context_ptr &conn,
 					  const bf::path &path,
 					  const s3_path &remote,
-					  bool just_touch=false)
-			: conn_(conn), path_(path), remote_(remote), just_touch_(just_touch)
+					  bool known_changed=false,
+					  const local_stat &stat=local_stat())
+			: conn_(conn), path_(path), remote_(remote),
+			  known_changed_(known_changed), stat_(stat)
 		{
 		}
 
@@ -36,27 +54,80 @@ namespace es3 {
 	private:
 		void start_upload(agenda_ptr ag,
 						  upload_content_ptr content, files_ptr files,
-						  bool compressed);
-		void simple_upload(agenda_ptr ag, upload_content_ptr content);
+						  const journal_entry *resumed=0,
+						  const part_map_t *uploaded=0);
+		//Returns false if there's no unfinished upload to pick up
+		bool resume_upload(agenda_ptr ag, upload_content_ptr content);
+		void on_compressed_part(agenda_ptr ag, upload_content_ptr content,
+								size_t num, segment_ptr part);
+		void on_compressed(agenda_ptr ag, upload_content_ptr content,
+						   size_t num_parts);
+		void simple_upload(agenda_ptr ag, upload_content_ptr content,
+						   const header_map_t &hmap);
 	};
 
-	class remote_file_deleter : public sync_task
+	//Files up to this size are uploaded in batches
+	#define SMALL_FILE_SIZE (64*1024)
+	#define SMALL_BATCH_FILES 64
+
+	struct small_file
+	{
+		bf::path path_;
+		s3_path remote_;
+		bool known_changed_;
+		local_stat stat_;
+	};
+
+	/**
+	  Uploads a batch of small files of one directory. The files are
+	  read in one go and all their requests are in flight at once, so
+	  it needs the transfer engine.
+	  */
+	class small_files_uploader : public sync_task
 	{
 		const context_ptr conn_;
-		const s3_path remote_;
+		std::vector<small_file> files_;
+		std::vector<bool> done_; //Not redone when the task is retried
 	public:
-		remote_file_deleter(const context_ptr &conn, const s3_path &remote)
-			: conn_(conn), remote_(remote)
+		small_files_uploader(const context_ptr &conn,
+							 const std::vector<small_file> &files)
+			: conn_(conn), files_(files), done_(files.size())
 		{
 		}
 
+		//Mostly waits for the network
+		virtual task_type_e get_class() const { return taskUnbound; }
 		virtual void operator()(agenda_ptr agenda);
 		virtual void print_to(std::ostream &str)
 		{
-			str << "Delete " << remote_;
+			str << "Upload " << files_.size() << " files from "
+				<< files_.front().path_.parent_path();
 		}
+	};
 
-	private:
+	/**
+	  Deletes a batch of keys of one bucket with a single request. Keys
+	  that fail with a transient error are retried by themselves.
+	  */
+	class remote_batch_deleter : public sync_task
+	{
+		const context_ptr conn_;
+		std::vector<s3_path> remotes_;
+		size_t num_failed_; //Permanent failures of the earlier attempts
+	public:
+		remote_batch_deleter(const context_ptr &conn,
+							 const std::vector<s3_path> &remotes)
+			: conn_(conn), remotes_(remotes), num_failed_()
+		{
+		}
+
+		virtual task_type_e get_class() const { return taskIOBound; }
+		virtual void operator()(agenda_ptr agenda);
+		virtual void print_to(std::ostream &str)
+		{
+			str << "Delete " << remotes_.size() << " keys from "
+				<< remotes_.front().bucket_;
+		}
 	};
 
 }; //namespace es3